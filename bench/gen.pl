@@ -0,0 +1,79 @@
+#!/usr/bin/env perl
+#
+# prints a large C file for the benchmarks
+# gen.pl <number of functions> [expr]
+#
+# the code stays in the subset accepted by simpleC, with the comments,
+# strings and blanks that dominate real headers
+# with 'expr' the functions are made of long nested expressions instead,
+# to stress the expression parser
+
+use strict;
+use warnings;
+
+my $count = $ARGV[0] // 10000;
+my $mode  = $ARGV[1] // '';
+
+# a small LCG, so that the output is the same on every run
+my $seed = 1;
+sub rnd {
+    my ($n) = @_;
+    $seed = ( $seed * 1103515245 + 12345 ) % 2147483648;
+    return ( $seed >> 16 ) % $n;
+}
+
+# a random expression of the given depth over a, b, v and f0()
+sub expr {
+    my ($depth) = @_;
+    my @leaves = ( 'a', 'b', 'v[1]', '*(v + 2)', '-a', rnd(250), '(int)b' );
+    return $leaves[ rnd( scalar @leaves ) ] if $depth == 0;
+
+    my @ops = ( '+', '-', '*', '/', '<<', '>>', '==', '!=' );
+    my $op  = $ops[ rnd( scalar @ops ) ];
+    my $lhs = expr( $depth - 1 );
+    # the shifts are compiled only by a constant amount
+    my $rhs = $op =~ /<<|>>/ ? rnd(8) : expr( $depth - 1 );
+    my $form = rnd(8);
+    return "f0($lhs, $rhs)" if $form == 0;
+    return "($lhs $op $rhs)" if $form < 4 || $op =~ /<<|>>/;
+    return "$lhs $op $rhs";
+}
+
+if ( $mode eq 'expr' ) {
+    print "int f0(int a, int b) {\n  return a + b;\n}\n\n";
+    for my $i ( 1 .. $count - 1 ) {
+        print "int f$i(int a, int b) {\n";
+        print "  int v[4] = {a, b, a + b, a - b};\n";
+        for ( 0 .. 3 ) {
+            print "  a = " . expr(4) . ";\n";
+        }
+        print "  return a;\n";
+        print "}\n\n";
+    }
+    print "int main() {\n  return f" . ( $count - 1 ) . "(1, 2);\n}\n";
+    exit;
+}
+
+for my $i ( 0 .. $count - 1 ) {
+    print "// function $i, generated for the benchmark\n";
+    print "/* a block comment\n";
+    print " * spanning a few lines\n";
+    print " */\n";
+    print "int f$i(int a, int b) {\n";
+    print "  int x = a + b * 3;\n";
+    print "  char *s = \"a string literal long enough to be worth scanning\";\n";
+    print "  while (x != 0) {\n";
+    print "    x = x - 1;    // decrement\n";
+    print "  }\n";
+    print "\n";
+    print "  if (a == b) {\n";
+    print "    return x;\n";
+    if ( $i > 0 ) {
+        print "  } else {\n";
+        print "    return f" . ( $i - 1 ) . "(x, b);\n";
+    }
+    print "  }\n";
+    print "  return 0;\n";
+    print "}\n\n";
+}
+print "int main() {\n  return f" . ( $count - 1 ) . "(1, 2);\n}\n";
@@ -1,12 +1,12 @@
 #include <assert.h>
 #include <ctype.h>
 #include <errno.h>
-#include <setjmp.h>
 #include <stdarg.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 #define SV_IMPLEMENTATION
 #include "jaris/src/instructions.h"
@@ -23,35 +23,167 @@ char *shiftr_string = "shiftr";
     exit(1);                          \
   } while (0);
 
-#define ALLOCED_MAX 2048 * 2048
-void *alloced[ALLOCED_MAX];
-int alloced_num = 0;
+#define ARENA_BLOCK_MIN (64 * 1024)
+#define ARENA_ALIGN     16
 
-void *alloc(int size) {
-  assert(alloced_num + 1 < ALLOCED_MAX);
-  void *ptr = malloc(size);
-  alloced[alloced_num++] = ptr;
+typedef struct arena_block_t_ {
+  struct arena_block_t_ *next;
+  size_t cap;
+  size_t used;
+  _Alignas(ARENA_ALIGN) char data[];
+} arena_block_t;
+
+typedef struct {
+  arena_block_t *block;
+  int alloc_num;
+  size_t alloc_bytes;
+} arena_t;
+
+typedef enum {
+  R_TOKEN,  // source buffers and token data, live until the output is written
+  R_AST,    // ast nodes, live until compile
+  R_TYPE,   // types, live until compile
+  R_STRING, // temporary strings for dumps and error messages
+  R_COUNT,
+} region_t;
+
+arena_t arenas[R_COUNT] = {0};
+
+void *alloc(region_t region, int size) {
+  assert(region < R_COUNT);
+  assert(size >= 0);
+  arena_t *arena = &arenas[region];
+  size_t aligned = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+  arena_block_t *block = arena->block;
+  if (!block || block->used + aligned > block->cap) {
+    size_t cap = aligned > ARENA_BLOCK_MIN ? aligned : ARENA_BLOCK_MIN;
+    block = malloc(sizeof(arena_block_t) + cap);
+    assert(block);
+    block->next = arena->block;
+    block->cap = cap;
+    block->used = 0;
+    arena->block = block;
+  }
+  void *ptr = block->data + block->used;
+  block->used += aligned;
+  arena->alloc_num++;
+  arena->alloc_bytes += size;
   return ptr;
 }
 
-void free_ptr(void *ptr) {
-  assert(ptr);
-  for (int i = alloced_num - 1; i >= 0; --i) {
-    if (alloced[i] == ptr) {
-      assert(alloced[i] != NULL);
-      free(alloced[i]);
-      memcpy(&alloced[i], &alloced[i + 1], (alloced_num - i) * sizeof(void *));
-      --alloced_num;
-      return;
-    }
+// keeps the newest block around to be reused by the next allocations
+void free_region(region_t region) {
+  assert(region < R_COUNT);
+  arena_t *arena = &arenas[region];
+  if (!arena->block) {
+    return;
   }
+  arena_block_t *block = arena->block->next;
+  while (block) {
+    arena_block_t *next = block->next;
+    free(block);
+    block = next;
+  }
+  arena->block->next = NULL;
+  arena->block->used = 0;
 }
 
+// appends to a heap array that grows by doubling, __item must not contain commas
+#define DA_APPEND(__items, __num, __cap, __item)                       \
+  do {                                                                \
+    if ((__num) >= (__cap)) {                                         \
+      (__cap) = (__cap) ? (__cap) * 2 : 64;                           \
+      (__items) = realloc((__items), (__cap) * sizeof(*(__items)));   \
+      assert(__items);                                                \
+    }                                                                 \
+    (__items)[(__num)++] = (__item);                                  \
+  } while (0)
+
+void type_table_free();
+void ast_stacks_free();
+void interner_free();
+void rules_free();
+void source_files_free();
+void trace_free();
+void remarks_free();
+void exports_free();
 void free_all() {
-  for (int i = 0; i < alloced_num; ++i) {
-    assert(alloced[i] != NULL);
-    free(alloced[i]);
+  for (int i = 0; i < R_COUNT; ++i) {
+    free_region(i);
+    free(arenas[i].block);
+    arenas[i].block = NULL;
+  }
+  type_table_free();
+  ast_stacks_free();
+  interner_free();
+  rules_free();
+  source_files_free();
+  trace_free();
+  remarks_free();
+  exports_free();
+}
+
+typedef struct {
+  sv_t *names; // id -> name
+  int name_num;
+  int name_cap;
+  int *table; // open addressing on the name hash, stores id + 1 (0 is empty)
+  int table_cap;
+} interner_t;
+
+interner_t interner = {0};
+
+uint32_t sv_hash(sv_t sv) {
+  uint32_t hash = 2166136261u;
+  for (unsigned int i = 0; i < sv.len; ++i) {
+    hash = (hash ^ (unsigned char)sv.start[i]) * 16777619u;
+  }
+  return hash;
+}
+
+void interner_grow_table() {
+  int cap = interner.table_cap ? interner.table_cap * 2 : 256;
+  int *table = calloc(cap, sizeof(int));
+  assert(table);
+  for (int id = 0; id < interner.name_num; ++id) {
+    uint32_t i = sv_hash(interner.names[id]) & (cap - 1);
+    while (table[i]) {
+      i = (i + 1) & (cap - 1);
+    }
+    table[i] = id + 1;
+  }
+  free(interner.table);
+  interner.table = table;
+  interner.table_cap = cap;
+}
+
+// returns a dense id that is the same for every sv with the same content
+int intern(sv_t sv) {
+  if (2 * (interner.name_num + 1) > interner.table_cap) {
+    interner_grow_table();
+  }
+  uint32_t i = sv_hash(sv) & (interner.table_cap - 1);
+  while (interner.table[i]) {
+    int id = interner.table[i] - 1;
+    if (sv_eq(interner.names[id], sv)) {
+      return id;
+    }
+    i = (i + 1) & (interner.table_cap - 1);
+  }
+  if (interner.name_num >= interner.name_cap) {
+    interner.name_cap = interner.name_cap ? interner.name_cap * 2 : 256;
+    interner.names = realloc(interner.names, interner.name_cap * sizeof(sv_t));
+    assert(interner.names);
   }
+  interner.names[interner.name_num] = sv;
+  interner.table[i] = interner.name_num + 1;
+  return interner.name_num++;
+}
+
+void interner_free() {
+  free(interner.names);
+  free(interner.table);
+  interner = (interner_t){0};
 }
 
 typedef enum {
@@ -97,23 +229,102 @@ typedef enum {
   T_BREAK,
 } token_kind_t;
 
+// rows and cols are only needed by the diagnostics, so they are computed from
+// the offset with a line index built the first time a file reports something
 typedef struct {
-  char *filename;
-  sv_t line;
-  unsigned int row, col;
-  unsigned int len;
+  uint32_t offset; // in bytes from the start of the file
+  uint16_t file;   // index in source_files
+  uint16_t len;
 } location_t;
 
+typedef struct {
+  char *name;
+  char *buffer;
+  int *line_starts; // offsets of every line, NULL until the first diagnostic
+  int line_num;
+} source_file_t;
+
+source_file_t *source_files = NULL;
+int source_file_num = 0;
+int source_file_cap = 0;
+
+int source_file_add(char *name, char *buffer) {
+  assert(name);
+  assert(buffer);
+  for (int i = 0; i < source_file_num; ++i) {
+    if (source_files[i].buffer == buffer) {
+      return i;
+    }
+  }
+  assert(source_file_num < UINT16_MAX);
+  source_file_t file = {name, buffer, NULL, 0};
+  DA_APPEND(source_files, source_file_num, source_file_cap, file);
+  return source_file_num - 1;
+}
+
+void source_files_free() {
+  for (int i = 0; i < source_file_num; ++i) {
+    free(source_files[i].line_starts);
+  }
+  free(source_files);
+  source_files = NULL;
+  source_file_num = 0;
+  source_file_cap = 0;
+}
+
+// returns the index of the line containing the location
+int location_line(location_t loc) {
+  assert(loc.file < source_file_num);
+  source_file_t *file = &source_files[loc.file];
+  if (!file->line_starts) {
+    int cap = 0;
+    DA_APPEND(file->line_starts, file->line_num, cap, 0);
+    for (char *nl = strchr(file->buffer, '\n'); nl; nl = strchr(nl + 1, '\n')) {
+      int start = nl + 1 - file->buffer;
+      DA_APPEND(file->line_starts, file->line_num, cap, start);
+    }
+  }
+  int lo = 0;
+  int hi = file->line_num - 1;
+  while (lo < hi) {
+    int mid = (lo + hi + 1) / 2;
+    if (file->line_starts[mid] <= (int)loc.offset) {
+      lo = mid;
+    } else {
+      hi = mid - 1;
+    }
+  }
+  return lo;
+}
+
+char *location_filename(location_t loc) {
+  assert(loc.file < source_file_num);
+  return source_files[loc.file].name;
+}
+
+int location_row(location_t loc) {
+  return location_line(loc) + 1;
+}
+
+int location_col(location_t loc) {
+  int line = location_line(loc);
+  return loc.offset - source_files[loc.file].line_starts[line] + 1;
+}
+
+sv_t location_line_image(location_t loc) {
+  int line = location_line(loc);
+  source_file_t *file = &source_files[loc.file];
+  char *start = file->buffer + file->line_starts[line];
+  return (sv_t){start, strcspn(start, "\n")};
+}
+
 #define LOCATION_FMT             "%s:%d:%d"
-#define LOCATION_UNPACK(__loc__) (__loc__).filename, (__loc__).row, (__loc__).col
+#define LOCATION_UNPACK(__loc__) location_filename(__loc__), location_row(__loc__), location_col(__loc__)
 
 location_t location_union(location_t a, location_t b) {
   location_t c = a;
-  if (a.row != b.row) {
-    c.len = a.line.len;
-  } else {
-    c.len = b.col + b.len - a.col;
-  }
+  uint32_t end = b.offset + b.len;
+  c.len = end > a.offset ? (end - a.offset > UINT16_MAX ? UINT16_MAX : end - a.offset) : a.len;
   return c;
 }
 
@@ -121,78 +332,96 @@ typedef struct {
   token_kind_t kind;
   sv_t image;
   location_t loc;
-  int asint;
+  union {
+    int asint;        // value of INT, HEX and CHAR
+    int symbol;       // of a SYM, symbol id + 1 once typecheck resolved it (0 if not)
+    int field_offset; // of the field SYM after a DOT, set by typecheck
+  };
 } token_t;
 
-#define MACRO_TOKEN_MAX 16
-#define MACRO_MAX       16
-
 typedef struct {
-  sv_t name;
-  token_t tokens[MACRO_TOKEN_MAX];
-  int token_count;
+  int first; // index in lexer_t.macro_tokens
+  int token_num;
+  bool active; // being expanded, to stop indirect recursion
 } macro_t;
 
+typedef struct {
+  int macro;
+  int pos;
+} macro_frame_t;
+
 typedef struct {
   char *buffer;
+  char *start; // of the file
   location_t loc;
-  token_t last_token;
-  bool has_last_token;
-  macro_t macros[MACRO_MAX];
-  int macro_count;
-  int current_macro;
-  int current_macro_token_index;
-} tokenizer_t;
+  macro_t *macros;
+  int macro_num;
+  int macro_cap;
+  token_t *macro_tokens; // the bodies of all the macros one after the other
+  int macro_token_num;
+  int macro_token_cap;
+  int *macro_of_name; // interned name id -> macro index + 1 (0 is not a macro)
+  int macro_of_name_cap;
+  macro_frame_t *frames; // the macros being expanded, innermost last
+  int frame_num;
+  int frame_cap;
+} lexer_t;
+
+void lexer_init(lexer_t *lexer, char *buffer, char *filename) {
+  assert(lexer);
+  *lexer = (lexer_t){0};
+  lexer->buffer = buffer;
+  lexer->start = buffer;
+  lexer->loc = (location_t){0, source_file_add(filename, buffer), 1};
+}
 
-void tokenizer_init(tokenizer_t *tokenizer, char *buffer, char *filename) {
-  assert(tokenizer);
-  char *row_end = buffer;
-  while (*row_end != '\n' && *row_end != '\0') {
-    ++row_end;
-  }
-  *tokenizer = (tokenizer_t){0};
-  tokenizer->buffer = buffer;
-  tokenizer->loc = (location_t){filename, (sv_t){buffer, row_end - buffer}, 1, 1, 1};
-  tokenizer->current_macro = -1;
+void lexer_free(lexer_t *lexer) {
+  assert(lexer);
+  free(lexer->macros);
+  free(lexer->macro_tokens);
+  free(lexer->macro_of_name);
+  free(lexer->frames);
+  *lexer = (lexer_t){0};
 }
 
 void print_location(location_t location) {
+  int row = location_row(location);
+  int col = location_col(location);
+  sv_t line = location_line_image(location);
+  int len = location.len;
+  if (col - 1 + len > (int)line.len) {
+    len = line.len - (col - 1) > 0 ? line.len - (col - 1) : 1;
+  }
   fprintf(stderr,
           "%*d | %*.*s\n",
-          location.row < 1000 ? 3 : 5,
-          location.row,
-          location.line.len,
-          location.line.len,
-          location.line.start);
+          row < 1000 ? 3 : 5,
+          row,
+          line.len,
+          line.len,
+          line.start);
   fprintf(stderr,
           "%s   %*.*s%c%*.*s\n",
-          location.row < 1000 ? "   " : "     ",
-          location.col - 1,
-          location.col - 1,
+          row < 1000 ? "   " : "     ",
+          col - 1,
+          col - 1,
           "                                                                    "
           "                                                                    "
           "                                                                ",
           '^',
-          location.len - 1,
-          location.len - 1,
+          len - 1,
+          len - 1,
           "~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~"
           "~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~"
           "~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~");
 }
 
 static bool dev_flag = false;
-static bool catch = false;
-static jmp_buf catch_buf;
 #define eprintf(__loc, ...) eprintf_impl((__loc), __LINE__, __FUNCTION__, __VA_ARGS__)
 void eprintf_impl(location_t location, int line, const char *func, char *fmt, ...) {
-  if (catch) {
-    catch = false;
-    longjmp(catch_buf, 1);
-  }
   if (dev_flag) {
     fprintf(stderr, "ERROR throw at %d in %s\n", line, func);
   }
-  fprintf(stderr, "ERROR:%s:%d:%d: ", location.filename, location.row, location.col);
+  fprintf(stderr, "ERROR:" LOCATION_FMT ": ", LOCATION_UNPACK(location));
   va_list argptr;
   va_start(argptr, fmt);
   vfprintf(stderr, fmt, argptr);
@@ -254,254 +483,393 @@ void token_dump(token_t token) {
   printf("%s '" SV_FMT "' @ %d:%d\n",
          token_kind_to_string(token.kind),
          SV_UNPACK(token.image),
-         token.loc.row,
-         token.loc.col);
+         location_row(token.loc),
+         location_col(token.loc));
 }
 
-token_t token_new_and_consume_from_buffer(token_kind_t kind, int len, tokenizer_t *tok, int asint) {
+token_t token_new_and_consume_from_buffer(token_kind_t kind, int len, lexer_t *tok, int asint) {
   assert(len);
   assert(tok);
-  location_t loc = tok->loc;
-  loc.len = len;
-  token_t token = (token_t){kind, {tok->buffer, len}, loc, asint};
-  tok->loc.col += len;
+  location_t loc = {tok->buffer - tok->start, tok->loc.file, len};
+  token_t token = (token_t){kind, {tok->buffer, len}, loc, {asint}};
   tok->buffer += len;
+  tok->loc.offset = tok->buffer - tok->start;
   return token;
 }
 
-token_t token_expect(tokenizer_t *tokenizer, token_kind_t kind);
-token_t token_next(tokenizer_t *tokenizer) {
-  assert(tokenizer);
-
-  token_kind_t table[128] = {0};
-  table['('] = T_PARO;
-  table[')'] = T_PARC;
-  table['['] = T_SQO;
-  table[']'] = T_SQC;
-  table['{'] = T_BRO;
-  table['}'] = T_BRC;
-  table[';'] = T_SEMICOLON;
-  table['+'] = T_PLUS;
-  table['-'] = T_MINUS;
-  table['*'] = T_STAR;
-  table['/'] = T_SLASH;
-  table['&'] = T_AND;
-  table[','] = T_COMMA;
-  table['.'] = T_DOT;
-  table['='] = T_EQUAL;
-  table['!'] = T_NOT;
-
-  token_t token = {0};
-
-  if (tokenizer->has_last_token) {
-    tokenizer->has_last_token = false;
-    token = tokenizer->last_token;
+// tokens made of a single char, T_NONE for the others
+const token_kind_t single_char_tokens[256] = {
+  ['('] = T_PARO,
+  [')'] = T_PARC,
+  ['['] = T_SQO,
+  [']'] = T_SQC,
+  ['{'] = T_BRO,
+  ['}'] = T_BRC,
+  [';'] = T_SEMICOLON,
+  ['+'] = T_PLUS,
+  ['-'] = T_MINUS,
+  ['*'] = T_STAR,
+  ['/'] = T_SLASH,
+  ['&'] = T_AND,
+  [','] = T_COMMA,
+  ['.'] = T_DOT,
+  ['='] = T_EQUAL,
+  ['!'] = T_NOT,
+};
+
+enum {
+  CC_DIGIT = 1 << 0,
+  CC_ALPHA = 1 << 1, // letters and '_'
+  CC_HEX = 1 << 2,
+};
+
+const uint8_t char_class[256] = {
+  ['0' ... '9'] = CC_DIGIT | CC_HEX,
+  ['a' ... 'f'] = CC_ALPHA | CC_HEX,
+  ['g' ... 'z'] = CC_ALPHA,
+  ['A' ... 'F'] = CC_ALPHA | CC_HEX,
+  ['G' ... 'Z'] = CC_ALPHA,
+  ['_'] = CC_ALPHA,
+};
+
+#define IS_CLASS(__c, __class) ((char_class[(uint8_t)(__c)] & (__class)) != 0)
+
+// T_SYM if it isn't a keyword
+token_kind_t keyword_kind(char *s, int len) {
+#define KEYWORD(__str, __kind) \
+  if (memcmp(s, __str, len) == 0) return __kind
+  // clang-format off
+  switch (len) {
+    case 2: KEYWORD("if", T_IF); break;
+    case 3:
+      switch (s[0]) {
+        case 'i': KEYWORD("int", T_INTKW); break;
+        case 'f': KEYWORD("for", T_FOR); break;
+      }
+      break;
+    case 4:
+      switch (s[0]) {
+        case 'e': KEYWORD("enum", T_ENUM); KEYWORD("else", T_ELSE); break;
+        case 'c': KEYWORD("char", T_CHARKW); break;
+        case 'v': KEYWORD("void", T_VOIDKW); break;
+      }
+      break;
+    case 5:
+      switch (s[0]) {
+        case 'w': KEYWORD("while", T_WHILE); break;
+        case 'b': KEYWORD("break", T_BREAK); break;
+      }
+      break;
+    case 6:
+      switch (s[0]) {
+        case 'r': KEYWORD("return", T_RETURN); break;
+        case 's': KEYWORD("struct", T_STRUCT); break;
+        case 'e': KEYWORD("extern", T_EXTERN); break;
+      }
+      break;
+    case 7:
+      switch (s[0]) {
+        case 't': KEYWORD("typedef", T_TYPEDEF); break;
+        case '_': KEYWORD("__asm__", T_ASM); break;
+      }
+      break;
+  }
+  // clang-format on
+#undef KEYWORD
+  return T_SYM;
+}
 
-  } else if (tokenizer->current_macro != -1) {
-    if (tokenizer->current_macro_token_index >= tokenizer->macros[tokenizer->current_macro].token_count) {
-      tokenizer->current_macro_token_index = 0;
-      tokenizer->current_macro = -1;
-      return token_next(tokenizer);
+// skips spaces, newlines and comments without looking at every byte in a loop:
+// the libc string functions already scan a word or a vector at a time
+void lexer_skip_blanks(lexer_t *lexer) {
+  assert(lexer);
+  while (true) {
+    lexer->buffer += strspn(lexer->buffer, " \t\r\n");
+    lexer->loc.offset = lexer->buffer - lexer->start;
+
+    char *c = lexer->buffer;
+    if (c[0] == '/' && c[1] == '/') {
+      lexer->buffer += strcspn(c, "\n");
+    } else if (c[0] == '/' && c[1] == '*') {
+      char *end = strstr(c + 2, "*/");
+      if (!end) {
+        lexer->loc.len = 2;
+        eprintf(lexer->loc, "unterminated comment");
+      }
+      lexer->buffer = end + 2;
     } else {
-      token = tokenizer->macros[tokenizer->current_macro].tokens[tokenizer->current_macro_token_index++];
+      return;
     }
+  }
+}
 
-  } else {
-    switch (*tokenizer->buffer) {
-      case '\0':
-        break;
-      case ' ':
-      case '\t':
-      case '\r':
-        ++tokenizer->buffer;
-        ++tokenizer->loc.col;
-        return token_next(tokenizer);
-      case '\n':
-      {
-        ++tokenizer->loc.row;
-        tokenizer->loc.col = 1;
-        ++tokenizer->buffer;
-        tokenizer->loc.line.start = tokenizer->buffer;
-        char *row_end = tokenizer->buffer;
-        while (*row_end != '\n' && *row_end != '\0') {
-          ++row_end;
-        }
+void lexer_directive(lexer_t *lexer);
 
-        tokenizer->loc.line.len = row_end - tokenizer->buffer;
-        return token_next(tokenizer);
-      }
-      case '#':
-      {
-        int len = 1;
-        while (isalpha(tokenizer->buffer[len]) || isdigit(tokenizer->buffer[len]) || tokenizer->buffer[len] == '_') {
-          ++len;
-        }
-        token = token_new_and_consume_from_buffer(T_NONE, len, tokenizer, 0);
-        if (sv_eq(token.image, sv_from_cstr("#define"))) {
-          token_t name = token_expect(tokenizer, T_SYM);
-          assert(tokenizer->macro_count + 1 < MACRO_MAX);
-          macro_t *macro = &tokenizer->macros[tokenizer->macro_count];
-          macro->name = name.image;
-
-          do {
-            int i = 0;
-            for (; isspace(tokenizer->buffer[i]); ++i) {
-            }
-            if (tokenizer->buffer[i - 1] == '\n') {
-              break;
-            }
+// one token straight from the buffer, the directives are consumed on the way
+token_t lexer_lex(lexer_t *lexer) {
+  assert(lexer);
 
-            token = token_next(tokenizer);
-            assert(macro->token_count + 1 < MACRO_TOKEN_MAX);
-            macro->tokens[macro->token_count++] = token;
-            if (token.kind == T_SYM && sv_eq(token.image, name.image)) {
-              eprintf(token.loc, "invalid recursive macro");
-            }
-          } while (1);
+  token_t token = {0};
 
-          tokenizer->macro_count++;
+  lexer_skip_blanks(lexer);
+  while (*lexer->buffer == '#') {
+    lexer_directive(lexer);
+    lexer_skip_blanks(lexer);
+  }
 
-          return token_next(tokenizer);
-        } else {
-          eprintf(token.loc, "invalid directive");
+  switch (*lexer->buffer) {
+    case '\0':
+      break;
+    case '<':
+    case '>':
+      if (lexer->buffer[1] == lexer->buffer[0]) {
+        token = token_new_and_consume_from_buffer(lexer->buffer[0] == '<' ? T_SHL : T_SHR, 2, lexer, 0);
+      } else {
+        TODO;
+      }
+      break;
+    case '/':
+    case '=':
+    case '!':
+      if (lexer->buffer[0] == '=' && lexer->buffer[1] == '=') {
+        token = token_new_and_consume_from_buffer(T_EQ, 2, lexer, 0);
+      } else if (lexer->buffer[0] == '!' && lexer->buffer[1] == '=') {
+        token = token_new_and_consume_from_buffer(T_NEQ, 2, lexer, 0);
+      } else {
+        assert(single_char_tokens[(uint8_t)*lexer->buffer]);
+        token = token_new_and_consume_from_buffer(single_char_tokens[(uint8_t)*lexer->buffer], 1, lexer, 0);
+      }
+      break;
+    case '"':
+    {
+      char *end = strchr(lexer->buffer + 1, '"');
+      if (!end) {
+        lexer->loc.len = 1;
+        eprintf(lexer->loc, "unterminated string");
+      }
+      token = token_new_and_consume_from_buffer(T_STRING, end + 1 - lexer->buffer, lexer, 0);
+    } break;
+    case '\'':
+      token = token_new_and_consume_from_buffer(T_CHAR, 3, lexer, *(lexer->buffer + 1));
+      if (token.image.start[2] != '\'') {
+        eprintf(token.loc, "CHAR can have only one char");
+      }
+      break;
+    case '0':
+      if (lexer->buffer[1] == 'x' || lexer->buffer[1] == 'X') {
+        int len = 2;
+        while (IS_CLASS(lexer->buffer[len], CC_HEX)) {
+          ++len;
         }
-      } break;
-      case '<':
-      case '>':
-        if (tokenizer->buffer[1] == tokenizer->buffer[0]) {
-          token = token_new_and_consume_from_buffer(tokenizer->buffer[0] == '<' ? T_SHL : T_SHR, 2, tokenizer, 0);
-        } else {
-          TODO;
+        token = token_new_and_consume_from_buffer(T_HEX, len, lexer, strtol(lexer->buffer + 2, NULL, 16));
+        if (len - 2 != 2 && len - 2 != 4) {
+          eprintf(token.loc, "HEX can be 1 or 2 bytes");
         }
         break;
-      case '/':
-        if (tokenizer->buffer[1] == '/') {
-          while (tokenizer->buffer[0] != '\n') {
-            ++tokenizer->buffer;
-          }
-          return token_next(tokenizer);
-        } else if (tokenizer->buffer[1] == '*') {
-          while (!(tokenizer->buffer[0] == '*' && tokenizer->buffer[1] == '/')) {
-            ++tokenizer->buffer;
-            ++tokenizer->loc.col;
-          }
-          tokenizer->buffer += 2;
-          tokenizer->loc.col += 2;
-          return token_next(tokenizer);
+      }
+      __attribute__((fallthrough));
+    default:
+      if (single_char_tokens[(uint8_t)*lexer->buffer]) {
+        token = token_new_and_consume_from_buffer(single_char_tokens[(uint8_t)*lexer->buffer], 1, lexer, 0);
+      } else if (IS_CLASS(*lexer->buffer, CC_DIGIT)) {
+        int len = 1;
+        while (IS_CLASS(lexer->buffer[len], CC_DIGIT)) {
+          ++len;
         }
-        __attribute__((fallthrough));
-      case '=':
-      case '!':
-        if (tokenizer->buffer[0] == '=' && tokenizer->buffer[1] == '=') {
-          token = token_new_and_consume_from_buffer(T_EQ, 2, tokenizer, 0);
-        } else if (tokenizer->buffer[0] == '!' && tokenizer->buffer[1] == '=') {
-          token = token_new_and_consume_from_buffer(T_NEQ, 2, tokenizer, 0);
-        } else {
-          assert(table[(int)*tokenizer->buffer]);
-          token = token_new_and_consume_from_buffer(table[(int)*tokenizer->buffer], 1, tokenizer, 0);
+        if (IS_CLASS(lexer->buffer[len], CC_ALPHA)) {
+          lexer->loc.len = len;
+          eprintf(lexer->loc, "invalid integer");
         }
-        break;
-      case '"':
-      {
+        token = token_new_and_consume_from_buffer(T_INT, len, lexer, atoi(lexer->buffer));
+      } else if (IS_CLASS(*lexer->buffer, CC_ALPHA)) {
         int len = 1;
-        do {
+        while (IS_CLASS(lexer->buffer[len], CC_ALPHA | CC_DIGIT)) {
           ++len;
-        } while (tokenizer->buffer[len] != '"');
-        ++len;
-        token = token_new_and_consume_from_buffer(T_STRING, len, tokenizer, 0);
-      } break;
-      case '\'':
-        token = token_new_and_consume_from_buffer(T_CHAR, 3, tokenizer, *(tokenizer->buffer + 1));
-        if (token.image.start[2] != '\'') {
-          eprintf(token.loc, "CHAR can have only one char");
         }
+        token = token_new_and_consume_from_buffer(keyword_kind(lexer->buffer, len), len, lexer, 0);
+
+      } else {
+        eprintf(lexer->loc, "unknown char: '%c'", *lexer->buffer);
+      }
+  }
+
+  return token;
+}
+
+int lexer_find_macro(lexer_t *lexer, token_t token) {
+  if (token.kind != T_SYM || lexer->macro_num == 0) {
+    return -1;
+  }
+  int id = intern(token.image);
+  if (id >= lexer->macro_of_name_cap) {
+    return -1;
+  }
+  return lexer->macro_of_name[id] - 1;
+}
+
+void lexer_define(lexer_t *lexer) {
+  assert(lexer);
+
+  token_t name = lexer_lex(lexer);
+  if (name.kind != T_SYM) {
+    eprintf(name.loc, "expected 'SYM' found '%s'", token_kind_to_string(name.kind));
+  }
+
+  macro_t macro = {lexer->macro_token_num, 0, false};
+  // the body ends with the line
+  while (1) {
+    lexer->buffer += strspn(lexer->buffer, " \t\r\v\f");
+    char *c = lexer->buffer;
+    if (*c == '\n' || *c == '\0' || (c[0] == '/' && c[1] == '/')) {
+      break;
+    }
+    if (c[0] == '/' && c[1] == '*') {
+      char *end = strstr(c + 2, "*/");
+      if (!end) {
+        lexer->loc.offset = c - lexer->start;
+        lexer->loc.len = 2;
+        eprintf(lexer->loc, "unterminated comment");
+      }
+      lexer->buffer = end + 2;
+      // a comment over more lines ends the body too
+      if (memchr(c, '\n', end - c)) {
         break;
-      case '0':
-        if (tokenizer->buffer[1] == 'x' || tokenizer->buffer[1] == 'X') {
-          int len = 2;
-          while (isdigit(tokenizer->buffer[len])
-                 || ('a' <= tokenizer->buffer[len] && tokenizer->buffer[len] <= 'f')
-                 || ('A' <= tokenizer->buffer[len] && tokenizer->buffer[len] <= 'F')) {
-            ++len;
-          }
-          token = token_new_and_consume_from_buffer(T_HEX, len, tokenizer, strtol(tokenizer->buffer + 2, NULL, 16));
-          if (len - 2 != 2 && len - 2 != 4) {
-            eprintf(token.loc, "HEX can be 1 or 2 bytes");
-          }
-          break;
-        }
-        __attribute__((fallthrough));
-      default:
-        if (table[(int)*tokenizer->buffer]) {
-          token = token_new_and_consume_from_buffer(table[(int)*tokenizer->buffer], 1, tokenizer, 0);
-        } else if (isdigit(*tokenizer->buffer)) {
-          int len = 1;
-          while (isdigit(tokenizer->buffer[len])) {
-            ++len;
-          }
-          if (isalpha(tokenizer->buffer[len]) || tokenizer->buffer[len] == '_') {
-            tokenizer->loc.len = len;
-            eprintf(tokenizer->loc, "invalid integer");
-          }
-          token = token_new_and_consume_from_buffer(T_INT, len, tokenizer, atoi(tokenizer->buffer));
-        } else if (isalpha(*tokenizer->buffer) || *tokenizer->buffer == '_') {
-          int len = 1;
-          while (isalpha(tokenizer->buffer[len]) || isdigit(tokenizer->buffer[len]) || tokenizer->buffer[len] == '_') {
-            ++len;
-          }
-          sv_t image = {tokenizer->buffer, len};
-          token = token_new_and_consume_from_buffer(
-              sv_eq(image, sv_from_cstr("return"))  ? T_RETURN :
-              sv_eq(image, sv_from_cstr("typedef")) ? T_TYPEDEF :
-              sv_eq(image, sv_from_cstr("struct"))  ? T_STRUCT :
-              sv_eq(image, sv_from_cstr("enum"))    ? T_ENUM :
-              sv_eq(image, sv_from_cstr("int"))     ? T_INTKW :
-              sv_eq(image, sv_from_cstr("char"))    ? T_CHARKW :
-              sv_eq(image, sv_from_cstr("void"))    ? T_VOIDKW :
-              sv_eq(image, sv_from_cstr("__asm__")) ? T_ASM :
-              sv_eq(image, sv_from_cstr("if"))      ? T_IF :
-              sv_eq(image, sv_from_cstr("else"))    ? T_ELSE :
-              sv_eq(image, sv_from_cstr("for"))     ? T_FOR :
-              sv_eq(image, sv_from_cstr("while"))   ? T_WHILE :
-              sv_eq(image, sv_from_cstr("extern"))  ? T_EXTERN :
-              sv_eq(image, sv_from_cstr("break"))   ? T_BREAK :
-                                                      T_SYM,
-              len,
-              tokenizer,
-              0);
+      }
+      continue;
+    }
+    if (*c == '#') {
+      lexer->loc.len = 1;
+      eprintf(lexer->loc, "invalid directive in a macro");
+    }
 
-        } else {
-          eprintf(tokenizer->loc, "unknown char: '%c'", *tokenizer->buffer);
-        }
+    token_t token = lexer_lex(lexer);
+    if (token.kind == T_SYM && sv_eq(token.image, name.image)) {
+      eprintf(token.loc, "invalid recursive macro");
+    }
+    DA_APPEND(lexer->macro_tokens, lexer->macro_token_num, lexer->macro_token_cap, token);
+    macro.token_num++;
+  }
+
+  int id = intern(name.image);
+  if (id >= lexer->macro_of_name_cap) {
+    int cap = lexer->macro_of_name_cap ? lexer->macro_of_name_cap : 64;
+    while (cap <= id) {
+      cap *= 2;
     }
+    lexer->macro_of_name = realloc(lexer->macro_of_name, cap * sizeof(int));
+    assert(lexer->macro_of_name);
+    memset(lexer->macro_of_name + lexer->macro_of_name_cap, 0, (cap - lexer->macro_of_name_cap) * sizeof(int));
+    lexer->macro_of_name_cap = cap;
+  }
+  // a redefinition replaces the old body
+  DA_APPEND(lexer->macros, lexer->macro_num, lexer->macro_cap, macro);
+  lexer->macro_of_name[id] = lexer->macro_num;
+}
+
+void lexer_directive(lexer_t *lexer) {
+  assert(lexer);
+
+  int len = 1;
+  while (IS_CLASS(lexer->buffer[len], CC_ALPHA | CC_DIGIT)) {
+    ++len;
+  }
+  token_t token = token_new_and_consume_from_buffer(T_NONE, len, lexer, 0);
+  if (len == 7 && memcmp(token.image.start, "#define", 7) == 0) {
+    lexer_define(lexer);
+  } else {
+    eprintf(token.loc, "invalid directive");
   }
+}
 
-  tokenizer->last_token = token;
+// expands the macros with a stack of frames instead of recursion
+token_t lexer_next(lexer_t *lexer) {
+  assert(lexer);
 
-  if (token.kind == T_SYM) {
-    for (int i = 0; i < tokenizer->macro_count; ++i) {
-      if (sv_eq(token.image, tokenizer->macros[i].name)) {
-        tokenizer->current_macro = i;
-        return token_next(tokenizer);
+  while (1) {
+    token_t token;
+    if (lexer->frame_num > 0) {
+      macro_frame_t *frame = &lexer->frames[lexer->frame_num - 1];
+      macro_t *macro = &lexer->macros[frame->macro];
+      if (frame->pos >= macro->token_num) {
+        macro->active = false;
+        lexer->frame_num--;
+        continue;
+      }
+      token = lexer->macro_tokens[macro->first + frame->pos++];
+    } else {
+      token = lexer_lex(lexer);
+      if (lexer->macro_num == 0) {
+        return token;
       }
     }
+
+    int m = lexer_find_macro(lexer, token);
+    if (m < 0) {
+      return token;
+    }
+    if (lexer->macros[m].active) {
+      eprintf(token.loc, "invalid recursive macro");
+    }
+    lexer->macros[m].active = true;
+    macro_frame_t frame = {m, 0};
+    DA_APPEND(lexer->frames, lexer->frame_num, lexer->frame_cap, frame);
   }
+}
 
-  return token;
+// the whole input lexed once, the parser moves a cursor on it so looking ahead
+// or going back is just reading another index
+typedef struct {
+  token_t *tokens; // ends with a T_NONE token
+  int token_num;
+  int token_cap;
+  int pos;
+} tokenizer_t;
+
+void tokenizer_init(tokenizer_t *tokenizer, char *buffer, char *filename) {
+  assert(tokenizer);
+  lexer_t lexer;
+  lexer_init(&lexer, buffer, filename);
+  *tokenizer = (tokenizer_t){0};
+  token_t token;
+  do {
+    token = lexer_next(&lexer);
+    DA_APPEND(tokenizer->tokens, tokenizer->token_num, tokenizer->token_cap, token);
+  } while (token.kind != T_NONE);
+  lexer_free(&lexer);
 }
 
-token_t token_peek(tokenizer_t *tokenizer) {
+void tokenizer_free(tokenizer_t *tokenizer) {
+  assert(tokenizer);
+  free(tokenizer->tokens);
+  *tokenizer = (tokenizer_t){0};
+}
+
+// the token k places after the cursor
+token_t token_peek_at(tokenizer_t *tokenizer, int k) {
   assert(tokenizer);
+  int i = tokenizer->pos + k;
+  return tokenizer->tokens[i < tokenizer->token_num ? i : tokenizer->token_num - 1];
+}
+
+token_t token_peek(tokenizer_t *tokenizer) {
+  return token_peek_at(tokenizer, 0);
+}
 
-  if (tokenizer->has_last_token) {
-    return tokenizer->last_token;
+token_t token_next(tokenizer_t *tokenizer) {
+  token_t token = token_peek(tokenizer);
+  if (token.kind != T_NONE) {
+    tokenizer->pos++;
   }
-  token_t token = token_next(tokenizer);
-  tokenizer->last_token = token;
-  tokenizer->has_last_token = true;
   return token;
 }
 
+// the last token consumed
+token_t token_last(tokenizer_t *tokenizer) {
+  assert(tokenizer);
+  assert(tokenizer->pos > 0);
+  return tokenizer->tokens[tokenizer->pos - 1];
+}
+
 token_t token_expect(tokenizer_t *tokenizer, token_kind_t kind) {
   assert(tokenizer);
   token_t token = token_next(tokenizer);
@@ -573,6 +941,7 @@ typedef struct type_t_ {
     struct {
       token_t name;
       struct type_t_ *fieldlist;
+      struct struct_layout_t_ *layout; // set by state_solve_type_alias
     } struct_;
     struct {
       struct type_t_ *type;
@@ -588,7 +957,8 @@ typedef struct type_t_ {
 } type_t;
 
 char *array_len_dump_to_string(array_len_t array_len) {
-  char *str = alloc(20);
+  char *str = alloc(R_STRING, 20);
+  str[0] = '\0';
   switch (array_len.kind) {
     case ARRAY_LEN_NOTARRAY:
       break;
@@ -606,7 +976,7 @@ char *array_len_dump_to_string(array_len_t array_len) {
 }
 
 type_t *type_malloc(type_t type) {
-  type_t *ptr = alloc(sizeof(type_t));
+  type_t *ptr = alloc(R_TYPE, sizeof(type_t));
   assert(ptr);
   *ptr = type;
   return ptr;
@@ -615,7 +985,7 @@ type_t *type_malloc(type_t type) {
 char *type_dump_to_string(type_t *type) {
   assert(type);
 
-  char *string = alloc(128);
+  char *string = alloc(R_STRING, 128);
   assert(string);
   memset(string, 0, 128);
 
@@ -640,11 +1010,9 @@ char *type_dump_to_string(type_t *type) {
       if (type->as.func.params) {
         char *str2 = type_dump_to_string(type->as.func.params);
         snprintf(string, 128, "FUNC {%s %s}", str, str2);
-        free_ptr(str2);
       } else {
         snprintf(string, 128, "FUNC {%s}", str);
       }
-      free_ptr(str);
     } break;
     case TY_PTR:
       assert(type->as.ptr);
@@ -653,7 +1021,6 @@ char *type_dump_to_string(type_t *type) {
       } else {
         char *str = type_dump_to_string(type->as.ptr);
         snprintf(string, 128, "PTR %s", str);
-        free_ptr(str);
       }
       break;
     case TY_PARAM:
@@ -663,11 +1030,9 @@ char *type_dump_to_string(type_t *type) {
       if (type->as.list.next) {
         char *str2 = type_dump_to_string(type->as.list.next);
         snprintf(string, 128, "PARAM {%s %s}", str, str2);
-        free_ptr(str2);
       } else {
         snprintf(string, 128, "PARAM {%s}", str);
       }
-      free_ptr(str);
     } break;
     case TY_ARRAY:
     {
@@ -675,8 +1040,6 @@ char *type_dump_to_string(type_t *type) {
       char *str = type_dump_to_string(type->as.array.type);
       char *arr = array_len_dump_to_string(type->as.array.len);
       snprintf(string, 128, "%s%s", str, arr);
-      free_ptr(str);
-      free_ptr(arr);
     } break;
     case TY_ALIAS:
       snprintf(string,
@@ -698,7 +1061,6 @@ char *type_dump_to_string(type_t *type) {
                  str,
                  SV_UNPACK(type->as.fieldlist.name.image),
                  str2);
-        free_ptr(str2);
       } else {
         snprintf(string,
                  128,
@@ -706,7 +1068,6 @@ char *type_dump_to_string(type_t *type) {
                  str,
                  SV_UNPACK(type->as.fieldlist.name.image));
       }
-      free_ptr(str);
     } break;
     case TY_STRUCT:
       if (type->as.struct_.fieldlist) {
@@ -717,7 +1078,6 @@ char *type_dump_to_string(type_t *type) {
           snprintf(
               string, 128, "STRUCT {" SV_FMT " %s}", SV_UNPACK(type->as.struct_.name.image), str);
         }
-        free_ptr(str);
       } else {
         if (type->as.struct_.name.kind == T_NONE) {
           snprintf(string, 128, "STRUCT {}");
@@ -730,7 +1090,6 @@ char *type_dump_to_string(type_t *type) {
       if (type->as.enum_.next) {
         char *str = type_dump_to_string(type->as.enum_.next);
         snprintf(string, 128, "ENUM {" SV_FMT " %s}", SV_UNPACK(type->as.enum_.name.image), str);
-        free_ptr(str);
       } else {
         snprintf(string, 128, "ENUM {" SV_FMT "}", SV_UNPACK(type->as.enum_.name.image));
       }
@@ -745,84 +1104,270 @@ char *type_dump_to_string(type_t *type) {
   return string;
 }
 
-bool type_cmp(type_t *a, type_t *b) {
-  if (a == NULL && b == NULL) {
-    return true;
+// canonical types are hash-consed: each distinct type exists once, so two
+// canonical types are the same type exactly when their pointers are equal.
+// They are never modified after interning. Derived types are keyed on their
+// canonical components, structs and enums on the definition they come from.
+// The size is not part of the key, it follows from the rest
+typedef struct {
+  type_t type;
+  type_t *resolved; // the same type with the aliases passed at every level, canonical
+} canon_type_t;
+
+typedef struct {
+  canon_type_t **types;
+  int type_num;
+  int type_cap;
+  int *table; // open addressing on type_hash, stores index + 1 (0 is empty)
+  int table_cap;
+  type_t *basic[TY_INT + 1]; // VOID, CHAR and INT, interned on first use
+} type_table_t;
+
+// the types live in R_TYPE, call type_table_free when freeing it
+type_table_t type_table = {0};
+
+uint32_t type_hash_mix(uint32_t hash, uintptr_t value) {
+  hash = (hash ^ (uint32_t)value) * 16777619u;
+  return (hash ^ (uint32_t)(value >> 16 >> 16)) * 16777619u;
+}
+
+uint32_t type_hash(type_t *type) {
+  uint32_t hash = type_hash_mix(2166136261u, type->kind);
+  switch (type->kind) {
+    case TY_NONE:
+    case TY_VOID:
+    case TY_CHAR:
+    case TY_INT:
+      break;
+    case TY_FUNC:
+      hash = type_hash_mix(hash, (uintptr_t)type->as.func.ret);
+      hash = type_hash_mix(hash, (uintptr_t)type->as.func.params);
+      break;
+    case TY_PTR:
+      hash = type_hash_mix(hash, (uintptr_t)type->as.ptr);
+      break;
+    case TY_PARAM:
+      hash = type_hash_mix(hash, (uintptr_t)type->as.list.type);
+      hash = type_hash_mix(hash, (uintptr_t)type->as.list.next);
+      break;
+    case TY_ARRAY:
+      hash = type_hash_mix(hash, (uintptr_t)type->as.array.type);
+      hash = type_hash_mix(hash, type->as.array.len.kind);
+      hash = type_hash_mix(hash, type->as.array.len.num);
+      break;
+    case TY_ALIAS:
+      hash = type_hash_mix(hash, sv_hash(type->as.alias.name.image));
+      hash = type_hash_mix(hash, (uintptr_t)type->as.alias.type);
+      break;
+    case TY_STRUCT:
+      hash = type_hash_mix(hash, (uintptr_t)type->as.struct_.fieldlist);
+      hash = type_hash_mix(hash, sv_hash(type->as.struct_.name.image));
+      break;
+    case TY_FIELDLIST:
+      hash = type_hash_mix(hash, (uintptr_t)type->as.fieldlist.type);
+      hash = type_hash_mix(hash, (uintptr_t)type->as.fieldlist.next);
+      hash = type_hash_mix(hash, sv_hash(type->as.fieldlist.name.image));
+      break;
+    case TY_ENUM:
+      hash = type_hash_mix(hash, (uintptr_t)type->as.enum_.next);
+      hash = type_hash_mix(hash, sv_hash(type->as.enum_.name.image));
+      break;
   }
-  if ((a == NULL && b != NULL) || (a != NULL && b == NULL)) {
+  return hash;
+}
+
+bool type_same_key(type_t *a, type_t *b) {
+  if (a->kind != b->kind) {
     return false;
   }
-
-  if (a->kind == TY_ALIAS) {
-    assert(a->as.alias.type);
-    return type_cmp(a->as.alias.type, b);
-  } else if (b->kind == TY_ALIAS) {
-    assert(b->as.alias.type);
-    return type_cmp(a, b->as.alias.type);
+  switch (a->kind) {
+    case TY_NONE:
+    case TY_VOID:
+    case TY_CHAR:
+    case TY_INT:
+      return true;
+    case TY_FUNC:
+      return a->as.func.ret == b->as.func.ret && a->as.func.params == b->as.func.params;
+    case TY_PTR:
+      return a->as.ptr == b->as.ptr;
+    case TY_PARAM:
+      return a->as.list.type == b->as.list.type && a->as.list.next == b->as.list.next;
+    case TY_ARRAY:
+      return a->as.array.type == b->as.array.type && a->as.array.len.kind == b->as.array.len.kind
+             && a->as.array.len.num == b->as.array.len.num;
+    case TY_ALIAS:
+      return a->as.alias.type == b->as.alias.type && a->as.alias.is_struct == b->as.alias.is_struct
+             && sv_eq(a->as.alias.name.image, b->as.alias.name.image);
+    case TY_STRUCT:
+      return a->as.struct_.fieldlist == b->as.struct_.fieldlist
+             && sv_eq(a->as.struct_.name.image, b->as.struct_.name.image);
+    case TY_FIELDLIST:
+      return a->as.fieldlist.type == b->as.fieldlist.type && a->as.fieldlist.next == b->as.fieldlist.next
+             && sv_eq(a->as.fieldlist.name.image, b->as.fieldlist.name.image);
+    case TY_ENUM:
+      return a->as.enum_.next == b->as.enum_.next && sv_eq(a->as.enum_.name.image, b->as.enum_.name.image);
   }
-  if (a->kind == b->kind) {
-    switch (a->kind) {
-      case TY_NONE:
-      case TY_VOID:
-      case TY_CHAR:
-      case TY_INT:
-        return true;
-      case TY_FUNC:
-        assert(a->as.func.ret);
-        if ((a->as.func.params ? 1 : 0) ^ (b->as.func.params ? 1 : 0)) {
-          return false;
-        }
-        return type_cmp(a->as.func.ret, b->as.func.ret)
-               && (a->as.func.params ? type_cmp(a->as.func.params, b->as.func.params) : true);
-      case TY_PTR:
-        assert(a->as.ptr);
-        assert(b->as.ptr);
-        return type_cmp(a->as.ptr, b->as.ptr);
-      case TY_PARAM:
-        assert(a->as.list.type);
-        assert(b->as.list.type);
-        if ((a->as.list.next ? 1 : 0) ^ (b->as.list.next ? 1 : 0)) {
-          return false;
-        }
-        return type_cmp(a->as.list.type, b->as.list.type)
-               && (a->as.list.next ? type_cmp(a->as.list.next, b->as.list.next) : true);
-      case TY_ARRAY:
-        return type_cmp(a->as.array.type, b->as.array.type)
-               && a->as.array.len.kind == b->as.array.len.kind;
-      case TY_ALIAS:
-        assert(0);
-      case TY_STRUCT:
-        return (a->as.struct_.name.kind != T_NONE && b->as.struct_.name.kind != T_NONE
-                && sv_eq(a->as.struct_.name.image, b->as.struct_.name.image))
-               || type_cmp(a->as.struct_.fieldlist, b->as.struct_.fieldlist);
-      case TY_FIELDLIST:
-        return type_cmp(a->as.fieldlist.type, b->as.fieldlist.type)
-               && sv_eq(a->as.fieldlist.name.image, b->as.fieldlist.name.image)
-               && type_cmp(a->as.fieldlist.next, b->as.fieldlist.next);
-      case TY_ENUM:
-        return sv_eq(a->as.enum_.name.image, b->as.enum_.name.image)
-               && type_cmp(a->as.enum_.next, b->as.enum_.next);
+  return false;
+}
+
+void type_table_grow() {
+  int cap = type_table.table_cap ? type_table.table_cap * 2 : 256;
+  int *table = calloc(cap, sizeof(int));
+  assert(table);
+  for (int id = 0; id < type_table.type_num; ++id) {
+    uint32_t i = type_hash(&type_table.types[id]->type) & (cap - 1);
+    while (table[i]) {
+      i = (i + 1) & (cap - 1);
     }
+    table[i] = id + 1;
   }
-  return false;
+  free(type_table.table);
+  type_table.table = table;
+  type_table.table_cap = cap;
 }
 
-bool type_greaterthan(type_t *a, type_t *b) { // a >= b
-  assert(a);
-  assert(b);
+type_t *type_resolved(type_t *canonical) {
+  assert(canonical);
+  return ((canon_type_t *)canonical)->resolved;
+}
+
+type_t *type_intern(type_t type);
+
+// the resolved type of a canonical type with aliases at its top or inside it
+type_t *type_resolve(type_t *type) {
+  type_t t = *type;
+  switch (t.kind) {
+    case TY_ALIAS:
+      return type_resolved(t.as.alias.type);
+    case TY_FUNC:
+      t.as.func.ret = type_resolved(t.as.func.ret);
+      t.as.func.params = t.as.func.params ? type_resolved(t.as.func.params) : NULL;
+      break;
+    case TY_PTR:
+      t.as.ptr = type_resolved(t.as.ptr);
+      break;
+    case TY_PARAM:
+      t.as.list.type = type_resolved(t.as.list.type);
+      t.as.list.next = t.as.list.next ? type_resolved(t.as.list.next) : NULL;
+      break;
+    case TY_ARRAY:
+      t.as.array.type = type_resolved(t.as.array.type);
+      break;
+    default:
+      return type;
+  }
+  return type_same_key(&t, type) ? type : type_intern(t);
+}
+
+// the components of type must be canonical already
+type_t *type_intern(type_t type) {
+  switch (type.kind) {
+    case TY_FUNC:
+      type.size = type.as.func.ret->size;
+      break;
+    case TY_PTR:
+      type.size = 2;
+      break;
+    case TY_PARAM:
+      type.size = type.as.list.type->size;
+      break;
+    case TY_ARRAY:
+      type.size = type.as.array.len.kind == ARRAY_LEN_NUM ? type.as.array.type->size * type.as.array.len.num : 0;
+      break;
+    case TY_ALIAS:
+      type.size = type.as.alias.type->size;
+      break;
+    default:
+      break;
+  }
+
+  if (2 * (type_table.type_num + 1) > type_table.table_cap) {
+    type_table_grow();
+  }
+  uint32_t i = type_hash(&type) & (type_table.table_cap - 1);
+  while (type_table.table[i]) {
+    canon_type_t *canon = type_table.types[type_table.table[i] - 1];
+    if (type_same_key(&canon->type, &type)) {
+      return &canon->type;
+    }
+    i = (i + 1) & (type_table.table_cap - 1);
+  }
+
+  canon_type_t *canon = alloc(R_TYPE, sizeof(canon_type_t));
+  canon->type = type;
+  canon->resolved = &canon->type;
+  type_table.table[i] = type_table.type_num + 1;
+  DA_APPEND(type_table.types, type_table.type_num, type_table.type_cap, canon);
+  // may intern more types and grow the table, the entry is already in place
+  canon->resolved = type_resolve(&canon->type);
+  return &canon->type;
+}
+
+type_t *type_basic(type_kind_t kind) {
+  assert(kind == TY_VOID || kind == TY_CHAR || kind == TY_INT);
+  if (!type_table.basic[kind]) {
+    type_table.basic[kind] = type_intern((type_t){kind, kind == TY_INT ? 2 : (kind == TY_CHAR ? 1 : 0), {}});
+  }
+  return type_table.basic[kind];
+}
+
+// the canonical version of a solved type, structs are not entered so
+// self-referencing ones are fine
+type_t *type_canon(type_t *type) {
+  if (!type) {
+    return NULL;
+  }
+  type_t t = *type;
+  switch (t.kind) {
+    case TY_FUNC:
+      t.as.func.ret = type_canon(t.as.func.ret);
+      t.as.func.params = type_canon(t.as.func.params);
+      break;
+    case TY_PTR:
+      t.as.ptr = type_canon(t.as.ptr);
+      break;
+    case TY_PARAM:
+      t.as.list.type = type_canon(t.as.list.type);
+      t.as.list.next = type_canon(t.as.list.next);
+      break;
+    case TY_ARRAY:
+      t.as.array.type = type_canon(t.as.array.type);
+      break;
+    case TY_ALIAS:
+      assert(t.as.alias.type);
+      t.as.alias.type = type_canon(t.as.alias.type);
+      break;
+    default:
+      break;
+  }
+  return type_intern(t);
+}
+
+void type_table_free() {
+  free(type_table.types);
+  free(type_table.table);
+  type_table = (type_table_t){0};
+}
 
-  if (a->kind == TY_ALIAS) {
-    assert(a->as.alias.type);
-    return type_cmp(a->as.alias.type, b); // TODO: shouldnt be type_greaterthan?
-  } else if (b->kind == TY_ALIAS) {
-    assert(b->as.alias.type);
-    return type_cmp(a, b->as.alias.type); // TODO: shouldnt be type_greaterthan?
+// a and b are canonical
+bool type_cmp(type_t *a, type_t *b) {
+  if (a == NULL || b == NULL) {
+    return a == b;
   }
+  return type_resolved(a) == type_resolved(b);
+}
+
+bool type_greaterthan(type_t *a, type_t *b) { // a >= b, both canonical
+  assert(a);
+  assert(b);
+  a = type_resolved(a);
+  b = type_resolved(b);
 
-  if (a->kind == TY_INT && b->kind == TY_CHAR) {
+  if (a == b) {
     return true;
-  } else if (a->kind == TY_ARRAY && b->kind == TY_ARRAY
-             && type_cmp(a->as.array.type, b->as.array.type)) {
+  } else if (a->kind == TY_INT && b->kind == TY_CHAR) {
+    return true;
+  } else if (a->kind == TY_ARRAY && b->kind == TY_ARRAY && a->as.array.type == b->as.array.type) {
     assert(b->as.array.len.kind == ARRAY_LEN_NUM);
     if (a->as.array.len.kind == ARRAY_LEN_NUM) {
       return a->as.array.len.num >= b->as.array.len.num;
@@ -830,11 +1375,11 @@ bool type_greaterthan(type_t *a, type_t *b) { // a >= b
       return a->as.array.len.kind == ARRAY_LEN_UNSET;
     }
   } else if (a->kind == TY_PTR && b->kind == TY_ARRAY) {
-    return type_cmp(a->as.ptr, b->as.array.type);
+    return a->as.ptr == b->as.array.type;
   } else if (a->kind == TY_INT && b->kind == TY_ENUM) {
     return true;
   }
-  return type_cmp(a, b);
+  return false;
 }
 
 int type_size_aligned(type_t *type) {
@@ -878,9 +1423,87 @@ type_t *type_pass_alias(type_t *type) {
   return type;
 }
 
+typedef struct {
+  token_t name;
+  int name_id; // interned
+  int offset;  // bytes from the start of the struct
+  type_t *type;
+  type_t *canon; // canonical type, set on the first access
+} field_layout_t;
+
+typedef struct struct_layout_t_ {
+  field_layout_t *fields; // in declaration order
+  int field_num;
+  int *slots; // open addressing on the name id, stores field index + 1 (0 is empty)
+  int slot_cap;
+  int size;
+} struct_layout_t;
+
+// the fieldlist types must be solved, the layout lives with the types in R_TYPE
+struct_layout_t *struct_layout_new(type_t *fieldlist) {
+  struct_layout_t *layout = alloc(R_TYPE, sizeof(struct_layout_t));
+  *layout = (struct_layout_t){0};
+  for (type_t *f = fieldlist; f; f = f->as.fieldlist.next) {
+    layout->field_num++;
+  }
+  layout->fields = alloc(R_TYPE, layout->field_num * sizeof(field_layout_t));
+  layout->slot_cap = 4;
+  while (layout->slot_cap < 2 * layout->field_num) {
+    layout->slot_cap *= 2;
+  }
+  layout->slots = alloc(R_TYPE, layout->slot_cap * sizeof(int));
+  memset(layout->slots, 0, layout->slot_cap * sizeof(int));
+
+  int offset = 0;
+  int i = 0;
+  for (type_t *f = fieldlist; f; f = f->as.fieldlist.next, ++i) {
+    field_layout_t *field = &layout->fields[i];
+    *field = (field_layout_t){f->as.fieldlist.name, intern(f->as.fieldlist.name.image), offset, f->as.fieldlist.type, NULL};
+    // a char followed by a wider field takes a whole word
+    if (type_is_kind(f->as.fieldlist.type, TY_CHAR) && f->as.fieldlist.next
+        && !type_is_kind(f->as.fieldlist.next->as.fieldlist.type, TY_CHAR)) {
+      offset += 2;
+    } else {
+      offset += f->as.fieldlist.type->size;
+    }
+
+    uint32_t slot = field->name_id & (layout->slot_cap - 1);
+    while (layout->slots[slot]) {
+      slot = (slot + 1) & (layout->slot_cap - 1);
+    }
+    layout->slots[slot] = i + 1;
+  }
+  // the padded size, word aligned like everything on the stack
+  layout->size = offset + offset % 2;
+  return layout;
+}
+
+field_layout_t *struct_layout_find(struct_layout_t *layout, sv_t name) {
+  assert(layout);
+  int id = intern(name);
+  uint32_t slot = id & (layout->slot_cap - 1);
+  while (layout->slots[slot]) {
+    field_layout_t *field = &layout->fields[layout->slots[slot] - 1];
+    if (field->name_id == id) {
+      return field;
+    }
+    slot = (slot + 1) & (layout->slot_cap - 1);
+  }
+  return NULL;
+}
+
+void struct_layout_dump(struct_layout_t *layout) {
+  assert(layout);
+  for (int i = 0; i < layout->field_num; ++i) {
+    field_layout_t *field = &layout->fields[i];
+    char *type = type_dump_to_string(field->type);
+    printf("  %d: " SV_FMT " <%s> offset %d size %d\n", i, SV_UNPACK(field->name.image), type, field->offset, field->type->size);
+  }
+}
+
 typedef enum {
   A_NONE,
-  A_LIST,      // binary
+  A_LIST,      // list
   A_FUNCDECL,  // funcdecl
   A_FUNCDEF,   // funcdef
   A_PARAMDEF,  // paramdef
@@ -910,25 +1533,29 @@ typedef enum {
 typedef struct ast_t_ {
   ast_kind_t kind;
   location_t loc;
-  type_t type;
+  type_t *type; // canonical, NULL until typechecked
   union {
     struct {
       struct ast_t_ *left;
       struct ast_t_ *right;
     } binary;
     struct {
-      type_t type;
+      struct ast_t_ **items; // contiguous, in R_AST
+      int num;
+    } list;
+    struct {
+      type_t *type; // as parsed, aliases solved by typecheck
       token_t name;
       struct ast_t_ *params;
       struct ast_t_ *block;
     } funcdecl;
     struct {
-      type_t type;
+      type_t *type;
       token_t name;
       struct ast_t_ *params;
     } funcdef;
     struct {
-      type_t type;
+      type_t *type;
       token_t name;
       struct ast_t_ *next;
     } paramdef;
@@ -942,7 +1569,7 @@ typedef struct ast_t_ {
       struct ast_t_ *arg;
     } unaryop;
     struct {
-      type_t type;
+      type_t *type;
       token_t name;
       struct ast_t_ *expr;
       struct ast_t_ *array_len;
@@ -952,11 +1579,11 @@ typedef struct ast_t_ {
       struct ast_t_ *params;
     } funcall;
     struct {
-      type_t type;
+      type_t *type;
       token_t name;
     } typedef_;
     struct {
-      type_t target;
+      type_t *target;
       struct ast_t_ *ast;
     } cast;
     struct {
@@ -970,12 +1597,63 @@ typedef struct ast_t_ {
 } ast_t;
 
 ast_t *ast_malloc(ast_t ast) {
-  ast_t *ptr = alloc(sizeof(ast_t));
+  ast_t *ptr = alloc(R_AST, sizeof(ast_t));
   assert(ptr);
   *ptr = ast;
   return ptr;
 }
 
+// the items of the lists being parsed, a nested list is pushed on top of the
+// outer one and moved to R_AST when complete
+typedef struct {
+  ast_t **items;
+  int num;
+  int cap;
+} ast_list_stack_t;
+
+ast_list_stack_t ast_list_stack = {0};
+
+void ast_list_push(ast_t *item) {
+  DA_APPEND(ast_list_stack.items, ast_list_stack.num, ast_list_stack.cap, item);
+}
+
+// the items pushed since base become an A_LIST
+ast_t *ast_list_end(int base, location_t loc) {
+  assert(base <= ast_list_stack.num);
+  int num = ast_list_stack.num - base;
+  ast_t **items = alloc(R_AST, num * sizeof(ast_t *));
+  memcpy(items, ast_list_stack.items + base, num * sizeof(ast_t *));
+  ast_list_stack.num = base;
+  return ast_malloc((ast_t){A_LIST, loc, NULL, {.list = {items, num}}});
+}
+
+// the passes walk the long chains (a + b + c ..., params and array items)
+// with this stack instead of recursing on them, nested walks push on top
+typedef struct {
+  ast_t *ast;
+  int arg; // kept by the pass until the node is popped
+} ast_walk_t;
+
+typedef struct {
+  ast_walk_t *items;
+  int num;
+  int cap;
+} ast_walk_stack_t;
+
+ast_walk_stack_t ast_walk = {0};
+
+void ast_walk_push(ast_t *ast, int arg) {
+  ast_walk_t walk = {ast, arg};
+  DA_APPEND(ast_walk.items, ast_walk.num, ast_walk.cap, walk);
+}
+
+void ast_stacks_free() {
+  free(ast_list_stack.items);
+  ast_list_stack = (ast_list_stack_t){0};
+  free(ast_walk.items);
+  ast_walk = (ast_walk_stack_t){0};
+}
+
 char *ast_kind_to_string(ast_kind_t kind) {
   switch (kind) {
     case A_NONE: return "NONE";
@@ -1021,6 +1699,13 @@ void ast_dump(ast_t *ast, bool dumptype) {
     case A_BREAK:
       break;
     case A_LIST:
+      for (int i = 0; i < ast->as.list.num; ++i) {
+        if (i > 0) {
+          printf(", ");
+        }
+        ast_dump(ast->as.list.items[i], dumptype);
+      }
+      break;
     case A_ASSIGN:
     case A_PARAM:
     case A_ARRAY:
@@ -1031,25 +1716,22 @@ void ast_dump(ast_t *ast, bool dumptype) {
       break;
     case A_FUNCDECL:
     {
-      char *str = type_dump_to_string(&ast->as.funcdecl.type);
+      char *str = type_dump_to_string(ast->as.funcdecl.type);
       printf("%s, " SV_FMT ", ", str, SV_UNPACK(ast->as.funcdecl.name.image));
-      free_ptr(str);
       ast_dump(ast->as.funcdecl.params, dumptype);
       printf(", ");
       ast_dump(ast->as.funcdecl.block, dumptype);
     } break;
     case A_FUNCDEF:
     {
-      char *str = type_dump_to_string(&ast->as.funcdef.type);
+      char *str = type_dump_to_string(ast->as.funcdef.type);
       printf("%s, " SV_FMT ", ", str, SV_UNPACK(ast->as.funcdef.name.image));
-      free_ptr(str);
       ast_dump(ast->as.funcdef.params, dumptype);
     } break;
     case A_PARAMDEF:
     {
-      char *str = type_dump_to_string(&ast->as.paramdef.type);
+      char *str = type_dump_to_string(ast->as.paramdef.type);
       printf("%s, " SV_FMT ", ", str, SV_UNPACK(ast->as.paramdef.name.image));
-      free_ptr(str);
       ast_dump(ast->as.paramdef.next, dumptype);
     } break;
     case A_BLOCK:
@@ -1077,9 +1759,8 @@ void ast_dump(ast_t *ast, bool dumptype) {
     case A_DECL:
     case A_GLOBDECL:
     {
-      char *str = type_dump_to_string(&ast->as.decl.type);
+      char *str = type_dump_to_string(ast->as.decl.type);
       printf("%s, " SV_FMT ", ", str, SV_UNPACK(ast->as.decl.name.image));
-      free_ptr(str);
       ast_dump(ast->as.decl.expr, dumptype);
       printf(", ");
       ast_dump(ast->as.decl.array_len, dumptype);
@@ -1090,15 +1771,13 @@ void ast_dump(ast_t *ast, bool dumptype) {
       break;
     case A_TYPEDEF:
     {
-      char *str = type_dump_to_string(&ast->as.typedef_.type);
+      char *str = type_dump_to_string(ast->as.typedef_.type);
       printf("%s, " SV_FMT ", ", str, SV_UNPACK(ast->as.typedef_.name.image));
-      free_ptr(str);
     } break;
     case A_CAST:
     {
-      char *str = type_dump_to_string(&ast->as.cast.target);
+      char *str = type_dump_to_string(ast->as.cast.target);
       printf("%s, ", str);
-      free_ptr(str);
       ast_dump(ast->as.cast.ast, dumptype);
     } break;
     case A_IF:
@@ -1111,10 +1790,9 @@ void ast_dump(ast_t *ast, bool dumptype) {
   }
   printf(")");
 
-  if (dumptype && ast->type.kind != TY_VOID) {
-    char *str = type_dump_to_string(&ast->type);
-    printf(" {%s <%d>}", str, ast->type.size);
-    free_ptr(str);
+  if (dumptype && (!ast->type || ast->type->kind != TY_VOID)) {
+    char *str = ast->type ? type_dump_to_string(ast->type) : "NONE";
+    printf(" {%s <%d>}", str, ast->type ? ast->type->size : 0);
   }
 }
 
@@ -1143,10 +1821,9 @@ void ast_dump_tree(ast_t *ast, bool dumptype, int indent) {
   printf("%s", ast_kind_to_string(ast->kind));
 
 #define dump_type                                   \
-  if (dumptype && ast->type.kind != TY_VOID) {      \
-    char *str = type_dump_to_string(&ast->type);    \
-    printf(" :: {%s <%d>}\n", str, ast->type.size); \
-    free_ptr(str);                                  \
+  if (dumptype && (!ast->type || ast->type->kind != TY_VOID)) {     \
+    char *str = ast->type ? type_dump_to_string(ast->type) : "NONE"; \
+    printf(" :: {%s <%d>}\n", str, ast->type ? ast->type->size : 0); \
   } else {                                          \
     printf("\n");                                   \
   }
@@ -1157,6 +1834,11 @@ void ast_dump_tree(ast_t *ast, bool dumptype, int indent) {
       dump_type;
       break;
     case A_LIST:
+      dump_type;
+      for (int i = 0; i < ast->as.list.num; ++i) {
+        ast_dump_tree(ast->as.list.items[i], dumptype, indent + 1);
+      }
+      break;
     case A_PARAM:
     case A_ARRAY:
     {
@@ -1171,26 +1853,23 @@ void ast_dump_tree(ast_t *ast, bool dumptype, int indent) {
     } break;
     case A_FUNCDECL:
     {
-      char *str = type_dump_to_string(&ast->as.funcdecl.type);
+      char *str = type_dump_to_string(ast->as.funcdecl.type);
       printf(" {%s} " SV_FMT, str, SV_UNPACK(ast->as.funcdecl.name.image));
-      free_ptr(str);
       dump_type;
       ast_dump_tree(ast->as.funcdecl.params, dumptype, indent + 1);
       ast_dump_tree(ast->as.funcdecl.block, dumptype, indent + 1);
     } break;
     case A_FUNCDEF:
     {
-      char *str = type_dump_to_string(&ast->as.funcdef.type);
+      char *str = type_dump_to_string(ast->as.funcdef.type);
       printf(" {%s} " SV_FMT, str, SV_UNPACK(ast->as.funcdef.name.image));
-      free_ptr(str);
       dump_type;
       ast_dump_tree(ast->as.funcdef.params, dumptype, indent + 1);
     } break;
     case A_PARAMDEF:
     {
-      char *str = type_dump_to_string(&ast->as.paramdef.type);
+      char *str = type_dump_to_string(ast->as.paramdef.type);
       printf(" {%s} " SV_FMT, str, SV_UNPACK(ast->as.paramdef.name.image));
-      free_ptr(str);
       dump_type;
       ast_dump_tree(ast->as.paramdef.next, dumptype, indent);
     } break;
@@ -1225,9 +1904,8 @@ void ast_dump_tree(ast_t *ast, bool dumptype, int indent) {
     case A_GLOBDECL:
     case A_DECL:
     {
-      char *str = type_dump_to_string(&ast->as.decl.type);
+      char *str = type_dump_to_string(ast->as.decl.type);
       printf(" {%s} " SV_FMT, str, SV_UNPACK(ast->as.decl.name.image));
-      free_ptr(str);
       dump_type;
       ast_dump_tree(ast->as.decl.expr, dumptype, indent + 1);
     } break;
@@ -1244,16 +1922,14 @@ void ast_dump_tree(ast_t *ast, bool dumptype, int indent) {
       break;
     case A_TYPEDEF:
     {
-      char *str = type_dump_to_string(&ast->as.typedef_.type);
+      char *str = type_dump_to_string(ast->as.typedef_.type);
       printf(" {%s} " SV_FMT, str, SV_UNPACK(ast->as.typedef_.name.image));
-      free_ptr(str);
       dump_type;
     } break;
     case A_CAST:
     {
-      char *str = type_dump_to_string(&ast->as.cast.target);
+      char *str = type_dump_to_string(ast->as.cast.target);
       printf(" {%s}\n", str);
-      free_ptr(str);
       ast_dump_tree(ast->as.cast.ast, dumptype, indent + 1);
     } break;
     case A_IF:
@@ -1267,13 +1943,6 @@ void ast_dump_tree(ast_t *ast, bool dumptype, int indent) {
 #undef dump_type
 }
 
-#define SYMBOL_MAX       256
-#define SCOPE_MAX        32
-#define DATA_MAX         256
-#define CODE_MAX         512
-#define IR_MAX           256
-#define BREAK_TARGET_MAX 8
-
 typedef struct {
   token_t name;
   type_t *type;
@@ -1292,18 +1961,24 @@ typedef struct {
   } info; // TODO: union {} info -> int arg
 } symbol_t;
 
+// scope bookkeeping of a visible symbol, set by state_add_symbol
 typedef struct {
-  symbol_t symbols[SYMBOL_MAX];
-  int symbol_num;
-} scope_t;
+  int symbol; // id, index in state_t.symbols
+  int name_id;
+  int shadow; // symbol with the same name hidden by this one, -1 if none
+  int depth;  // scope depth where it was defined
+} symbol_link_t;
 
 typedef struct {
-  bytecode_t data[DATA_MAX];
+  bytecode_t *data;
   int data_num;
-  bytecode_t init[CODE_MAX];
+  int data_cap;
+  bytecode_t *init;
   int init_num;
-  bytecode_t code[CODE_MAX];
+  int init_cap;
+  bytecode_t *code;
   int code_num;
+  int code_cap;
   bool is_init;
 } compiled_t;
 
@@ -1324,7 +1999,7 @@ typedef enum {
   IR_OPERATION,   // + inst
   IR_MUL,         // + num
   IR_DIV,         // + num
-  IR_CALL,        // + sv
+  IR_CALL,        // + call
   IR_EXTERN,      // + sv
 } ir_kind_t;
 
@@ -1336,6 +2011,10 @@ typedef struct {
       uint16_t offset;
     } loc;
     sv_t sv;
+    struct {
+      sv_t name;
+      int frame; // bytes of the parameters and the return value, the callee writes them
+    } call;
     int num;
     instruction_t inst;
   } arg;
@@ -1390,10 +2069,12 @@ void ir_dump(ir_t ir) {
     case IR_FUNCEND:
       break;
     case IR_SETLABEL:
-    case IR_CALL:
     case IR_EXTERN:
       printf(" " SV_FMT, SV_UNPACK(ir.arg.sv));
       break;
+    case IR_CALL:
+      printf(" " SV_FMT, SV_UNPACK(ir.arg.call.name));
+      break;
     case IR_SETULI:
     case IR_JMPZ:
     case IR_JMPNZ:
@@ -1432,21 +2113,32 @@ typedef enum {
 } builtin_externs_t;
 
 typedef struct {
-  scope_t scopes[SCOPE_MAX];
+  symbol_t *symbols; // every symbol ever declared, indexed by id, kept for compile
+  int symbol_num;
+  int symbol_cap;
+  symbol_link_t *visible; // the symbols in scope, the innermost scope last
+  int visible_num;
+  int visible_cap;
+  int *scope_starts; // visible_num at every state_push_scope, to undo the scope on drop
   int scope_num;
-  scope_t *scope;
+  int scope_cap;
+  int *bindings; // name id -> index in visible of the innermost symbol with that name, -1 if none
+  int binding_cap;
   int sp;
   int param;
   int uli; // unique label id
-  type_t ret_type;
+  type_t *ret_type; // canonical
   compiled_t compiled;
-  ir_t irs[IR_MAX];
+  ir_t *irs;
   int ir_num;
-  ir_t irs_init[IR_MAX];
+  int ir_cap;
+  ir_t *irs_init;
   int ir_init_num;
+  int ir_init_cap;
   bool is_init;
-  break_target_info_t break_target[BREAK_TARGET_MAX];
+  break_target_info_t *break_target;
   int break_target_num;
+  int break_target_cap;
   int builtin_externs;
 } state_t;
 static_assert(BE_COUNT < 32, "too many builtin externs");
@@ -1456,36 +2148,80 @@ typedef enum {
   OL_BASE,
   OL_MATH,
   OL_MULTI_READ,
+  OL_CFG,
   OL_COUNT
 } optlevel_t;
 
 void state_print_variables(state_t *state) {
   assert(state);
   printf("VARIABLES:\n");
-  for (int i = 0; i < state->scope_num; ++i) {
-    printf("SCOPE %d:\n", i);
-    for (int j = 0; j < state->scopes[i].symbol_num; ++j) {
-      symbol_t *s = &state->scopes[i].symbols[j];
-      char *t = type_dump_to_string(s->type);
-      printf(SV_FMT " <%s> ", SV_UNPACK(s->name.image), t);
-      switch (s->kind) {
-        case INFO_NONE: printf("NONE"); break;
-        case INFO_LOCAL: printf("LOCAL %d", s->info.local); break;
-        case INFO_GLOBAL: printf("GLOBAL %d", s->info.global); break;
-        case INFO_TYPE: printf("TYPE TODO:"); break;
-        case INFO_TYPEINCOMPLETE: printf("TYPEINCOMPLETE"); break;
-        case INFO_CONSTANT: printf("CONSTANT %d", s->info.num); break;
-      }
-      printf("\n");
+  int scope = 0;
+  printf("SCOPE %d:\n", scope);
+  for (int i = 0; i < state->visible_num; ++i) {
+    while (scope < state->scope_num && state->scope_starts[scope] <= i) {
+      printf("SCOPE %d:\n", ++scope);
+    }
+    symbol_t *s = &state->symbols[state->visible[i].symbol];
+    char *t = type_dump_to_string(s->type);
+    printf(SV_FMT " <%s> ", SV_UNPACK(s->name.image), t);
+    switch (s->kind) {
+      case INFO_NONE: printf("NONE"); break;
+      case INFO_LOCAL: printf("LOCAL %d", s->info.local); break;
+      case INFO_GLOBAL: printf("GLOBAL %d", s->info.global); break;
+      case INFO_TYPE: printf("TYPE TODO:"); break;
+      case INFO_TYPEINCOMPLETE: printf("TYPEINCOMPLETE"); break;
+      case INFO_CONSTANT: printf("CONSTANT %d", s->info.num); break;
+    }
+    printf("\n");
+  }
+}
+
+// every struct type that has a name, once
+void state_print_layouts(state_t *state) {
+  assert(state);
+  printf("STRUCT LAYOUTS:\n");
+  for (int i = 0; i < state->symbol_num; ++i) {
+    symbol_t *s = &state->symbols[i];
+    if ((s->kind != INFO_TYPE && s->kind != INFO_TYPEINCOMPLETE) || !type_is_kind(s->type, TY_STRUCT)) {
+      continue;
     }
+    struct_layout_t *layout = type_pass_alias(s->type)->as.struct_.layout;
+    if (!layout) {
+      continue;
+    }
+    bool printed = false;
+    for (int j = 0; j < i && !printed; ++j) {
+      symbol_t *t = &state->symbols[j];
+      printed = (t->kind == INFO_TYPE || t->kind == INFO_TYPEINCOMPLETE) && type_is_kind(t->type, TY_STRUCT)
+                && type_pass_alias(t->type)->as.struct_.layout == layout;
+    }
+    if (printed) {
+      continue;
+    }
+    printf(SV_FMT " size %d\n", SV_UNPACK(s->name.image), layout->size);
+    struct_layout_dump(layout);
   }
+  printf("\n");
+}
+
+void state_free(state_t *state) {
+  assert(state);
+  free(state->symbols);
+  free(state->visible);
+  free(state->scope_starts);
+  free(state->bindings);
+  free(state->irs);
+  free(state->irs_init);
+  free(state->break_target);
+  free(state->compiled.data);
+  free(state->compiled.init);
+  free(state->compiled.code);
+  *state = (state_t){0};
 }
 
 void state_init(state_t *state) {
   assert(state);
   *state = (state_t){0};
-  ++state->scope_num;
-  state->scope = &state->scopes[0];
 }
 
 void state_add_ir(state_t *state, ir_t ir) {
@@ -1494,11 +2230,9 @@ void state_add_ir(state_t *state, ir_t ir) {
     return;
   }
   if (state->is_init) {
-    assert(state->ir_init_num + 1 < IR_MAX);
-    state->irs_init[state->ir_init_num++] = ir;
+    DA_APPEND(state->irs_init, state->ir_init_num, state->ir_init_cap, ir);
   } else {
-    assert(state->ir_num + 1 < IR_MAX);
-    state->irs[state->ir_num++] = ir;
+    DA_APPEND(state->irs, state->ir_num, state->ir_cap, ir);
   }
   switch (ir.kind) {
     case IR_NONE:
@@ -1555,31 +2289,27 @@ void state_add_ir(state_t *state, ir_t ir) {
 
 void state_add_addr_offset(state_t *state, int offset) {
   assert(state);
+  ir_t *last = NULL;
   if (state->is_init) {
     assert(state->ir_init_num > 0);
-    if (state->irs_init[state->ir_init_num - 1].kind == IR_ADDR_LOCAL) {
-      state->irs_init[state->ir_init_num - 1].arg.num += offset;
-    } else if (state->irs_init[state->ir_init_num - 1].kind == IR_ADDR_GLOBAL) {
-      state->irs_init[state->ir_init_num - 1].arg.loc.offset += offset;
-    } else {
-      assert(0 && "expected ADDR");
-    }
+    last = &state->irs_init[state->ir_init_num - 1];
   } else {
     assert(state->ir_num > 0);
-    if (state->irs[state->ir_num - 1].kind == IR_ADDR_LOCAL) {
-      state->irs[state->ir_num - 1].arg.num += offset;
-    } else if (state->irs[state->ir_num - 1].kind == IR_ADDR_GLOBAL) {
-      state->irs[state->ir_num - 1].arg.loc.offset += offset;
-    } else {
-      assert(0 && "expected ADDR");
-    }
+    last = &state->irs[state->ir_num - 1];
+  }
+  if (last->kind == IR_ADDR_LOCAL) {
+    last->arg.num += offset;
+  } else if (last->kind == IR_ADDR_GLOBAL) {
+    last->arg.loc.offset += offset;
+  } else {
+    assert(0 && "expected ADDR");
   }
 }
 
 void state_push_break_target(state_t *state, int target) {
   assert(state);
-  assert(state->break_target_num + 1 < BREAK_TARGET_MAX);
-  state->break_target[state->break_target_num++] = (break_target_info_t){target, state->sp};
+  break_target_info_t info = {target, state->sp};
+  DA_APPEND(state->break_target, state->break_target_num, state->break_target_cap, info);
 }
 
 void state_drop_break_target(state_t *state) {
@@ -1590,8 +2320,18 @@ void state_drop_break_target(state_t *state) {
 
 void data(compiled_t *, bytecode_t);
 void code(compiled_t *, bytecode_t);
-void state_init_with_compiled(state_t *state) {
+// compile starts from a clean state, but keeps the symbols resolved by typecheck:
+// the ast references them by id
+void state_reset_for_compile(state_t *state) {
+  symbol_t *symbols = state->symbols;
+  int symbol_num = state->symbol_num;
+  int symbol_cap = state->symbol_cap;
+  state->symbols = NULL;
+  state_free(state);
   state_init(state);
+  state->symbols = symbols;
+  state->symbol_num = symbol_num;
+  state->symbol_cap = symbol_cap;
   compiled_t *compiled = &state->compiled;
   data(compiled, bytecode_with_string(BEXTERN, 0, "exit"));
   data(compiled, bytecode_with_string(BGLOBAL, 0, "_start"));
@@ -1602,49 +2342,74 @@ void state_init_with_compiled(state_t *state) {
 
 void state_push_scope(state_t *state) {
   assert(state);
-  assert(state->scope_num + 1 < SCOPE_MAX);
-  memset(&state->scopes[state->scope_num], 0, sizeof(scope_t));
-  ++state->scope_num;
-  state->scope = &state->scopes[state->scope_num - 1];
+  DA_APPEND(state->scope_starts, state->scope_num, state->scope_cap, state->visible_num);
 }
 
 void state_drop_scope(state_t *state) {
   assert(state);
   assert(state->scope_num > 0);
-  --state->scope_num;
-  state->scope = &state->scopes[state->scope_num - 1];
+  int start = state->scope_starts[--state->scope_num];
+  while (state->visible_num > start) {
+    symbol_link_t *l = &state->visible[--state->visible_num];
+    state->bindings[l->name_id] = l->shadow;
+  }
+}
+
+symbol_t *state_lookup_symbol(state_t *state, sv_t name) {
+  assert(state);
+  int id = intern(name);
+  if (id >= state->binding_cap || state->bindings[id] < 0) {
+    return NULL;
+  }
+  return &state->symbols[state->visible[state->bindings[id]].symbol];
 }
 
 symbol_t *state_find_symbol(state_t *state, token_t name) {
   assert(state);
-  assert(state->scope_num > 0);
-  for (int j = state->scope_num - 1; j >= 0; --j) {
-    scope_t *scope = &state->scopes[j];
-    for (int i = 0; i < scope->symbol_num; ++i) {
-      if (sv_eq(scope->symbols[i].name.image, name.image)) {
-        return &scope->symbols[i];
-      }
-    }
+  symbol_t *s = state_lookup_symbol(state, name.image);
+  if (!s) {
+    eprintf(name.loc, "symbol not declared: " SV_FMT, SV_UNPACK(name.image));
   }
-  eprintf(name.loc, "symbol not declared: " SV_FMT, SV_UNPACK(name.image));
-  assert(0);
+  return s;
 }
 
-void state_add_symbol(state_t *state, symbol_t symbol) {
+// returns the id of the new symbol
+int state_add_symbol(state_t *state, symbol_t symbol) {
   assert(state);
 
-  for (int i = 0; i < state->scope->symbol_num; ++i) {
-    if (sv_eq(state->scope->symbols[i].name.image, symbol.name.image)) {
-      eprintf(symbol.name.loc,
-              "redefinition of symbol '" SV_FMT "', defined at " LOCATION_FMT,
-              SV_UNPACK(symbol.name.image),
-              LOCATION_UNPACK(state->scope->symbols[i].name.loc));
+  symbol_link_t link = {state->symbol_num, intern(symbol.name.image), -1, state->scope_num};
+  if (link.name_id >= state->binding_cap) {
+    int cap = state->binding_cap ? state->binding_cap : 256;
+    while (cap <= link.name_id) {
+      cap *= 2;
     }
+    state->bindings = realloc(state->bindings, cap * sizeof(int));
+    assert(state->bindings);
+    for (int i = state->binding_cap; i < cap; ++i) {
+      state->bindings[i] = -1;
+    }
+    state->binding_cap = cap;
+  }
+
+  link.shadow = state->bindings[link.name_id];
+  if (link.shadow >= 0 && state->visible[link.shadow].depth == link.depth) {
+    eprintf(symbol.name.loc,
+            "redefinition of symbol '" SV_FMT "', defined at " LOCATION_FMT,
+            SV_UNPACK(symbol.name.image),
+            LOCATION_UNPACK(state->symbols[state->visible[link.shadow].symbol].name.loc));
   }
 
-  scope_t *scope = &state->scopes[state->scope_num - 1];
-  assert(scope->symbol_num + 1 < SYMBOL_MAX);
-  scope->symbols[scope->symbol_num++] = symbol;
+  state->bindings[link.name_id] = state->visible_num;
+  DA_APPEND(state->visible, state->visible_num, state->visible_cap, link);
+  DA_APPEND(state->symbols, state->symbol_num, state->symbol_cap, symbol);
+  return link.symbol;
+}
+
+// the symbol typecheck bound to the name
+symbol_t *state_symbol_of(state_t *state, token_t name) {
+  assert(state);
+  assert(name.symbol > 0 && name.symbol <= state->symbol_num);
+  return &state->symbols[name.symbol - 1];
 }
 
 void state_solve_type_alias(state_t *state, type_t *type) {
@@ -1696,7 +2461,8 @@ void state_solve_type_alias(state_t *state, type_t *type) {
     case TY_STRUCT:
       if (type->as.struct_.fieldlist) {
         state_solve_type_alias(state, type->as.struct_.fieldlist);
-        type->size = type->as.struct_.fieldlist->size;
+        type->as.struct_.layout = struct_layout_new(type->as.struct_.fieldlist);
+        type->size = type->as.struct_.layout->size;
       }
       break;
     case TY_FIELDLIST:
@@ -1728,6 +2494,25 @@ void dump_code(compiled_t *compiled) {
   }
 }
 
+// in bytes once assembled: the opcode and its 8 or 16 bit arg, labels and
+// directives take no space in the code
+int bytecode_size(bytecode_t bc) {
+  switch (bc.kind) {
+    case BINST:
+    case BHEX:
+      return 1;
+    case BINSTHEX:
+    case BHEX2:
+      return 2;
+    case BINSTHEX2:
+    case BINSTLABEL:
+    case BINSTRELLABEL:
+      return 3;
+    default:
+      return 0;
+  }
+}
+
 void bytecode_to_file(FILE *stream, bytecode_t bc) {
   assert(stream);
   switch (bc.kind) {
@@ -1806,6 +2591,37 @@ type_t parse_type(tokenizer_t *tokenizer) {
   return type;
 }
 
+// number of tokens of the type k tokens after the cursor as parse_type reads it, 0 if it isn't a type
+int type_lookahead(tokenizer_t *tokenizer, int k) {
+  assert(tokenizer);
+  int start = k;
+  if (token_peek_at(tokenizer, k).kind == T_STRUCT) {
+    ++k;
+  }
+  switch (token_peek_at(tokenizer, k).kind) {
+    case T_VOIDKW:
+    case T_INTKW:
+    case T_CHARKW:
+    case T_SYM:
+      ++k;
+      break;
+    default:
+      return 0;
+  }
+  if (token_peek_at(tokenizer, k).kind == T_STAR) {
+    ++k;
+  }
+  return k - start;
+}
+
+// '(' type ')' k tokens after the cursor
+bool is_cast_lookahead(tokenizer_t *tokenizer, int k) {
+  assert(tokenizer);
+  int len = type_lookahead(tokenizer, k + 1);
+  return token_peek_at(tokenizer, k).kind == T_PARO && len > 0
+         && token_peek_at(tokenizer, k + 1 + len).kind == T_PARC;
+}
+
 void add_field(ast_t *ast, type_t *type, type_t **typei) {
   assert(ast);
   assert(ast->kind == A_DECL);
@@ -1816,7 +2632,7 @@ void add_field(ast_t *ast, type_t *type, type_t **typei) {
   assert((*typei)->kind == TY_FIELDLIST);
   assert((*typei)->as.fieldlist.next == NULL);
 
-  type_t ftype = ast->as.decl.type;
+  type_t ftype = *ast->as.decl.type;
   token_t fname = ast->as.decl.name;
 
   for (type_t *t = type; t; t = t->as.fieldlist.next) {
@@ -1846,8 +2662,7 @@ type_t parse_structdef(tokenizer_t *tokenizer) {
   }
   token_expect(tokenizer, T_BRO);
   if (token_next_if_kind(tokenizer, T_BRC)) {
-    catch = false;
-    eprintf(location_union(start, tokenizer->last_token.loc), "invalid empty struct");
+    eprintf(location_union(start, token_last(tokenizer).loc), "invalid empty struct");
   }
 
   type_t type = {TY_FIELDLIST, 0, {}};
@@ -1862,19 +2677,18 @@ type_t parse_structdef(tokenizer_t *tokenizer) {
       }
       add_field(ast, &type, &typei);
     } else if (ast->kind == A_LIST) {
-      for (ast_t *l = ast; l; l = l->as.binary.right) {
-        assert(l->kind == A_LIST);
-        assert(l->as.binary.left);
-        assert(l->as.binary.left->kind == A_DECL);
-        if (l->as.binary.left->as.decl.expr) {
-          eprintf(ast->as.decl.expr->loc, "expected SEMICOLON");
+      for (int i = 0; i < ast->as.list.num; ++i) {
+        ast_t *decl = ast->as.list.items[i];
+        assert(decl->kind == A_DECL);
+        if (decl->as.decl.expr) {
+          eprintf(decl->as.decl.expr->loc, "expected SEMICOLON");
         }
-        add_field(l->as.binary.left, &type, &typei);
+        add_field(decl, &type, &typei);
       }
     }
   } while (!token_next_if_kind(tokenizer, T_BRC));
 
-  return (type_t){TY_STRUCT, 0, {.struct_ = {name, type_malloc(type)}}};
+  return (type_t){TY_STRUCT, 0, {.struct_ = {name, type_malloc(type), NULL}}};
 }
 
 type_t parse_enumdef(tokenizer_t *tokenizer) {
@@ -1921,12 +2735,12 @@ ast_t *parse_param(tokenizer_t *tokenizer) {
   }
 
   ast_t *expr = parse_expr(tokenizer);
-  ast_t *ast = ast_malloc((ast_t){A_PARAM, expr->loc, {0}, {.binary = {expr, NULL}}});
+  ast_t *ast = ast_malloc((ast_t){A_PARAM, expr->loc, NULL, {.binary = {expr, NULL}}});
   ast_t *asti = ast;
 
   while (token_next_if_kind(tokenizer, T_COMMA)) {
     expr = parse_expr(tokenizer);
-    asti->as.binary.right = ast_malloc((ast_t){A_PARAM, expr->loc, {}, {.binary = {expr, NULL}}});
+    asti->as.binary.right = ast_malloc((ast_t){A_PARAM, expr->loc, NULL, {.binary = {expr, NULL}}});
     asti = asti->as.binary.right;
   }
 
@@ -1941,7 +2755,7 @@ ast_t *parse_funcall(tokenizer_t *tokenizer) {
   token_t name = token_expect(tokenizer, T_SYM);
   ast_t *param = parse_param(tokenizer);
 
-  return ast_malloc((ast_t){A_FUNCALL, param ? location_union(name.loc, param->loc) : name.loc, {}, {.funcall = {name, param}}});
+  return ast_malloc((ast_t){A_FUNCALL, param ? location_union(name.loc, param->loc) : name.loc, NULL, {.funcall = {name, param}}});
 }
 
 ast_t *parse_array(tokenizer_t *tokenizer) {
@@ -1949,16 +2763,15 @@ ast_t *parse_array(tokenizer_t *tokenizer) {
 
   token_t bro = token_expect(tokenizer, T_BRO);
   if (token_next_if_kind(tokenizer, T_BRC)) {
-    catch = false;
-    eprintf(location_union(bro.loc, tokenizer->last_token.loc), "invalid empty array");
+    eprintf(location_union(bro.loc, token_last(tokenizer).loc), "invalid empty array");
   }
 
   ast_t *expr = parse_expr(tokenizer);
-  ast_t *ast = ast_malloc((ast_t){A_ARRAY, expr->loc, {}, {.binary = {expr, NULL}}});
+  ast_t *ast = ast_malloc((ast_t){A_ARRAY, expr->loc, NULL, {.binary = {expr, NULL}}});
   ast_t *asti = ast;
   while (token_next_if_kind(tokenizer, T_COMMA)) {
     expr = parse_expr(tokenizer);
-    asti->as.binary.right = ast_malloc((ast_t){A_ARRAY, expr->loc, {}, {.binary = {expr, NULL}}});
+    asti->as.binary.right = ast_malloc((ast_t){A_ARRAY, expr->loc, NULL, {.binary = {expr, NULL}}});
     asti = asti->as.binary.right;
   }
   token_t brc = token_expect(tokenizer, T_BRC);
@@ -1971,20 +2784,7 @@ ast_t *parse_fac(tokenizer_t *tokenizer) {
 
   token_t token = token_peek(tokenizer);
 
-  tokenizer_t savetok = *tokenizer;
-
   if (token_next_if_kind(tokenizer, T_PARO)) {
-    savetok = *tokenizer;
-    catch = true;
-    if (setjmp(catch_buf) == 0) {
-      type_t type = parse_type(tokenizer);
-      token_expect(tokenizer, T_PARC);
-      catch = false;
-      ast_t *fac = parse_fac(tokenizer);
-      return ast_malloc((ast_t){A_CAST, location_union(token.loc, fac->loc), {}, {.cast = {type, fac}}});
-    }
-    *tokenizer = savetok;
-
     ast_t *expr = parse_expr(tokenizer);
     token_expect(tokenizer, T_PARC);
     return expr;
@@ -1994,42 +2794,49 @@ ast_t *parse_fac(tokenizer_t *tokenizer) {
     return parse_array(tokenizer);
   }
 
-  savetok = *tokenizer;
-  if (token.kind == T_SYM) {
-    token_next(tokenizer);
-    if (token_peek(tokenizer).kind == T_PARO) {
-      *tokenizer = savetok;
-      return parse_funcall(tokenizer);
-    }
-    *tokenizer = savetok;
+  if (token.kind == T_SYM && token_peek_at(tokenizer, 1).kind == T_PARO) {
+    return parse_funcall(tokenizer);
   }
 
-  token_next(tokenizer);
-  if (token.kind == T_INT || token.kind == T_HEX || token.kind == T_CHAR) {
-    return ast_malloc((ast_t){A_INT, token.loc, {}, {.fac = token}});
-  } else if (token.kind == T_STRING) {
-    return ast_malloc((ast_t){A_STRING, token.loc, {}, {.fac = token}});
-  } else if (token.kind == T_SYM) {
-    return ast_malloc((ast_t){A_SYM, token.loc, {}, {.fac = token}});
-  } else {
-    eprintf(token.loc, "invalid token for fac: '%s'", token_kind_to_string(token.kind));
+  switch (token.kind) {
+    case T_INT:
+    case T_HEX:
+    case T_CHAR:
+      token_next(tokenizer);
+      return ast_malloc((ast_t){A_INT, token.loc, NULL, {.fac = token}});
+    case T_STRING:
+      token_next(tokenizer);
+      return ast_malloc((ast_t){A_STRING, token.loc, NULL, {.fac = token}});
+    case T_SYM:
+      token_next(tokenizer);
+      return ast_malloc((ast_t){A_SYM, token.loc, NULL, {.fac = token}});
+    default:
+      eprintf(token.loc, "unvalid expr");
   }
   assert(0);
 }
 
-ast_t *parse_access(tokenizer_t *tokenizer) {
+// the postfix operators bind tighter than anything else
+ast_t *parse_postfix(tokenizer_t *tokenizer, ast_t *ast) {
   assert(tokenizer);
+  assert(ast);
 
-  ast_t *fac = parse_fac(tokenizer);
+  while (1) {
+    if (token_next_if_kind(tokenizer, T_SQO)) {
+      ast_t *index = parse_expr(tokenizer);
+      token_t sqc = token_expect(tokenizer, T_SQC);
 
-  if (token_peek(tokenizer).kind == T_DOT) {
-    token_t dot = token_next(tokenizer);
-    token_t name = token_expect(tokenizer, T_SYM);
+      location_t loc = location_union(ast->loc, sqc.loc);
+      ast = ast_malloc((ast_t){A_UNARYOP, loc, NULL, {.unaryop = {T_STAR, ast_malloc((ast_t){A_BINARYOP, loc, NULL, {.binaryop = {T_PLUS, ast, index}}})}}});
+    } else if (token_next_if_kind(tokenizer, T_DOT)) {
+      token_t name = token_expect(tokenizer, T_SYM);
 
-    return ast_malloc((ast_t){A_BINARYOP, location_union(fac->loc, name.loc), {}, {.binaryop = {dot.kind, fac, ast_malloc((ast_t){A_SYM, name.loc, {}, {.fac = name}})}}});
+      ast_t *field = ast_malloc((ast_t){A_SYM, name.loc, NULL, {.fac = name}});
+      ast = ast_malloc((ast_t){A_BINARYOP, location_union(ast->loc, name.loc), NULL, {.binaryop = {T_DOT, ast, field}}});
+    } else {
+      return ast;
+    }
   }
-
-  return fac;
 }
 
 ast_t *parse_unary(tokenizer_t *tokenizer) {
@@ -2041,519 +2848,79 @@ ast_t *parse_unary(tokenizer_t *tokenizer) {
     case T_MINUS:
     case T_AND:
     case T_STAR:
+    case T_NOT:
+    {
       token_next(tokenizer);
       ast_t *arg = parse_unary(tokenizer);
-
-      if (arg->kind == A_INT) {
-        if (token.kind == T_MINUS) {
-          arg->as.fac.asint = 0xFFFF - arg->as.fac.asint + 1;
-          return arg;
-        } else if (token.kind == T_PLUS) {
-          return arg;
-        }
-      }
-
-      return ast_malloc((ast_t){
-          A_UNARYOP, location_union(token.loc, arg->loc), {}, {.unaryop = {token.kind, arg}}});
+      return ast_malloc((ast_t){A_UNARYOP, location_union(token.loc, arg->loc), NULL, {.unaryop = {token.kind, arg}}});
+    }
     default:
       break;
   }
 
-  ast_t *ast = parse_access(tokenizer);
-
-  if (token_next_if_kind(tokenizer, T_SQO)) {
-    ast_t *expr = parse_expr(tokenizer);
-    token_t sqc = token_expect(tokenizer, T_SQC);
-
-    ast->loc = location_union(ast->loc, sqc.loc);
-    ast = ast_malloc((ast_t){A_UNARYOP, ast->loc, {}, {.unaryop = {T_STAR, ast_malloc((ast_t){A_BINARYOP, ast->loc, {}, {.binaryop = {T_PLUS, ast, expr}}})}}});
-  }
-
-  return ast;
-}
-
-ast_t *parse_term(tokenizer_t *tokenizer) {
-  assert(tokenizer);
-
-  ast_t *a = parse_unary(tokenizer);
-  token_t token;
-  while (token = token_peek(tokenizer), token.kind == T_STAR || token.kind == T_SLASH) {
+  if (is_cast_lookahead(tokenizer, 0)) {
     token_next(tokenizer);
-    ast_t *b = parse_unary(tokenizer);
-    a = ast_malloc((ast_t){A_BINARYOP, location_union(a->loc, b->loc), {}, {.binaryop = {token.kind, a, b}}});
+    type_t type = parse_type(tokenizer);
+    token_expect(tokenizer, T_PARC);
+    ast_t *arg = parse_unary(tokenizer);
+    return ast_malloc((ast_t){A_CAST, location_union(token.loc, arg->loc), NULL, {.cast = {type_malloc(type), arg}}});
   }
 
-  return a;
+  return parse_postfix(tokenizer, parse_fac(tokenizer));
 }
 
-ast_t *parse_atom1(tokenizer_t *tokenizer) {
-  assert(tokenizer);
-
-  ast_t *a = parse_term(tokenizer);
-
-  token_t token;
-  while (token = token_peek(tokenizer), token.kind == T_PLUS || token.kind == T_MINUS) {
-    token_next(tokenizer);
-    ast_t *b = parse_term(tokenizer);
-    a = ast_malloc((ast_t){A_BINARYOP, location_union(a->loc, b->loc), {}, {.binaryop = {token.kind, a, b}}});
+// precedence of the binary operators, 0 ends the expression
+int binary_prec(token_kind_t kind) {
+  switch (kind) {
+    case T_STAR:
+    case T_SLASH:
+      return 12;
+    case T_PLUS:
+    case T_MINUS:
+      return 11;
+    case T_SHL:
+    case T_SHR:
+      return 10;
+    // LESS THAN etc 9
+    case T_EQ:
+    case T_NEQ:
+      return 8;
+    case T_AND:
+      return 7;
+      // XOR 6
+      // OR 5
+      // LOGIC AND 4
+      // LOGIC OR 3
+    default:
+      return 0;
   }
-
-  return a;
 }
 
-ast_t *parse_atom(tokenizer_t *tokenizer) {
+// precedence climbing: parses the operators that bind at least as tight as
+// min_prec, so the C stack grows with the nesting and not with the length
+ast_t *parse_expr_prec(tokenizer_t *tokenizer, int min_prec) {
   assert(tokenizer);
 
-  ast_t *a = parse_atom1(tokenizer);
+  ast_t *a = parse_unary(tokenizer);
 
-  token_t t = token_peek(tokenizer);
-  if (token_next_if_kind(tokenizer, T_SHL) || token_next_if_kind(tokenizer, T_SHR)) {
-    ast_t *b = parse_atom1(tokenizer);
-    a = ast_malloc((ast_t){A_BINARYOP, location_union(a->loc, b->loc), {}, {.binaryop = {t.kind, a, b}}});
+  int prec;
+  while ((prec = binary_prec(token_peek(tokenizer).kind)) >= min_prec) {
+    token_t op = token_next(tokenizer);
+    // all the binary operators are left associative
+    ast_t *b = parse_expr_prec(tokenizer, prec + 1);
+    a = ast_malloc((ast_t){A_BINARYOP, location_union(a->loc, b->loc), NULL, {.binaryop = {op.kind, a, b}}});
   }
 
   return a;
 }
 
-ast_t *parse_comp(tokenizer_t *tokenizer) {
-  assert(tokenizer);
-
-  ast_t *ast = parse_atom(tokenizer);
-
-  token_t t = token_peek(tokenizer);
-  if (token_next_if_kind(tokenizer, T_EQ) || token_next_if_kind(tokenizer, T_NEQ)) {
-    ast_t *b = parse_atom(tokenizer);
-    ast = ast_malloc((ast_t){A_BINARYOP, location_union(ast->loc, b->loc), {}, {.binaryop = {t.kind, ast, b}}});
-  }
-
-  return ast;
+ast_t *parse_expr(tokenizer_t *tokenizer) {
+  return parse_expr_prec(tokenizer, 1);
 }
 
-ast_t *parse_bitewiseand(tokenizer_t *tokenizer) {
+ast_t *parse_decl(tokenizer_t *tokenizer) {
   assert(tokenizer);
-
-  ast_t *a = parse_comp(tokenizer);
-
-  if (token_next_if_kind(tokenizer, T_AND)) {
-    ast_t *b = parse_expr(tokenizer);
-    a = ast_malloc((ast_t){A_BINARYOP, location_union(a->loc, b->loc), {}, {.binaryop = {T_AND, a, b}}});
-  }
-
-  return a;
-}
-
-// parsing_info_t token_parsing_info(token_kind_t kind) {
-//   switch (kind) {
-//     case T_DOT:
-//       return (parsing_info_t){14, LEFTASS};
-//     case T_NOT:
-//       return (parsing_info_t){13, RIGHTASS};
-//     case T_STAR:
-//     case T_SLASH:
-//       return (parsing_info_t){12, LEFTASS};
-//     case T_PLUS:
-//     case T_MINUS:
-//       return (parsing_info_t){11, LEFTASS};
-//     case T_SHL:
-//     case T_SHR:
-//       return (parsing_info_t){10, LEFTASS};
-//     // LESS THAN etc 9
-//     case T_EQ:
-//     case T_NEQ:
-//       return (parsing_info_t){8, LEFTASS};
-//     case T_AND:
-//       return (parsing_info_t){7, LEFTASS};
-//       // XOR 6
-//       // OR 5
-//       // LOGIC AND 4
-//       // LOGIC OR 3
-//       // EQUAL 2
-//       // COMMA 1
-//
-//     case T_SYM:
-//     case T_INT:
-//     case T_HEX:
-//     case T_STRING:
-//     case T_CHAR:
-//       break;
-//       return (parsing_info_t){PRECATOM, LEFTASS};
-//
-//     case T_PARO:
-//     case T_PARC:
-//     case T_SQO:
-//     case T_SQC:
-//     case T_BRO:
-//     case T_BRC:
-//       return (parsing_info_t){PRECPAR, LEFTASS};
-//
-//     case T_NONE:
-//     case T_RETURN:
-//     case T_TYPEDEF:
-//     case T_STRUCT:
-//     case T_SEMICOLON:
-//     case T_EQUAL:
-//     case T_VOIDKW:
-//     case T_INTKW:
-//     case T_CHARKW:
-//     case T_ENUM:
-//     case T_ASM:
-//     case T_IF:
-//     case T_ELSE:
-//     case T_FOR:
-//     case T_WHILE:
-//     case T_EXTERN:
-//     case T_BREAK:
-//     case T_COMMA:
-//       return (parsing_info_t){PRECUNVALID, LEFTASS};
-//   }
-//   assert(0);
-// }
-
-#define PARSER_STACK_CAP 1024
-
-typedef struct {
-  token_t t;
-  int prec;
-  int is_unary;
-  enum {
-    LEFTASS,
-    RIGHTASS
-  } ass;
-  int is_cast;
-  type_t type;
-} parser_token_t;
-
-void parse_create_ast(ast_t **output, int *oi, parser_token_t token) {
-  assert(output);
-  assert(oi);
-
-  switch (token.t.kind) {
-    case T_SQO:
-    case T_BRO:
-      eprintf(token.t.loc, "unmached parenthesis");
-      break;
-    case T_PARO:
-      if (!token.is_cast) {
-        eprintf(token.t.loc, "unmached parenthesis");
-      }
-      assert(*oi >= 1);
-      output[*oi - 1] = ast_malloc((ast_t){A_CAST, location_union(token.t.loc, output[*oi - 1]->loc), {}, {.cast = {token.type, output[*oi - 1]}}});
-      break;
-
-    case T_MINUS:
-    case T_PLUS:
-    case T_SHL:
-    case T_SHR:
-    case T_SLASH:
-    case T_EQ:
-    case T_NEQ:
-    case T_STAR:
-    case T_AND:
-    case T_NOT:
-    case T_DOT:
-      if (token.is_unary) {
-        assert(*oi >= 1);
-        ast_t *a = output[--(*oi)];
-        output[(*oi)++] = ast_malloc((ast_t){A_UNARYOP, location_union(token.t.loc, a->loc), {}, {.unaryop = {token.t.kind, a}}});
-      } else {
-        assert(*oi >= 2);
-        ast_t *a = output[--(*oi)];
-        ast_t *b = output[--(*oi)];
-        output[(*oi)++] = ast_malloc((ast_t){A_BINARYOP, location_union(a->loc, b->loc), {}, {.binaryop = {token.t.kind, b, a}}});
-      }
-      break;
-
-    case T_COMMA:
-    {
-      assert(*oi >= 2);
-      ast_t *a = output[--(*oi)];
-      ast_t *b = output[--(*oi)];
-      if (a->kind == A_ARRAY) {
-        output[(*oi)++] = ast_malloc((ast_t){A_ARRAY, location_union(a->loc, b->loc), {}, {.binary = {b, a}}});
-      } else if (b->kind == A_ARRAY) {
-        assert(0);
-      } else {
-        output[(*oi)++] = ast_malloc((ast_t){A_ARRAY, location_union(a->loc, b->loc), {}, {.binary = {b, ast_malloc((ast_t){A_ARRAY, a->loc, {}, {.binary = {a, NULL}}})}}});
-      }
-    } break;
-
-    case T_SYM: assert(0);
-
-    case T_PARC:
-    case T_SQC:
-    case T_BRC:
-    case T_INT:
-    case T_HEX:
-    case T_CHAR:
-    case T_STRING:
-      assert(0);
-
-    case T_NONE:
-    case T_RETURN:
-    case T_TYPEDEF:
-    case T_STRUCT:
-    case T_SEMICOLON:
-    case T_EQUAL:
-    case T_VOIDKW:
-    case T_INTKW:
-    case T_CHARKW:
-    case T_ENUM:
-    case T_ASM:
-    case T_IF:
-    case T_ELSE:
-    case T_FOR:
-    case T_WHILE:
-    case T_EXTERN:
-    case T_BREAK:
-      assert(0);
-  }
-}
-
-ast_t *parse_expr(tokenizer_t *tokenizer) {
-  assert(tokenizer);
-
-  location_t start_loc = tokenizer->last_token.loc;
-
-  parser_token_t stack[PARSER_STACK_CAP] = {0};
-  ast_t *output[PARSER_STACK_CAP] = {0};
-  int si = 0, oi = 0;
-
-  int opened_pars = 0;
-  int opened_sqs = 0;
-  int opened_brs = 0;
-  int is_start_expr = 1;
-  int is_last_op = 0;
-  int is_last_par_open = 0;
-  token_t t = {0};
-  while ((t = token_peek(tokenizer)).kind != T_NONE) {
-    int end_parse_expr = 0;
-    parser_token_t token = {t, 0, LEFTASS, 0, 0, {}};
-    int is_op = 0;
-
-    switch (t.kind) {
-      case T_INT:
-      case T_HEX:
-      case T_CHAR:
-        output[oi++] = ast_malloc((ast_t){A_INT, t.loc, {}, {.fac = t}});
-        break;
-      case T_STRING:
-        output[oi++] = ast_malloc((ast_t){A_STRING, t.loc, {}, {.fac = t}});
-        break;
-      case T_SYM:
-      {
-        tokenizer_t savetok = *tokenizer;
-        catch = true;
-        if (setjmp(catch_buf) == 0) {
-          ast_t *ast = parse_funcall(tokenizer);
-          output[oi++] = ast;
-          catch = false;
-          tokenizer->has_last_token = 1; // so than the next doesnt consume the next one
-          break;
-        }
-        *tokenizer = savetok;
-
-        output[oi++] = ast_malloc((ast_t){A_SYM, t.loc, {}, {.fac = t}});
-      } break;
-
-      case T_PARO:
-      {
-        tokenizer_t savetok = *tokenizer;
-        catch = true;
-        if (setjmp(catch_buf) == 0) {
-          token_next(tokenizer);
-          token.type = parse_type(tokenizer);
-          if (token_peek(tokenizer).kind != T_PARC) {
-            eprintf(tokenizer->last_token.loc, "expected )");
-          }
-          token.is_cast = 1;
-          token.prec = 13;
-          token.ass = RIGHTASS;
-          token.is_unary = 1;
-          is_op = 1;
-          catch = false;
-          break;
-        }
-        *tokenizer = savetok;
-
-        opened_pars++;
-        stack[si++] = token;
-      } break;
-      case T_PARC:
-        opened_pars--;
-        if (opened_pars < 0) {
-          end_parse_expr = 1;
-          break;
-        }
-        while (stack[si - 1].t.kind != T_PARO || stack[si - 1].is_cast) {
-          parse_create_ast(output, &oi, stack[--si]);
-        }
-        si--;
-        break;
-      case T_SQO:
-        opened_sqs++;
-        stack[si++] = token;
-        break;
-      case T_SQC:
-      {
-        opened_sqs--;
-        if (opened_sqs < 0) {
-          end_parse_expr = 1;
-          break;
-        }
-        while (stack[si - 1].t.kind != T_SQO) {
-          parse_create_ast(output, &oi, stack[--si]);
-        }
-        si--;
-        assert(oi >= 2);
-        ast_t *a = output[--oi];
-        ast_t *b = output[--oi];
-        location_t loc = location_union(b->loc, t.loc);
-        output[oi++] = ast_malloc((ast_t){A_UNARYOP, loc, {}, {.unaryop = {T_STAR, ast_malloc((ast_t){A_BINARYOP, loc, {}, {.binaryop = {T_PLUS, b, a}}})}}});
-      } break;
-      case T_BRO:
-        opened_brs++;
-        stack[si++] = token;
-        break;
-      case T_BRC:
-      {
-        opened_brs--;
-        if (opened_brs < 0) {
-          end_parse_expr = 1;
-          break;
-        }
-        while (stack[si - 1].t.kind != T_BRO) {
-          parse_create_ast(output, &oi, stack[--si]);
-        }
-
-        location_t loc = stack[si - 1].t.loc;
-        si--;
-        assert(oi >= 1);
-        if (output[oi - 1]->kind != A_ARRAY) {
-          output[oi - 1] = ast_malloc((ast_t){A_ARRAY, {}, {}, {.binary = {output[oi - 1], NULL}}});
-        }
-        output[oi - 1]->loc = location_union(loc, t.loc);
-      } break;
-
-      case T_MINUS:
-      case T_PLUS:
-        is_op = 1;
-        token.is_unary = is_last_op || is_start_expr || is_last_par_open;
-        token.prec = token.is_unary ? 13 : 11;
-        token.ass = token.is_unary ? RIGHTASS : LEFTASS;
-        break;
-      case T_SLASH:
-        is_op = 1;
-        token.prec = 12;
-        break;
-      case T_STAR:
-        is_op = 1;
-        token.is_unary = is_last_op || is_start_expr || is_last_par_open;
-        token.prec = token.is_unary ? 13 : 12;
-        break;
-      case T_AND:
-        is_op = 1;
-        token.is_unary = is_last_op || is_start_expr || is_last_par_open;
-        token.prec = token.is_unary ? 13 : 7;
-        break;
-      case T_DOT:
-        is_op = 1;
-        token.prec = 14;
-        break;
-      case T_EQ:
-      case T_NEQ:
-        is_op = 1;
-        token.prec = 8;
-        break;
-      case T_NOT:
-        is_op = 1;
-        token.is_unary = 1;
-        token.prec = 13;
-        token.ass = RIGHTASS;
-        break;
-      case T_SHL:
-      case T_SHR:
-        is_op = 1;
-        token.prec = 10;
-        break;
-      case T_COMMA:
-        if (opened_brs > 0 || opened_pars > 0) {
-          is_op = 1;
-          token.prec = 1;
-        } else {
-          end_parse_expr = 1;
-        }
-        break;
-
-      case T_NONE: assert(0);
-      case T_RETURN:
-      case T_TYPEDEF:
-      case T_STRUCT:
-      case T_SEMICOLON:
-      case T_EQUAL:
-      case T_VOIDKW:
-      case T_INTKW:
-      case T_CHARKW:
-      case T_ENUM:
-      case T_ASM:
-      case T_IF:
-      case T_ELSE:
-      case T_FOR:
-      case T_WHILE:
-      case T_EXTERN:
-      case T_BREAK:
-        end_parse_expr = 1;
-        break;
-    }
-    if (end_parse_expr) {
-      break;
-    }
-    token_next(tokenizer);
-
-    if (is_op) {
-      if (si == 0) {
-        stack[si++] = token;
-      } else if (token.is_unary) {
-        stack[si++] = token;
-
-      } else if (token.prec < stack[si - 1].prec || (token.ass == RIGHTASS && token.prec == stack[si - 1].prec)) {
-        parse_create_ast(output, &oi, stack[--si]);
-        stack[si++] = token;
-      } else {
-        stack[si++] = token;
-      }
-    }
-
-    // printf("stack:\n");
-    // for (int i = 0; i < si; ++i) {
-    //   token_dump(stack[i].t);
-    // }
-    // printf("output:\n");
-    // for (int i = 0; i < oi; ++i) {
-    //   ast_dump(output[i], 0);
-    //   printf(" ");
-    // }
-    // printf("\n\n");
-
-    is_last_par_open = t.kind == T_PARO || t.kind == T_SQO || t.kind == T_BRO;
-    is_last_op = is_op;
-    is_start_expr = 0;
-    assert(0 <= si && si <= PARSER_STACK_CAP);
-    assert(0 <= si && oi <= PARSER_STACK_CAP);
-  }
-
-  while (si > 0) {
-    parse_create_ast(output, &oi, stack[--si]);
-  }
-
-  if (oi != 1) {
-    eprintf(start_loc, "unvalid expr");
-  }
-  return output[0];
-}
-
-ast_t *parse_decl(tokenizer_t *tokenizer) {
-  assert(tokenizer);
-  location_t start = tokenizer->loc;
+  location_t start = token_peek(tokenizer).loc;
   type_t type = parse_type(tokenizer);
   token_t name = token_expect(tokenizer, T_SYM);
   ast_t *array_len_expr = NULL;
@@ -2578,31 +2945,32 @@ ast_t *parse_decl(tokenizer_t *tokenizer) {
   if (array_len.kind != ARRAY_LEN_NOTARRAY) {
     type = (type_t){TY_ARRAY, 0, {.array = {type_malloc(type), array_len}}};
   }
+  type_t *decl_type = type_malloc(type);
   if (expr && array_len.kind != ARRAY_LEN_UNSET) {
-    expr = ast_malloc((ast_t){A_CAST, expr->loc, {}, {.cast = {type, expr}}});
+    expr = ast_malloc((ast_t){A_CAST, expr->loc, NULL, {.cast = {decl_type, expr}}});
   }
-  ast_t *ast = ast_malloc((ast_t){A_DECL, location_union(start, expr ? expr->loc : name.loc), {}, {.decl = {type, name, expr, array_len_expr}}});
+  ast_t *ast = ast_malloc((ast_t){A_DECL, location_union(start, expr ? expr->loc : name.loc), NULL, {.decl = {decl_type, name, expr, array_len_expr}}});
   if (array_len.kind == ARRAY_LEN_NOTARRAY) {
     if (token_next_if_kind(tokenizer, T_COMMA)) {
-      ast = ast_malloc((ast_t){A_LIST, ast->loc, {}, {.binary = {ast, NULL}}});
-      ast_t **asti = &ast->as.binary.right;
+      int base = ast_list_stack.num;
+      location_t loc = ast->loc;
+      ast_list_push(ast);
 
       do {
-        start = tokenizer->loc;
+        start = token_peek(tokenizer).loc;
         bool ptr = token_next_if_kind(tokenizer, T_STAR);
         name = token_expect(tokenizer, T_SYM);
         expr = NULL;
         if (token_next_if_kind(tokenizer, T_EQUAL)) {
           expr = parse_expr(tokenizer);
         }
-        type_t _type = type;
+        type_t *_type = decl_type;
         if (ptr) {
-          _type = (type_t){TY_PTR, 2, {.ptr = type_malloc(type)}};
+          _type = type_malloc((type_t){TY_PTR, 2, {.ptr = decl_type}});
         }
-        ast_t *_ast = ast_malloc((ast_t){A_DECL, location_union(start, expr ? expr->loc : name.loc), {}, {.decl = {_type, name, expr, array_len_expr}}});
-        *asti = ast_malloc((ast_t){A_LIST, _ast->loc, {}, {.binary = {_ast, NULL}}});
-        asti = &(*asti)->as.binary.right;
+        ast_list_push(ast_malloc((ast_t){A_DECL, location_union(start, expr ? expr->loc : name.loc), NULL, {.decl = {_type, name, expr, array_len_expr}}}));
       } while (token_next_if_kind(tokenizer, T_COMMA));
+      ast = ast_list_end(base, loc);
     }
   }
   return ast;
@@ -2611,28 +2979,28 @@ ast_t *parse_decl(tokenizer_t *tokenizer) {
 ast_t *parse_asm(tokenizer_t *tokenizer) {
   assert(tokenizer);
 
-  location_t start = tokenizer->loc;
+  location_t start = token_peek(tokenizer).loc;
   token_expect(tokenizer, T_ASM);
   token_expect(tokenizer, T_PARO);
   token_t str = token_expect(tokenizer, T_STRING);
   token_expect(tokenizer, T_PARC);
 
-  return ast_malloc((ast_t){A_ASM, location_union(start, tokenizer->loc), {}, {.fac = str}});
+  return ast_malloc((ast_t){A_ASM, location_union(start, token_peek(tokenizer).loc), NULL, {.fac = str}});
 }
 
 ast_t *parse_statement(tokenizer_t *tokenizer) {
   assert(tokenizer);
 
-  location_t start = tokenizer->loc;
+  location_t start = token_peek(tokenizer).loc;
 
   if (token_next_if_kind(tokenizer, T_SEMICOLON)) {
     return NULL;
   }
 
   if (token_next_if_kind(tokenizer, T_BREAK)) {
-    location_t loc = tokenizer->last_token.loc;
+    location_t loc = token_last(tokenizer).loc;
     token_expect(tokenizer, T_SEMICOLON);
-    return ast_malloc((ast_t){A_BREAK, loc, {}, {}});
+    return ast_malloc((ast_t){A_BREAK, loc, NULL, {}});
   }
 
   if (token_next_if_kind(tokenizer, T_RETURN)) {
@@ -2641,42 +3009,35 @@ ast_t *parse_statement(tokenizer_t *tokenizer) {
       expr = parse_expr(tokenizer);
     }
     token_expect(tokenizer, T_SEMICOLON);
-    return ast_malloc((ast_t){A_RETURN, location_union(start, expr ? expr->loc : start), {}, {.ast = expr}});
+    return ast_malloc((ast_t){A_RETURN, location_union(start, expr ? expr->loc : start), NULL, {.ast = expr}});
   }
 
-  tokenizer_t savetok = *tokenizer;
-  catch = true;
-  if (setjmp(catch_buf) == 0) {
-    if (token_peek(tokenizer).kind == T_STRUCT) {
-      catch = false;
-    }
+  // a type followed by a name can only start a decl
+  int type_len = type_lookahead(tokenizer, 0);
+  if (token_peek(tokenizer).kind == T_STRUCT
+      || (type_len > 0 && token_peek_at(tokenizer, type_len).kind == T_SYM)) {
     ast_t *ast = parse_decl(tokenizer);
     token_expect(tokenizer, T_SEMICOLON);
-    catch = false;
     return ast;
   }
 
-  *tokenizer = savetok;
-  catch = true;
-  if (setjmp(catch_buf) == 0) {
+  if (token_peek(tokenizer).kind == T_ASM) {
     ast_t *ast = parse_asm(tokenizer);
     token_expect(tokenizer, T_SEMICOLON);
-    catch = false;
     return ast;
   }
 
-  *tokenizer = savetok;
   ast_t *a = parse_expr(tokenizer);
   if (token_next_if_kind(tokenizer, T_EQUAL)) {
     ast_t *b = parse_expr(tokenizer);
     token_expect(tokenizer, T_SEMICOLON);
-    a = ast_malloc((ast_t){A_ASSIGN, location_union(a->loc, b->loc), {}, {.binary = {a, b}}});
-    return ast_malloc((ast_t){A_STATEMENT, a->loc, {}, {.ast = a}});
+    a = ast_malloc((ast_t){A_ASSIGN, location_union(a->loc, b->loc), NULL, {.binary = {a, b}}});
+    return ast_malloc((ast_t){A_STATEMENT, a->loc, NULL, {.ast = a}});
   }
 
   token_expect(tokenizer, T_SEMICOLON);
 
-  a = ast_malloc((ast_t){A_STATEMENT, a->loc, {}, {.ast = a}});
+  a = ast_malloc((ast_t){A_STATEMENT, a->loc, NULL, {.ast = a}});
 
   return a;
 }
@@ -2685,7 +3046,7 @@ ast_t *parse_block(tokenizer_t *tokenizer);
 ast_t *parse_if(tokenizer_t *tokenizer) {
   assert(tokenizer);
 
-  location_t start = tokenizer->loc;
+  location_t start = token_peek(tokenizer).loc;
 
   token_expect(tokenizer, T_IF);
   token_expect(tokenizer, T_PARO);
@@ -2701,15 +3062,15 @@ ast_t *parse_if(tokenizer_t *tokenizer) {
     }
   }
 
-  location_t end = tokenizer->loc;
+  location_t end = token_peek(tokenizer).loc;
 
-  return ast_malloc((ast_t){A_IF, location_union(start, end), {}, {.if_ = {cond, then, else_}}});
+  return ast_malloc((ast_t){A_IF, location_union(start, end), NULL, {.if_ = {cond, then, else_}}});
 }
 
 ast_t *parse_for(tokenizer_t *tokenizer) {
   assert(tokenizer);
 
-  location_t start = tokenizer->loc;
+  location_t start = token_peek(tokenizer).loc;
 
   token_expect(tokenizer, T_FOR);
   token_expect(tokenizer, T_PARO);
@@ -2724,38 +3085,41 @@ ast_t *parse_for(tokenizer_t *tokenizer) {
       token_expect(tokenizer, T_EQUAL);
       ast_t *b = parse_expr(tokenizer);
 
-      inc = ast_malloc((ast_t){A_ASSIGN, location_union(inc->loc, b->loc), {}, {.binary = {inc, b}}});
+      inc = ast_malloc((ast_t){A_ASSIGN, location_union(inc->loc, b->loc), NULL, {.binary = {inc, b}}});
     }
   }
   if (inc) {
-    inc = ast_malloc((ast_t){A_STATEMENT, inc->loc, {}, {.ast = inc}});
+    inc = ast_malloc((ast_t){A_STATEMENT, inc->loc, NULL, {.ast = inc}});
   }
 
   token_expect(tokenizer, T_PARC);
 
-  location_t end = tokenizer->loc;
+  location_t end = token_peek(tokenizer).loc;
   ast_t *body = parse_block(tokenizer);
 
   if (inc && body) {
     assert(body->kind == A_BLOCK);
-    ast_t *a = body->as.ast;
-    assert(a->kind == A_LIST);
-    while (a->as.binary.right) {
-      a = a->as.binary.right;
-      assert(a->kind == A_LIST);
+    ast_t *list = body->as.ast;
+    assert(list->kind == A_LIST);
+    int base = ast_list_stack.num;
+    for (int i = 0; i < list->as.list.num; ++i) {
+      ast_list_push(list->as.list.items[i]);
     }
-
-    a->as.binary.right = ast_malloc((ast_t){A_LIST, inc->loc, {}, {.binary = {inc, NULL}}});
+    ast_list_push(inc);
+    body->as.ast = ast_list_end(base, list->loc);
   } else if (inc) {
-    body = ast_malloc((ast_t){A_BLOCK, inc->loc, {}, {.ast = inc}});
+    body = ast_malloc((ast_t){A_BLOCK, inc->loc, NULL, {.ast = inc}});
   }
 
   location_t loc = location_union(start, end);
 
-  ast_t *ast = ast_malloc((ast_t){A_WHILE, loc, {}, {.binary = {cond, body}}});
+  ast_t *ast = ast_malloc((ast_t){A_WHILE, loc, NULL, {.binary = {cond, body}}});
 
   if (init) {
-    ast = ast_malloc((ast_t){A_BLOCK, loc, {}, {.ast = ast_malloc((ast_t){A_LIST, loc, {}, {.binary = {init, ast_malloc((ast_t){A_LIST, loc, {}, {.binary = {ast, NULL}}})}}})}});
+    int base = ast_list_stack.num;
+    ast_list_push(init);
+    ast_list_push(ast);
+    ast = ast_malloc((ast_t){A_BLOCK, loc, NULL, {.ast = ast_list_end(base, loc)}});
   }
 
   return ast;
@@ -2764,7 +3128,7 @@ ast_t *parse_for(tokenizer_t *tokenizer) {
 ast_t *parse_while(tokenizer_t *tokenizer) {
   assert(tokenizer);
 
-  location_t start = tokenizer->loc;
+  location_t start = token_peek(tokenizer).loc;
 
   token_expect(tokenizer, T_WHILE);
   token_expect(tokenizer, T_PARO);
@@ -2772,7 +3136,7 @@ ast_t *parse_while(tokenizer_t *tokenizer) {
   token_expect(tokenizer, T_PARC);
   ast_t *body = parse_block(tokenizer);
 
-  return ast_malloc((ast_t){A_WHILE, location_union(start, tokenizer->loc), {}, {.binary = {cond, body}}});
+  return ast_malloc((ast_t){A_WHILE, location_union(start, token_peek(tokenizer).loc), NULL, {.binary = {cond, body}}});
 }
 
 ast_t *parse_code(tokenizer_t *tokenizer) {
@@ -2808,21 +3172,20 @@ ast_t *parse_block(tokenizer_t *tokenizer) {
     return NULL;
   }
 
-  ast_t *code = parse_code(tokenizer);
-  ast_t *ast = ast_malloc((ast_t){A_LIST, location_union(token.loc, code->loc), {}, {.binary = {code, NULL}}});
-  ast_t *block = ast;
-
-  while (token_peek(tokenizer).kind != T_BRC) {
-    code = parse_code(tokenizer);
+  int base = ast_list_stack.num;
+  location_t loc = token.loc;
+  do {
+    ast_t *code = parse_code(tokenizer);
     if (code) {
-      block->as.binary.right = ast_malloc((ast_t){A_LIST, location_union(ast->loc, code->loc), {}, {.binary = {code, NULL}}});
-      block = block->as.binary.right;
+      ast_list_push(code);
+      loc = location_union(token.loc, code->loc);
     }
-  }
+  } while (token_peek(tokenizer).kind != T_BRC);
+  ast_t *ast = ast_list_end(base, loc);
 
   token_t end = token_expect(tokenizer, T_BRC);
 
-  return ast_malloc((ast_t){A_BLOCK, location_union(token.loc, end.loc), {}, {.ast = ast}});
+  return ast_malloc((ast_t){A_BLOCK, location_union(token.loc, end.loc), NULL, {.ast = ast}});
 }
 
 ast_t *parse_paramdef(tokenizer_t *tokenizer) {
@@ -2835,13 +3198,13 @@ ast_t *parse_paramdef(tokenizer_t *tokenizer) {
 
   type_t type = parse_type(tokenizer);
   token_t name = token_expect(tokenizer, T_SYM);
-  ast_t *ast = ast_malloc((ast_t){A_PARAMDEF, location_union(par.loc, name.loc), {}, {.paramdef = {type, name, NULL}}});
+  ast_t *ast = ast_malloc((ast_t){A_PARAMDEF, location_union(par.loc, name.loc), NULL, {.paramdef = {type_malloc(type), name, NULL}}});
   ast_t *asti = ast;
 
   while (token_next_if_kind(tokenizer, T_COMMA)) {
     type = parse_type(tokenizer);
     name = token_expect(tokenizer, T_SYM);
-    asti->as.paramdef.next = ast_malloc((ast_t){A_PARAMDEF, location_union(ast->loc, name.loc), {}, {.paramdef = {type, name, NULL}}});
+    asti->as.paramdef.next = ast_malloc((ast_t){A_PARAMDEF, location_union(ast->loc, name.loc), NULL, {.paramdef = {type_malloc(type), name, NULL}}});
     asti = asti->as.paramdef.next;
   }
 
@@ -2853,7 +3216,7 @@ ast_t *parse_paramdef(tokenizer_t *tokenizer) {
 ast_t *parse_funcdecl(tokenizer_t *tokenizer) {
   assert(tokenizer);
 
-  location_t start = tokenizer->loc;
+  location_t start = token_peek(tokenizer).loc;
 
   type_t type = parse_type(tokenizer);
   token_t name = token_expect(tokenizer, T_SYM);
@@ -2862,13 +3225,13 @@ ast_t *parse_funcdecl(tokenizer_t *tokenizer) {
 
   ast_t *block = parse_block(tokenizer);
 
-  return ast_malloc((ast_t){A_FUNCDECL, location_union(start, block ? block->loc : (param ? param->loc : name.loc)), {}, {.funcdecl = {type, name, param, block}}});
+  return ast_malloc((ast_t){A_FUNCDECL, location_union(start, block ? block->loc : (param ? param->loc : name.loc)), NULL, {.funcdecl = {type_malloc(type), name, param, block}}});
 }
 
 ast_t *parse_funcdef(tokenizer_t *tokenizer) {
   assert(tokenizer);
 
-  location_t start = tokenizer->loc;
+  location_t start = token_peek(tokenizer).loc;
 
   type_t type = parse_type(tokenizer);
   token_t name = token_expect(tokenizer, T_SYM);
@@ -2877,7 +3240,7 @@ ast_t *parse_funcdef(tokenizer_t *tokenizer) {
 
   token_expect(tokenizer, T_SEMICOLON);
 
-  return ast_malloc((ast_t){A_FUNCDEF, location_union(start, param ? param->loc : name.loc), {}, {.funcdef = {type, name, param}}});
+  return ast_malloc((ast_t){A_FUNCDEF, location_union(start, param ? param->loc : name.loc), NULL, {.funcdef = {type_malloc(type), name, param}}});
 }
 
 ast_t *parse_typedef(tokenizer_t *tokenizer) {
@@ -2901,18 +3264,18 @@ ast_t *parse_typedef(tokenizer_t *tokenizer) {
   token_t name = token_expect(tokenizer, T_SYM);
   token_expect(tokenizer, T_SEMICOLON);
 
-  return ast_malloc((ast_t){A_TYPEDEF, td.loc, {}, {.typedef_ = {type, name}}});
+  return ast_malloc((ast_t){A_TYPEDEF, td.loc, NULL, {.typedef_ = {type_malloc(type), name}}});
 }
 
 ast_t *parse_extern(tokenizer_t *tokenizer) {
   assert(tokenizer);
 
-  location_t start = tokenizer->loc;
+  location_t start = token_peek(tokenizer).loc;
 
   token_expect(tokenizer, T_EXTERN);
   ast_t *funcdef = parse_funcdef(tokenizer);
 
-  return ast_malloc((ast_t){A_EXTERN, location_union(start, funcdef->loc), {}, {.ast = funcdef}});
+  return ast_malloc((ast_t){A_EXTERN, location_union(start, funcdef->loc), NULL, {.ast = funcdef}});
 }
 
 ast_t *parse_global(tokenizer_t *tokenizer) {
@@ -2926,18 +3289,17 @@ ast_t *parse_global(tokenizer_t *tokenizer) {
     return parse_extern(tokenizer);
   }
 
-  tokenizer_t savetok = *tokenizer;
-  catch = true;
-  if (setjmp(catch_buf) == 0) {
-    ast_t *decl = parse_decl(tokenizer);
-    token_expect(tokenizer, T_SEMICOLON);
-    decl->kind = A_GLOBDECL;
-    catch = false;
-    return decl;
+  // type name '(' starts a function
+  int type_len = type_lookahead(tokenizer, 0);
+  if (type_len > 0 && token_peek_at(tokenizer, type_len).kind == T_SYM
+      && token_peek_at(tokenizer, type_len + 1).kind == T_PARO) {
+    return parse_funcdecl(tokenizer);
   }
-  *tokenizer = savetok;
 
-  return parse_funcdecl(tokenizer);
+  ast_t *decl = parse_decl(tokenizer);
+  token_expect(tokenizer, T_SEMICOLON);
+  decl->kind = A_GLOBDECL;
+  return decl;
 }
 
 ast_t *parse(tokenizer_t *tokenizer) {
@@ -2947,42 +3309,216 @@ ast_t *parse(tokenizer_t *tokenizer) {
     return NULL;
   }
 
-  ast_t *glob = parse_global(tokenizer);
-  ast_t *ast = ast_malloc((ast_t){A_LIST, glob->loc, {}, {.binary = {glob, NULL}}});
-  ast_t *asti = ast;
-
+  int base = ast_list_stack.num;
+  location_t loc = token_peek(tokenizer).loc;
   while (token_peek(tokenizer).kind != T_NONE) {
-    ast_t *glob = parse_global(tokenizer);
-    asti->as.binary.right = ast_malloc((ast_t){A_LIST, glob->loc, {}, {.binary = {glob, NULL}}});
-    asti = asti->as.binary.right;
+    ast_list_push(parse_global(tokenizer));
   }
 
-  return ast;
+  return ast_list_end(base, loc);
+}
+
+double time_now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+#define TRACE_ARG_MAX 3
+
+typedef struct {
+  char *name;
+  int value;
+} trace_arg_t;
+
+// a complete ("X") event of the chrome trace event format
+typedef struct {
+  char *cat;
+  sv_t name;
+  double start;
+  double end;
+  trace_arg_t args[TRACE_ARG_MAX];
+  int arg_num;
+} trace_event_t;
+
+struct {
+  FILE *file; // NULL if not tracing
+  double origin;
+  trace_event_t *events;
+  int event_num;
+  int event_cap;
+} trace = {0};
+
+// 0 when not tracing, the result is only meant for trace_end
+double trace_begin() {
+  return trace.file ? time_now() : 0;
+}
+
+// the varargs are arg_num pairs of a char * name and an int value
+void trace_end(char *cat, sv_t name, double start, int arg_num, ...) {
+  if (!trace.file) {
+    return;
+  }
+  assert(arg_num <= TRACE_ARG_MAX);
+  trace_event_t event = {cat, name, start, time_now(), {{0}}, arg_num};
+  va_list argptr;
+  va_start(argptr, arg_num);
+  for (int i = 0; i < arg_num; ++i) {
+    event.args[i].name = va_arg(argptr, char *);
+    event.args[i].value = va_arg(argptr, int);
+  }
+  va_end(argptr);
+  DA_APPEND(trace.events, trace.event_num, trace.event_cap, event);
+}
+
+// at exit, the names point into the source buffers that live until then
+void trace_write() {
+  FILE *file = trace.file;
+  fprintf(file, "{\"traceEvents\": [");
+  for (int i = 0; i < trace.event_num; ++i) {
+    trace_event_t *e = &trace.events[i];
+    fprintf(file,
+            "%s\n  {\"name\": \"" SV_FMT "\", \"cat\": \"%s\", \"ph\": \"X\", \"pid\": 1, \"tid\": 1, "
+            "\"ts\": %.3f, \"dur\": %.3f, \"args\": {",
+            i ? "," : "",
+            SV_UNPACK(e->name),
+            e->cat,
+            (e->start - trace.origin) * 1e6,
+            (e->end - e->start) * 1e6);
+    for (int k = 0; k < e->arg_num; ++k) {
+      fprintf(file, "%s\"%s\": %d", k ? ", " : "", e->args[k].name, e->args[k].value);
+    }
+    fprintf(file, "}}");
+  }
+  fprintf(file, "\n], \"displayTimeUnit\": \"ms\"}\n");
+  assert(fclose(file) == 0);
+  trace.file = NULL;
+}
+
+void trace_free() {
+  free(trace.events);
+  trace.events = NULL;
+  trace.event_num = 0;
+  trace.event_cap = 0;
 }
 
 void typecheck(ast_t *ast, state_t *state);
-void typecheck_expect(ast_t *ast, state_t *state, type_t type) {
+// type is canonical
+void typecheck_expect(ast_t *ast, state_t *state, type_t *type) {
   assert(ast);
 
-  if (ast->type.kind == TY_NONE) {
+  if (!ast->type) {
     typecheck(ast, state);
   }
 
-  type_expect(ast->loc, &ast->type, &type);
+  type_expect(ast->loc, ast->type, type);
 }
 
-void typecheck_expandable(ast_t *ast, state_t *state, type_t type) {
+void typecheck_expandable(ast_t *ast, state_t *state, type_t *type) {
   assert(ast);
 
-  if (ast->type.kind == TY_NONE) {
+  if (!ast->type) {
     typecheck(ast, state);
   }
 
-  if (type_greaterthan(&type, &ast->type)) {
+  if (type_greaterthan(type, ast->type)) {
     return;
   }
 
-  type_expect(ast->loc, &ast->type, &type);
+  type_expect(ast->loc, ast->type, type);
+}
+
+// the lhs is typed already
+void typecheck_binaryop(ast_t *ast, state_t *state) {
+  type_t *type = ast->as.binaryop.lhs->type;
+
+  switch (ast->as.binaryop.op) {
+    case T_DOT:
+    {
+      assert(ast->as.binaryop.rhs->kind == A_SYM);
+
+      if (!type_is_kind(type, TY_STRUCT)) {
+        eprintf(ast->as.binaryop.lhs->loc,
+                "expected a 'STRUCT', found '%s'",
+                type_dump_to_string(type));
+      }
+
+      type_t *struct_ = type_pass_alias(type);
+      token_t *name = &ast->as.binaryop.rhs->as.fac;
+      field_layout_t *field = struct_->as.struct_.layout ? struct_layout_find(struct_->as.struct_.layout, name->image) : NULL;
+      if (!field) {
+        eprintf(ast->as.binaryop.rhs->loc,
+                "member not found in '%s'",
+                type_dump_to_string(struct_));
+      }
+      assert(field->offset < 256);
+      name->field_offset = field->offset;
+
+      if (!field->canon) {
+        field->canon = type_canon(field->type);
+      }
+      ast->type = field->canon;
+
+    } break;
+    case T_EQ:
+    case T_NEQ:
+      typecheck_expandable(ast->as.binaryop.rhs, state, ast->as.binaryop.lhs->type);
+      if (!type_is_kind(type, TY_INT) && !type_is_kind(type, TY_CHAR) && !type_is_kind(type, TY_PTR)) {
+        eprintf(ast->loc,
+                "invalid operation '%s' between '%s' and '%s'",
+                token_kind_to_string(ast->as.binaryop.op),
+                type_dump_to_string(ast->as.binaryop.lhs->type),
+                type_dump_to_string(ast->as.binaryop.rhs->type));
+      }
+      ast->type = ast->as.binaryop.lhs->type;
+      break;
+    case T_PLUS:
+    case T_MINUS:
+      if (type_is_kind(type, TY_PTR) && ast->as.binaryop.op == T_MINUS) {
+        typecheck(ast->as.binaryop.rhs, state);
+        if (type_is_kind(ast->as.binaryop.rhs->type, TY_INT)) {
+          ast->type = type;
+        } else if (type_is_kind(ast->as.binaryop.rhs->type, TY_PTR)) {
+          type_expect(ast->as.binaryop.lhs->loc, ast->as.binaryop.lhs->type, type);
+          ast->type = type_basic(TY_INT);
+        } else {
+          eprintf(ast->loc,
+                  "invalid operation '%s' between '%s' and '%s'",
+                  token_kind_to_string(ast->as.binaryop.op),
+                  type_dump_to_string(ast->as.binaryop.lhs->type),
+                  type_dump_to_string(ast->as.binaryop.rhs->type));
+        }
+      } else {
+        typecheck_expandable(ast->as.binaryop.rhs, state, type_basic(TY_INT));
+
+        if (type_is_kind(type, TY_INT) || type_is_kind(type, TY_PTR)) {
+          ast->type = type;
+        } else if (type->kind == TY_ARRAY) {
+          ast->type = type_intern((type_t){TY_PTR, 2, {.ptr = type->as.array.type}});
+          ast_t *lhs = ast->as.binaryop.lhs;
+          ast->as.binaryop.lhs = ast_malloc((ast_t){A_CAST, lhs->loc, NULL, {.cast = {ast->type, lhs}}});
+        } else {
+          eprintf(ast->loc,
+                  "invalid operation '%s' between '%s' and '%s'",
+                  token_kind_to_string(ast->as.binaryop.op),
+                  type_dump_to_string(ast->as.binaryop.lhs->type),
+                  type_dump_to_string(ast->as.binaryop.rhs->type));
+        }
+      }
+      break;
+    case T_SHR:
+    case T_SHL:
+    case T_STAR:
+    case T_SLASH:
+    case T_AND:
+      typecheck_expandable(ast->as.binaryop.lhs, state, type_basic(TY_INT));
+      typecheck_expandable(ast->as.binaryop.rhs, state, type_basic(TY_INT));
+      ast->type = type_basic(TY_INT);
+      break;
+    default:
+      printf("todo op: %s\n", token_kind_to_string(ast->as.binaryop.op));
+      TODO;
+  }
 }
 
 void typecheck(ast_t *ast, state_t *state) {
@@ -2996,184 +3532,110 @@ void typecheck(ast_t *ast, state_t *state) {
     case A_NONE:
       assert(0);
     case A_LIST:
-      assert(ast->as.binary.left);
-      typecheck(ast->as.binary.left, state);
-      typecheck(ast->as.binary.right, state);
-      ast->type = (type_t){TY_VOID, 0, {}};
+      for (int i = 0; i < ast->as.list.num; ++i) {
+        typecheck(ast->as.list.items[i], state);
+      }
+      ast->type = type_basic(TY_VOID);
       break;
     case A_BLOCK:
       state_push_scope(state);
       assert(ast->as.ast);
       typecheck(ast->as.ast, state);
       state_drop_scope(state);
-      ast->type = (type_t){TY_VOID, 0, {}};
+      ast->type = type_basic(TY_VOID);
       break;
     case A_RETURN:
       if (ast->as.ast) {
         typecheck_expect(ast->as.ast, state, state->ret_type);
       }
-      ast->type = (type_t){TY_VOID, 0, {}};
+      ast->type = type_basic(TY_VOID);
       break;
     case A_STATEMENT:
       assert(ast->as.ast);
       typecheck(ast->as.ast, state);
-      ast->type = (type_t){TY_VOID, 0, {}};
+      ast->type = type_basic(TY_VOID);
       break;
     case A_FUNCDECL:
+    {
+      double trace_start = trace_begin();
+      int types = type_table.type_num;
       // TODO: why not solve_type_alias there?
-      state_add_symbol(state, (symbol_t){ast->as.funcdecl.name, &ast->type, 0, {}});
+      // the type is known after the params, before the block that may recurse
+      ast->as.funcdecl.name.symbol = state_add_symbol(state, (symbol_t){.name = ast->as.funcdecl.name, .type = NULL}) + 1;
       state_push_scope(state);
       state->param = 0;
       typecheck(ast->as.funcdecl.params, state);
-      state_solve_type_alias(state, &ast->as.funcdecl.type);
-      ast->type = (type_t){TY_FUNC, ast->as.funcdecl.type.size, {.func = {&ast->as.funcdecl.type, ast->as.funcdecl.params ? &ast->as.funcdecl.params->type : NULL}}};
-      state->ret_type = *ast->type.as.func.ret;
+      state_solve_type_alias(state, ast->as.funcdecl.type);
+      ast->type = type_intern((type_t){TY_FUNC, 0, {.func = {type_canon(ast->as.funcdecl.type), ast->as.funcdecl.params ? ast->as.funcdecl.params->type : NULL}}});
+      state_symbol_of(state, ast->as.funcdecl.name)->type = ast->type;
+      state->ret_type = ast->type->as.func.ret;
       if (ast->as.funcdecl.block) {
         typecheck(ast->as.funcdecl.block, state);
       }
       state_drop_scope(state);
-      break;
+      trace_end("typecheck", ast->as.funcdecl.name.image, trace_start, 1, "types", type_table.type_num - types);
+    } break;
     case A_FUNCDEF:
-      state_add_symbol(state, (symbol_t){ast->as.funcdef.name, &ast->type, 0, {}});
+      ast->as.funcdef.name.symbol = state_add_symbol(state, (symbol_t){.name = ast->as.funcdef.name, .type = NULL}) + 1;
       state_push_scope(state);
       state->param = 0;
       typecheck(ast->as.funcdef.params, state);
-      state_solve_type_alias(state, &ast->as.funcdef.type);
-      ast->type =
-          (type_t){TY_FUNC,
-                   ast->as.funcdef.type.size,
-                   {.func = {&ast->as.funcdef.type,
-                             ast->as.funcdef.params ? &ast->as.funcdef.params->type : NULL}}};
+      state_solve_type_alias(state, ast->as.funcdef.type);
+      ast->type = type_intern((type_t){TY_FUNC, 0, {.func = {type_canon(ast->as.funcdef.type), ast->as.funcdef.params ? ast->as.funcdef.params->type : NULL}}});
+      state_symbol_of(state, ast->as.funcdef.name)->type = ast->type;
       state_drop_scope(state);
       break;
     case A_PARAMDEF:
     {
-      scope_t *scope = &state->scopes[state->scope_num - 1];
-      assert(scope->symbol_num + 1 < SYMBOL_MAX);
       ++state->param;
-      state_solve_type_alias(state, &ast->as.paramdef.type);
-      scope->symbols[scope->symbol_num++] = (symbol_t){
-          ast->as.paramdef.name, &ast->as.paramdef.type, INFO_LOCAL, {-1 - state->param}};
+      state_solve_type_alias(state, ast->as.paramdef.type);
+      type_t *type = type_canon(ast->as.paramdef.type);
+      ast->as.paramdef.name.symbol = state_add_symbol(state, (symbol_t){.name = ast->as.paramdef.name, .type = type, .kind = INFO_LOCAL}) + 1;
 
       typecheck(ast->as.paramdef.next, state);
-      ast->type = (type_t){TY_PARAM, ast->as.paramdef.type.size, {.list = {&ast->as.paramdef.type, ast->as.paramdef.next ? &ast->as.paramdef.next->type : NULL}}};
+      ast->type = type_intern((type_t){TY_PARAM, 0, {.list = {type, ast->as.paramdef.next ? ast->as.paramdef.next->type : NULL}}});
     } break;
     case A_BINARYOP:
     {
-      assert(ast->as.binaryop.lhs);
-      assert(ast->as.binaryop.rhs);
-      typecheck(ast->as.binaryop.lhs, state);
-      type_t *type = &ast->as.binaryop.lhs->type;
-
-      switch (ast->as.binaryop.op) {
-        case T_DOT:
-        {
-          assert(ast->as.binaryop.rhs->kind == A_SYM);
-
-          if (!type_is_kind(type, TY_STRUCT)) {
-            eprintf(ast->as.binaryop.lhs->loc,
-                    "expected a 'STRUCT', found '%s'",
-                    type_dump_to_string(type));
-          }
-
-          type_t *f = type->as.alias.type->as.struct_.fieldlist;
-          while (!sv_eq(f->as.fieldlist.name.image, ast->as.binaryop.rhs->as.fac.image)) {
-            f = f->as.fieldlist.next;
-          };
-          if (!f) {
-            eprintf(ast->as.binaryop.rhs->loc,
-                    "member not found in '%s'",
-                    type_dump_to_string(type->as.alias.type));
-          }
-
-          ast->type = *f->as.fieldlist.type;
-
-        } break;
-        case T_EQ:
-        case T_NEQ:
-          typecheck_expandable(ast->as.binaryop.rhs, state, ast->as.binaryop.lhs->type);
-          if (!type_is_kind(type, TY_INT) && !type_is_kind(type, TY_CHAR) && !type_is_kind(type, TY_PTR)) {
-            eprintf(ast->loc,
-                    "invalid operation '%s' between '%s' and '%s'",
-                    token_kind_to_string(ast->as.binaryop.op),
-                    type_dump_to_string(&ast->as.binaryop.lhs->type),
-                    type_dump_to_string(&ast->as.binaryop.rhs->type));
-          }
-          ast->type = ast->as.binaryop.lhs->type;
-          break;
-        case T_PLUS:
-        case T_MINUS:
-          if (type_is_kind(type, TY_PTR) && ast->as.binaryop.op == T_MINUS) {
-            typecheck(ast->as.binaryop.rhs, state);
-            if (type_is_kind(&ast->as.binaryop.rhs->type, TY_INT)) {
-              ast->type = *type;
-            } else if (type_is_kind(&ast->as.binaryop.rhs->type, TY_PTR)) {
-              type_expect(ast->as.binaryop.lhs->loc, &ast->as.binaryop.lhs->type, type);
-              ast->type = (type_t){TY_INT, 2, {}};
-            } else {
-              eprintf(ast->loc,
-                      "invalid operation '%s' between '%s' and '%s'",
-                      token_kind_to_string(ast->as.binaryop.op),
-                      type_dump_to_string(&ast->as.binaryop.lhs->type),
-                      type_dump_to_string(&ast->as.binaryop.rhs->type));
-            }
-          } else {
-            typecheck_expandable(ast->as.binaryop.rhs, state, (type_t){TY_INT, 2, {}});
-
-            if (type_is_kind(type, TY_INT) || type_is_kind(type, TY_PTR)) {
-              ast->type = *type;
-            } else if (type->kind == TY_ARRAY) {
-              ast->type = (type_t){TY_PTR, 2, {.ptr = type->as.array.type}};
-              ast_t *lhs = ast->as.binaryop.lhs;
-              ast->as.binaryop.lhs = ast_malloc((ast_t){A_CAST, lhs->loc, {}, {.cast = {ast->type, lhs}}});
-            } else {
-              eprintf(ast->loc,
-                      "invalid operation '%s' between '%s' and '%s'",
-                      token_kind_to_string(ast->as.binaryop.op),
-                      type_dump_to_string(&ast->as.binaryop.lhs->type),
-                      type_dump_to_string(&ast->as.binaryop.rhs->type));
-            }
-          }
-          break;
-        case T_SHR:
-        case T_SHL:
-        case T_STAR:
-        case T_SLASH:
-        case T_AND:
-          typecheck_expandable(ast->as.binaryop.lhs, state, (type_t){TY_INT, 2, {}});
-          typecheck_expandable(ast->as.binaryop.rhs, state, (type_t){TY_INT, 2, {}});
-          ast->type = (type_t){TY_INT, 2, {}};
-          break;
-        default:
-          printf("todo op: %s\n", token_kind_to_string(ast->as.binaryop.op));
-          TODO;
+      // a + b + c ... nests on the lhs as deep as the chain is long, so the
+      // chain is walked down with the stack and typed bottom up
+      int base = ast_walk.num;
+      ast_t *a = ast;
+      for (; a->kind == A_BINARYOP; a = a->as.binaryop.lhs) {
+        assert(a->as.binaryop.lhs);
+        assert(a->as.binaryop.rhs);
+        ast_walk_push(a, 0);
+      }
+      typecheck(a, state);
+      while (ast_walk.num > base) {
+        typecheck_binaryop(ast_walk.items[--ast_walk.num].ast, state);
       }
     } break;
     case A_UNARYOP:
       assert(ast->as.unaryop.arg);
       switch (ast->as.unaryop.op) {
         case T_MINUS:
-          typecheck_expandable(ast->as.unaryop.arg, state, (type_t){TY_INT, 2, {}});
-          ast->type.kind = TY_INT;
+          typecheck_expandable(ast->as.unaryop.arg, state, type_basic(TY_INT));
+          ast->type = type_basic(TY_INT);
           break;
         case T_AND:
           typecheck(ast->as.unaryop.arg, state);
-          ast->type = (type_t){TY_PTR, 2, {.ptr = &ast->as.unaryop.arg->type}};
+          ast->type = type_intern((type_t){TY_PTR, 2, {.ptr = ast->as.unaryop.arg->type}});
           break;
         case T_STAR:
           typecheck(ast->as.unaryop.arg, state);
-          if (type_is_kind(&ast->as.unaryop.arg->type, TY_PTR)) {
-            ast->type = *ast->as.unaryop.arg->type.as.ptr;
-          } else if (type_is_kind(&ast->as.unaryop.arg->type, TY_ARRAY)) {
-            ast->type = *ast->as.unaryop.arg->type.as.array.type;
+          if (type_is_kind(ast->as.unaryop.arg->type, TY_PTR)) {
+            ast->type = type_pass_alias(ast->as.unaryop.arg->type)->as.ptr;
+          } else if (type_is_kind(ast->as.unaryop.arg->type, TY_ARRAY)) {
+            ast->type = type_pass_alias(ast->as.unaryop.arg->type)->as.array.type;
           } else {
-            char *type = type_dump_to_string(&ast->as.unaryop.arg->type);
+            char *type = type_dump_to_string(ast->as.unaryop.arg->type);
             eprintf(ast->as.unaryop.arg->loc, "cannot dereference non PTR type: '%s'", type);
           }
           break;
         case T_NOT:
-          typecheck_expect(ast->as.unaryop.arg, state, (type_t){TY_INT, 2, {}});
-          ast->type = (type_t){TY_INT, 2, {}};
+          typecheck_expect(ast->as.unaryop.arg, state, type_basic(TY_INT));
+          ast->type = type_basic(TY_INT);
           break;
         default:
           TODO;
@@ -3181,58 +3643,64 @@ void typecheck(ast_t *ast, state_t *state) {
       break;
     case A_INT:
       if (ast->as.fac.kind == T_CHAR || (ast->as.fac.kind == T_HEX && ast->as.fac.image.len == 4)) {
-        ast->type = (type_t){TY_CHAR, 1, {}};
+        ast->type = type_basic(TY_CHAR);
       } else {
-        ast->type = (type_t){TY_INT, 2, {}};
+        ast->type = type_basic(TY_INT);
       }
       break;
     case A_STRING:
-      ast->type = (type_t){TY_PTR, 2, {.ptr = type_malloc((type_t){TY_CHAR, 1, {}})}};
+      ast->type = type_intern((type_t){TY_PTR, 2, {.ptr = type_basic(TY_CHAR)}});
       break;
     case A_SYM:
-      ast->type = *state_find_symbol(state, ast->as.fac)->type;
-      break;
+    {
+      symbol_t *s = state_find_symbol(state, ast->as.fac);
+      ast->as.fac.symbol = s - state->symbols + 1;
+      // value symbols hold canonical types, type symbols the solved ones
+      ast->type = s->kind == INFO_TYPE || s->kind == INFO_TYPEINCOMPLETE ? type_canon(s->type) : s->type;
+    } break;
     case A_GLOBDECL:
     case A_DECL:
-      state_solve_type_alias(state, &ast->as.decl.type);
+      state_solve_type_alias(state, ast->as.decl.type);
 
-      if (type_is_kind(&ast->as.decl.type, TY_ARRAY)
-          && ast->as.decl.type.as.array.len.kind == ARRAY_LEN_UNSET && ast->as.decl.expr == NULL) {
+      if (type_is_kind(ast->as.decl.type, TY_ARRAY)
+          && ast->as.decl.type->as.array.len.kind == ARRAY_LEN_UNSET && ast->as.decl.expr == NULL) {
         eprintf(ast->loc, "array without length uninitialized");
       }
-      if (type_is_kind(&ast->as.decl.type, TY_ARRAY)
-          && ast->as.decl.type.as.array.len.kind == ARRAY_LEN_EXPR) {
+      if (type_is_kind(ast->as.decl.type, TY_ARRAY)
+          && ast->as.decl.type->as.array.len.kind == ARRAY_LEN_EXPR) {
         if (ast->as.decl.expr != NULL) {
           eprintf(ast->loc, "array with variable length cannot be initialized");
         } else {
-          typecheck_expect(ast->as.decl.array_len, state, (type_t){TY_INT, 2, {}});
+          typecheck_expect(ast->as.decl.array_len, state, type_basic(TY_INT));
         }
       }
+      type_t *type = type_canon(ast->as.decl.type);
       if (ast->as.decl.expr) {
-        typecheck_expandable(ast->as.decl.expr, state, ast->as.decl.type);
-        if (type_is_kind(&ast->as.decl.type, TY_ARRAY)
-            && ast->as.decl.type.as.array.len.kind == ARRAY_LEN_UNSET) {
+        typecheck_expandable(ast->as.decl.expr, state, type);
+        if (type_is_kind(ast->as.decl.type, TY_ARRAY)
+            && ast->as.decl.type->as.array.len.kind == ARRAY_LEN_UNSET) {
           typecheck(ast->as.decl.expr, state);
-          ast->as.decl.type = ast->as.decl.expr->type;
+          type = ast->as.decl.expr->type;
+          ast->as.decl.type = type;
         }
-        ast->as.decl.expr->type = ast->as.decl.type;
+        ast->as.decl.expr->type = type;
       }
 
-      if (ast->as.decl.type.size == 0) {
-        eprintf(ast->loc, "variable has incomplete type: %s", type_dump_to_string(&ast->as.decl.type));
+      if (ast->as.decl.type->size == 0) {
+        eprintf(ast->loc, "variable has incomplete type: %s", type_dump_to_string(ast->as.decl.type));
       }
 
-      state_add_symbol(state, (symbol_t){ast->as.decl.name, &ast->as.decl.type, 0, {}});
-      ast->type = (type_t){TY_VOID, 0, {}};
+      ast->as.decl.name.symbol = state_add_symbol(state, (symbol_t){.name = ast->as.decl.name, .type = type, .kind = ast->kind == A_DECL ? INFO_LOCAL : INFO_GLOBAL}) + 1;
+      ast->type = type_basic(TY_VOID);
       break;
     case A_ASSIGN:
       assert(ast->as.binary.left);
       assert(ast->as.binary.right);
       typecheck(ast->as.binary.left, state);
-      if (type_is_kind(&ast->as.binary.left->type, TY_ARRAY)) {
+      if (type_is_kind(ast->as.binary.left->type, TY_ARRAY)) {
         eprintf(ast->loc, "assign to array");
       }
-      if (type_is_kind(&ast->as.binary.left->type, TY_ENUM)) {
+      if (type_is_kind(ast->as.binary.left->type, TY_ENUM)) {
         eprintf(ast->loc, "assign to enumerator");
       }
       typecheck_expect(ast->as.binary.right, state, ast->as.binary.left->type);
@@ -3241,6 +3709,7 @@ void typecheck(ast_t *ast, state_t *state) {
     case A_FUNCALL:
     {
       symbol_t *s = state_find_symbol(state, ast->as.funcall.name);
+      ast->as.funcall.name.symbol = s - state->symbols + 1;
       if (s->type->kind != TY_FUNC) {
         char *foundstr = type_dump_to_string(s->type);
         eprintf(ast->loc, "expected 'TY_FUNC', found '%s'", foundstr);
@@ -3252,73 +3721,74 @@ void typecheck(ast_t *ast, state_t *state) {
         eprintf(ast->loc, "too few parameters");
       }
       if (s->type->as.func.params) {
-        typecheck_expect(ast->as.funcall.params, state, *s->type->as.func.params);
+        typecheck_expect(ast->as.funcall.params, state, s->type->as.func.params);
       }
       assert(s->type->as.func.ret);
-      ast->type = *s->type->as.func.ret;
+      ast->type = s->type->as.func.ret;
     } break;
     case A_PARAM:
-      assert(ast->as.binary.left);
-      typecheck(ast->as.binary.left, state);
-      typecheck(ast->as.binary.right, state);
-      ast->type = (type_t){TY_PARAM,
-                           ast->as.binary.left->type.size,
-                           {.list = {&ast->as.binary.left->type,
-                                     ast->as.binary.right ? &ast->as.binary.right->type : NULL}}};
-      break;
     case A_ARRAY:
-      assert(ast->as.binary.left);
-      if (ast->as.binary.right) {
-        typecheck(ast->as.binary.left, state);
-        typecheck(ast->as.binary.right, state);
-        assert(type_is_kind(&ast->as.binary.right->type, TY_ARRAY));
-        type_cmp(&ast->as.binary.left->type, ast->as.binary.right->type.as.array.type);
-
-        type_t type = ast->as.binary.right->type;
-        type.as.array.len.num += 1;
-        type.size += ast->as.binary.left->type.size;
-        ast->type = type;
-      } else {
-        typecheck(ast->as.binary.left, state);
-        ast->type = (type_t){TY_ARRAY,
-                             ast->as.binary.left->type.size,
-                             {.array = {&ast->as.binary.left->type, .len = {ARRAY_LEN_NUM, 1}}}};
+    {
+      // the items are a chain on the right, typed in order and then every
+      // node gets the type of the rest of the chain from the last one
+      int base = ast_walk.num;
+      for (ast_t *a = ast; a; a = a->as.binary.right) {
+        assert(a->kind == ast->kind);
+        assert(a->as.binary.left);
+        typecheck(a->as.binary.left, state);
+        ast_walk_push(a, 0);
       }
-      break;
+      type_t *rest = NULL;
+      while (ast_walk.num > base) {
+        ast_t *a = ast_walk.items[--ast_walk.num].ast;
+        if (a->kind == A_PARAM) {
+          a->type = type_intern((type_t){TY_PARAM, 0, {.list = {a->as.binary.left->type, rest}}});
+        } else if (rest) {
+          type_t type = *rest;
+          type.as.array.len.num += 1;
+          a->type = type_intern(type);
+        } else {
+          a->type = type_intern((type_t){TY_ARRAY, 0, {.array = {a->as.binary.left->type, .len = {ARRAY_LEN_NUM, 1}}}});
+        }
+        rest = a->type;
+      }
+    } break;
     case A_TYPEDEF:
     {
-      type_t *type = &ast->as.typedef_.type;
+      type_t *type = ast->as.typedef_.type;
       if (type->kind == TY_STRUCT && type->as.struct_.name.kind != T_NONE) {
-        state_add_symbol(state, (symbol_t){type->as.struct_.name, type, INFO_TYPEINCOMPLETE, {}});
+        state_add_symbol(state, (symbol_t){.name = type->as.struct_.name, .type = type, .kind = INFO_TYPEINCOMPLETE});
       }
       if (type->kind == TY_ENUM) {
+        int i = 0;
         for (type_t *typei = type; typei; typei = typei->as.enum_.next) {
-          state_add_symbol(state, (symbol_t){typei->as.enum_.name, type, 0, {}});
+          state_add_symbol(state, (symbol_t){.name = typei->as.enum_.name, .type = type_canon(type), .kind = INFO_CONSTANT, .info = {.num = i++}});
         }
       }
 
       state_solve_type_alias(state, type);
       state_add_symbol(state,
-                       (symbol_t){ast->as.typedef_.name, &ast->as.typedef_.type, INFO_TYPE, {}});
-      ast->type = (type_t){TY_VOID, 0, {}};
+                       (symbol_t){.name = ast->as.typedef_.name, .type = ast->as.typedef_.type, .kind = INFO_TYPE});
+      ast->type = type_basic(TY_VOID);
     } break;
     case A_CAST:
-      state_solve_type_alias(state, &ast->as.cast.target);
+      state_solve_type_alias(state, ast->as.cast.target);
 
-      if (type_is_kind(&ast->as.cast.target, TY_STRUCT) && ast->as.cast.ast->kind == A_ARRAY) {
-        type_t *target = type_pass_alias(&ast->as.cast.target);
+      if (type_is_kind(ast->as.cast.target, TY_STRUCT) && ast->as.cast.ast->kind == A_ARRAY) {
+        type_t *target = type_pass_alias(ast->as.cast.target);
         type_t *f = target->as.struct_.fieldlist;
         ast_t *expr = ast->as.cast.ast;
 
         while (f && expr) {
           if (type_is_kind(f->as.fieldlist.type, TY_PTR) && expr->as.binary.left->kind == A_INT
               && expr->as.binary.left->as.fac.asint == 0) {
-            expr->as.binary.left->type = *f->as.fieldlist.type;
+            expr->as.binary.left->type = type_canon(f->as.fieldlist.type);
           } else {
-            typecheck_expect(expr->as.binary.left, state, *f->as.fieldlist.type);
+            typecheck_expect(expr->as.binary.left, state, type_canon(f->as.fieldlist.type));
           }
-          expr->type = *target;
-          expr->type.as.struct_.fieldlist = f;
+          type_t rest = *target;
+          rest.as.struct_.fieldlist = f;
+          expr->type = type_intern(rest);
 
           expr = expr->as.binary.right;
           f = f->as.fieldlist.next;
@@ -3338,61 +3808,302 @@ void typecheck(ast_t *ast, state_t *state) {
       } else {
         typecheck(ast->as.cast.ast, state);
 
-        if (type_is_kind(&ast->as.cast.target, TY_CHAR) && type_is_kind(&ast->as.cast.ast->type, TY_INT)) {
+        if (type_is_kind(ast->as.cast.target, TY_CHAR) && type_is_kind(ast->as.cast.ast->type, TY_INT)) {
         } else {
-          type_expect_expandable(ast->as.cast.ast->loc, &ast->as.cast.ast->type, &ast->as.cast.target);
+          type_expect_expandable(ast->as.cast.ast->loc, ast->as.cast.ast->type, type_canon(ast->as.cast.target));
         }
       }
-      ast->type = ast->as.cast.target;
+      ast->type = type_canon(ast->as.cast.target);
       break;
     case A_IF:
       assert(ast->as.if_.cond);
       typecheck(ast->as.if_.cond, state);
-      assert(type_is_kind(&ast->as.if_.cond->type, TY_INT)
-             || type_is_kind(&ast->as.if_.cond->type, TY_CHAR)
-             || type_is_kind(&ast->as.if_.cond->type, TY_PTR));
+      assert(type_is_kind(ast->as.if_.cond->type, TY_INT)
+             || type_is_kind(ast->as.if_.cond->type, TY_CHAR)
+             || type_is_kind(ast->as.if_.cond->type, TY_PTR));
       if (ast->as.if_.then) {
         typecheck(ast->as.if_.then, state);
       }
       if (ast->as.if_.else_) {
         typecheck(ast->as.if_.else_, state);
       }
-      ast->type = (type_t){TY_VOID, 0, {}};
+      ast->type = type_basic(TY_VOID);
       break;
     case A_WHILE:
       assert(ast->as.binary.left);
-      typecheck_expandable(ast->as.binary.left, state, (type_t){TY_INT, 2, {}});
+      typecheck_expandable(ast->as.binary.left, state, type_basic(TY_INT));
       if (ast->as.binary.right) {
         typecheck(ast->as.binary.right, state);
       }
-      ast->type = (type_t){TY_VOID, 0, {}};
+      ast->type = type_basic(TY_VOID);
       break;
     case A_ASM:
-      ast->type = (type_t){TY_VOID, 0, {}};
+      ast->type = type_basic(TY_VOID);
       break;
     case A_EXTERN:
       typecheck(ast->as.ast, state);
-      ast->type = (type_t){TY_VOID, 0, {}};
+      ast->type = type_basic(TY_VOID);
       break;
     case A_BREAK:
-      ast->type = (type_t){TY_VOID, 0, {}};
+      ast->type = type_basic(TY_VOID);
       break;
   }
 }
 
-void optimize_ast(ast_t **astp, bool debug_opt, optlevel_t opt) {
-  assert(astp);
-  ast_t *ast = *astp;
-  if (!ast) {
-    return;
-  }
+// the remarks of -d opt, one line for every rewrite of the optimizers and for
+// every spot they could not improve:
+//   <location>: remark <passed|missed> <pass> <rule> [<function>+<index>] [(saved <n> <unit>)]: <text>
+// --opt-stats sums them up
+typedef enum {
+  OR_IF_EQ,
+  OR_IF_NOT,
+  OR_WHILE_EQ,
+  OR_MUL_BUILTIN,
+  OR_DIV_BUILTIN,
+  OR_SHIFT_BUILTIN,
+  OR_CONST_FOLD,
+  OR_CONST_COND,
+  OR_CONST_PROP,
+  OR_CONST_BRANCH,
+  OR_JUMP_THREAD,
+  OR_UNREACHABLE,
+  OR_JUMP_NEXT,
+  OR_UNUSED_LABEL,
+  OR_DEAD_VALUE,
+  OR_UNUSED_FUNCTION,
+  OR_UNUSED_DATA,
+  OR_COUNT,
+} opt_remark_t;
 
-  switch (ast->kind) {
-    case A_NONE:
-      assert(0);
-    case A_PARAMDEF:
-    case A_INT:
+typedef struct {
+  char *name;
+  char *pass;
+  bool missed;
+  int saved; // ir ops a hit saves, the == and ! cost 5 to materialize, a constant condition at least its test
+  int hits;
+  int total; // ir ops saved by all the hits, the cfg rewrites save a varying number
+} opt_remark_info_t;
+
+opt_remark_info_t opt_remarks[OR_COUNT] = {
+  [OR_IF_EQ] = {"if-eq", "ast", false, 5, 0},
+  [OR_IF_NOT] = {"if-not", "ast", false, 5, 0},
+  [OR_WHILE_EQ] = {"while-eq", "ast", false, 5, 0},
+  [OR_MUL_BUILTIN] = {"mul-builtin", "compile", true, 0, 0},
+  [OR_DIV_BUILTIN] = {"div-builtin", "compile", true, 0, 0},
+  [OR_SHIFT_BUILTIN] = {"shift-builtin", "compile", true, 0, 0},
+  [OR_CONST_FOLD] = {"const-fold", "ast", false, 2, 0},
+  [OR_CONST_COND] = {"const-cond", "ast", false, 2, 0},
+  [OR_CONST_PROP] = {"const-prop", "cfg", false, 1, 0},
+  [OR_CONST_BRANCH] = {"const-branch", "cfg", false, 1, 0},
+  [OR_JUMP_THREAD] = {"jump-thread", "cfg", false, 0, 0},
+  [OR_UNREACHABLE] = {"unreachable", "cfg", false, 0, 0},
+  [OR_JUMP_NEXT] = {"jump-next", "cfg", false, 1, 0},
+  [OR_UNUSED_LABEL] = {"unused-label", "cfg", false, 1, 0},
+  [OR_DEAD_VALUE] = {"dead-value", "cfg", false, 0, 0},
+  [OR_UNUSED_FUNCTION] = {"unused-function", "callgraph", false, 0, 0},
+  [OR_UNUSED_DATA] = {"unused-data", "callgraph", false, 0, 0},
+};
+
+typedef struct {
+  sv_t name;
+  location_t loc;
+} remark_function_t;
+
+struct {
+  bool print; // -d opt
+  bool stats; // --opt-stats
+  // where the functions are declared, the ir and the asm remarks point there
+  remark_function_t *functions;
+  int function_num;
+  int function_cap;
+} remarks = {0};
+
+void remark_function_add(token_t name) {
+  remark_function_t function = {name.image, name.loc};
+  DA_APPEND(remarks.functions, remarks.function_num, remarks.function_cap, function);
+}
+
+remark_function_t *remark_function_find(sv_t name) {
+  for (int i = 0; i < remarks.function_num; ++i) {
+    if (sv_eq(remarks.functions[i].name, name)) {
+      return &remarks.functions[i];
+    }
+  }
+  return NULL;
+}
+
+void remarks_free() {
+  free(remarks.functions);
+  remarks.functions = NULL;
+  remarks.function_num = 0;
+  remarks.function_cap = 0;
+}
+
+// prints the remark up to its text, that the caller ends with a newline,
+// function is NULL outside of the functions, unit is NULL if nothing is saved
+void remark_start(location_t *loc, bool missed, char *pass, char *rule, remark_function_t *function, int index, int saved, char *unit) {
+  if (loc) {
+    printf(LOCATION_FMT ": ", LOCATION_UNPACK(*loc));
+  } else {
+    printf("-: ");
+  }
+  printf("remark %s %s %s", missed ? "missed" : "passed", pass, rule);
+  if (function) {
+    printf(" " SV_FMT "+%d", SV_UNPACK(function->name), index);
+  }
+  if (unit) {
+    printf(" (saved %d %s)", saved, unit);
+  }
+  printf(": ");
+}
+
+// counts the remark, with -d opt prints it and returns true for the caller to add the text
+bool opt_remark(opt_remark_t remark, location_t loc) {
+  assert(remark < OR_COUNT);
+  opt_remark_info_t *info = &opt_remarks[remark];
+  info->hits++;
+  info->total += info->saved;
+  if (remarks.print) {
+    remark_start(&loc, info->missed, info->pass, info->name, NULL, 0, info->saved, info->missed ? NULL : "ir");
+  }
+  return remarks.print;
+}
+
+// the types whose values are plain numbers
+bool type_is_integer(type_t *type) {
+  return type_is_kind(type, TY_INT) || type_is_kind(type, TY_CHAR) || type_is_kind(type, TY_ENUM);
+}
+
+bool ast_is_const(ast_t *ast) {
+  return ast && ast->kind == A_INT && type_is_integer(ast->type);
+}
+
+ast_t *ast_const(ast_t *ast, int value) {
+  value &= 0xFFFF;
+  int len = snprintf(NULL, 0, "%d", value);
+  char *image = alloc(R_AST, len + 1);
+  snprintf(image, len + 1, "%d", value);
+  token_t token = {T_INT, {image, len}, ast->loc, {value}};
+  return ast_malloc((ast_t){A_INT, ast->loc, ast->type, {.fac = token}});
+}
+
+// the value of an operation between constants as the 16 bits Jaris computes
+// it, false if it is not known at compile time
+bool ast_fold_value(ast_t *ast, state_t *state, int *value) {
+  switch (ast->kind) {
     case A_SYM:
+    {
+      symbol_t *s = state_symbol_of(state, ast->as.fac);
+      *value = s->info.num;
+      return s->kind == INFO_CONSTANT;
+    }
+    case A_CAST:
+      if (!ast_is_const(ast->as.cast.ast) || !type_is_integer(ast->type)) {
+        return false;
+      }
+      // a narrowing cast keeps the low byte
+      *value = ast->as.cast.ast->as.fac.asint & (type_is_kind(ast->type, TY_CHAR) ? 0xFF : 0xFFFF);
+      return true;
+    case A_UNARYOP:
+    {
+      if (!ast_is_const(ast->as.unaryop.arg)) {
+        return false;
+      }
+      int a = ast->as.unaryop.arg->as.fac.asint;
+      switch (ast->as.unaryop.op) {
+        case T_MINUS: *value = -a; return true;
+        case T_NOT: *value = a == 0; return true;
+        default: return false;
+      }
+    }
+    case A_BINARYOP:
+    {
+      if (!ast_is_const(ast->as.binaryop.lhs) || !ast_is_const(ast->as.binaryop.rhs)
+          || !type_is_integer(ast->type)) {
+        return false;
+      }
+      int a = ast->as.binaryop.lhs->as.fac.asint;
+      int b = ast->as.binaryop.rhs->as.fac.asint;
+      switch (ast->as.binaryop.op) {
+        case T_PLUS: *value = a + b; return true;
+        case T_MINUS: *value = a - b; return true;
+        case T_STAR: *value = (uint32_t)a * (uint32_t)b & 0xFFFF; return true;
+        case T_SHL: *value = b < 16 ? a << b : 0; return true;
+        case T_SHR: *value = b < 16 ? a >> b : 0; return true;
+        case T_AND: *value = a & b; return true;
+        case T_EQ: *value = a == b; return true;
+        case T_NEQ: *value = a != b; return true;
+        // the division is left to the builtin for the negative numbers
+        case T_SLASH: *value = b != 0 ? a / b : 0; return b != 0 && a < 0x8000 && b < 0x8000;
+        default: return false;
+      }
+    }
+    default:
+      return false;
+  }
+}
+
+// replaces an operation between constants, or an enum constant, with its value
+ast_t *ast_fold(ast_t *ast, state_t *state, optlevel_t opt) {
+  int value;
+  if (opt < OL_MATH || !ast_fold_value(ast, state, &value)) {
+    return ast;
+  }
+  ast_t *folded = ast_const(ast, value);
+  // enum constants and casts already compile to a single INT
+  if ((ast->kind == A_BINARYOP || ast->kind == A_UNARYOP) && opt_remark(OR_CONST_FOLD, ast->loc)) {
+    ast_dump(ast, 0);
+    printf(" -> %d\n", folded->as.fac.asint);
+  }
+  return folded;
+}
+
+ast_t *ast_empty(location_t loc) {
+  return ast_malloc((ast_t){A_LIST, loc, NULL, {.list = {NULL, 0}}});
+}
+
+// an if or a while with a constant condition is replaced by the code that runs,
+// the condition of an endless while is dropped, returns false if it is not constant
+bool optimize_const_cond(ast_t **astp, optlevel_t opt) {
+  ast_t *ast = *astp;
+  ast_t *cond = ast->kind == A_IF ? ast->as.if_.cond : ast->as.binary.left;
+  if (opt < OL_MATH || !ast_is_const(cond)) {
+    return false;
+  }
+  if (opt_remark(OR_CONST_COND, ast->loc)) {
+    ast_dump(ast, 0);
+    printf(" -> ");
+  }
+
+  bool taken = cond->as.fac.asint != 0;
+  if (ast->kind == A_IF) {
+    ast_t *code = taken ? ast->as.if_.then : ast->as.if_.else_;
+    *astp = code ? code : ast_empty(ast->loc);
+  } else if (taken) {
+    ast->as.binary.left = NULL;
+  } else {
+    *astp = ast_empty(ast->loc);
+  }
+
+  if (remarks.print) {
+    ast_dump(*astp, 0);
+    printf("\n");
+  }
+  return true;
+}
+
+void optimize_ast(ast_t **astp, state_t *state, optlevel_t opt) {
+  assert(astp);
+  ast_t *ast = *astp;
+  if (!ast) {
+    return;
+  }
+
+  switch (ast->kind) {
+    case A_NONE:
+      assert(0);
+    case A_PARAMDEF:
+    case A_INT:
     case A_STRING:
     case A_TYPEDEF:
     case A_ASM:
@@ -3400,46 +4111,79 @@ void optimize_ast(ast_t **astp, bool debug_opt, optlevel_t opt) {
     case A_EXTERN:
     case A_BREAK:
       break;
+    case A_SYM:
+      *astp = ast_fold(ast, state, opt);
+      break;
     case A_LIST:
+      for (int i = 0; i < ast->as.list.num; ++i) {
+        optimize_ast(&ast->as.list.items[i], state, opt);
+      }
+      break;
     case A_ASSIGN:
+      optimize_ast(&ast->as.binary.left, state, opt);
+      optimize_ast(&ast->as.binary.right, state, opt);
+      break;
     case A_ARRAY:
     case A_PARAM:
-      optimize_ast(&ast->as.binary.left, debug_opt, opt);
-      optimize_ast(&ast->as.binary.right, debug_opt, opt);
+      for (ast_t *a = ast; a; a = a->as.binary.right) {
+        optimize_ast(&a->as.binary.left, state, opt);
+      }
       break;
     case A_FUNCDECL:
-      optimize_ast(&ast->as.funcdecl.block, debug_opt, opt);
+      optimize_ast(&ast->as.funcdecl.block, state, opt);
       break;
     case A_STATEMENT:
     case A_RETURN:
     case A_BLOCK:
-      optimize_ast(&ast->as.ast, debug_opt, opt);
+      optimize_ast(&ast->as.ast, state, opt);
       break;
     case A_BINARYOP:
     {
-      ast_t *a = ast->as.binaryop.lhs;
-      ast_t *b = ast->as.binaryop.rhs;
-      optimize_ast(&a, debug_opt, opt);
-      optimize_ast(&b, debug_opt, opt);
+      // the chains on the lhs are walked in a loop and folded from the bottom
+      int base = ast_walk.num;
+      ast_t *a = ast;
+      for (; a->kind == A_BINARYOP; a = a->as.binaryop.lhs) {
+        ast_walk_push(a, 0);
+        // the field after a DOT is not a symbol
+        if (a->as.binaryop.op != T_DOT) {
+          optimize_ast(&a->as.binaryop.rhs, state, opt);
+        }
+      }
+      optimize_ast(&ast_walk.items[ast_walk.num - 1].ast->as.binaryop.lhs, state, opt);
+      while (ast_walk.num > base) {
+        ast_t *folded = ast_fold(ast_walk.items[--ast_walk.num].ast, state, opt);
+        if (ast_walk.num > base) {
+          ast_walk.items[ast_walk.num - 1].ast->as.binaryop.lhs = folded;
+        } else {
+          *astp = folded;
+        }
+      }
     } break;
     case A_UNARYOP:
-      optimize_ast(&ast->as.unaryop.arg, debug_opt, opt);
+      optimize_ast(&ast->as.unaryop.arg, state, opt);
+      *astp = ast_fold(ast, state, opt);
       break;
     case A_DECL:
     case A_GLOBDECL:
-      optimize_ast(&ast->as.decl.expr, debug_opt, opt);
+      optimize_ast(&ast->as.decl.expr, state, opt);
       break;
     case A_FUNCALL:
-      optimize_ast(&ast->as.funcall.params, debug_opt, opt);
+      optimize_ast(&ast->as.funcall.params, state, opt);
       break;
     case A_CAST:
-      optimize_ast(&ast->as.cast.ast, debug_opt, opt);
+      optimize_ast(&ast->as.cast.ast, state, opt);
+      *astp = ast_fold(ast, state, opt);
       break;
     case A_IF:
     {
+      optimize_ast(&ast->as.if_.cond, state, opt);
       ast_t *cond = ast->as.if_.cond;
+      if (optimize_const_cond(astp, opt)) {
+        optimize_ast(astp, state, opt);
+        break;
+      }
       if (opt >= OL_BASE && cond->kind == A_BINARYOP && (cond->as.binaryop.op == T_EQ || cond->as.binaryop.op == T_NEQ)) {
-        if (debug_opt) {
+        if (opt_remark(OR_IF_EQ, ast->loc)) {
           ast_dump(ast, 0);
           printf(" -> ");
         }
@@ -3451,81 +4195,80 @@ void optimize_ast(ast_t **astp, bool debug_opt, optlevel_t opt) {
         }
         cond->as.binaryop.op = T_MINUS;
 
-        if (debug_opt) {
+        if (remarks.print) {
           ast_dump(ast, 0);
           printf("\n");
         }
 
       } else if (opt >= OL_BASE && cond->kind == A_UNARYOP && cond->as.unaryop.op == T_NOT) {
-        if (debug_opt) {
+        if (opt_remark(OR_IF_NOT, ast->loc)) {
           ast_dump(ast, 0);
           printf(" -> ");
         }
 
         ast->as.if_.cond = cond->as.unaryop.arg;
-        free_ptr(cond);
 
         ast_t *then = ast->as.if_.then;
         ast->as.if_.then = ast->as.if_.else_;
         ast->as.if_.else_ = then;
 
-        if (debug_opt) {
+        if (remarks.print) {
           ast_dump(ast, 0);
           printf("\n");
         }
       }
 
-      optimize_ast(&cond, debug_opt, opt);
-      optimize_ast(&ast->as.if_.then, debug_opt, opt);
-      optimize_ast(&ast->as.if_.else_, debug_opt, opt);
+      optimize_ast(&ast->as.if_.then, state, opt);
+      optimize_ast(&ast->as.if_.else_, state, opt);
     } break;
     case A_WHILE:
     {
+      optimize_ast(&ast->as.binary.left, state, opt);
       ast_t *cond = ast->as.binary.left;
-      if (cond->kind == A_BINARYOP
-          && (cond->as.binaryop.op == T_EQ || cond->as.binaryop.op == T_NEQ)) {
-        if (debug_opt) {
+      if (optimize_const_cond(astp, opt)) {
+        if (*astp != ast) {
+          break;
+        }
+      } else if (cond->kind == A_BINARYOP
+                 && (cond->as.binaryop.op == T_EQ || cond->as.binaryop.op == T_NEQ)) {
+        if (opt_remark(OR_WHILE_EQ, ast->loc)) {
           ast_dump(ast, 0);
           printf(" -> ");
         }
 
-        cond->as.binaryop.op = T_MINUS;
         if (cond->as.binaryop.op == T_EQ) {
           ast->as.binary.left =
               ast_malloc((ast_t){A_UNARYOP, cond->loc, cond->type, {.unaryop = {T_NOT, cond}}});
         }
+        cond->as.binaryop.op = T_MINUS;
 
-        if (debug_opt) {
+        if (remarks.print) {
           ast_dump(ast, 0);
           printf("\n");
         }
       }
 
-      optimize_ast(&cond, debug_opt, opt);
-      optimize_ast(&ast->as.binary.right, debug_opt, opt);
+      optimize_ast(&ast->as.binary.right, state, opt);
     } break;
   }
 }
 
 void data(compiled_t *compiled, bytecode_t b) {
   assert(compiled);
-  assert(compiled->data_num + 1 < DATA_MAX);
   if (compiled->data_num > 0 && compiled->data[compiled->data_num - 1].kind == BDB
       && b.kind == BDB) {
     compiled->data[compiled->data_num - 1].arg.num += b.arg.num;
     return;
   }
-  compiled->data[compiled->data_num++] = b;
+  DA_APPEND(compiled->data, compiled->data_num, compiled->data_cap, b);
 }
 
 void code(compiled_t *compiled, bytecode_t b) {
   assert(compiled);
   if (compiled->is_init) {
-    assert(compiled->init_num + 1 < CODE_MAX);
-    compiled->init[compiled->init_num++] = b;
+    DA_APPEND(compiled->init, compiled->init_num, compiled->init_cap, b);
   } else {
-    assert(compiled->code_num + 1 < CODE_MAX);
-    compiled->code[compiled->code_num++] = b;
+    DA_APPEND(compiled->code, compiled->code_num, compiled->code_cap, b);
   }
 }
 
@@ -3564,7 +4307,7 @@ void get_addr_ast(state_t *state, ast_t *ast) {
   switch (ast->kind) {
     case A_SYM:
     {
-      symbol_t *s = state_find_symbol(state, ast->as.fac);
+      symbol_t *s = state_symbol_of(state, ast->as.fac);
       if (s->kind == INFO_LOCAL) {
         state_add_ir(state, (ir_t){IR_ADDR_LOCAL, {.num = state->sp - s->info.local}});
       } else if (s->kind == INFO_GLOBAL) {
@@ -3576,7 +4319,7 @@ void get_addr_ast(state_t *state, ast_t *ast) {
     } break;
     case A_UNARYOP:
       assert(ast->as.unaryop.op == T_STAR);
-      assert(type_is_kind(&ast->as.unaryop.arg->type, TY_PTR));
+      assert(type_is_kind(ast->as.unaryop.arg->type, TY_PTR));
       compile(ast->as.unaryop.arg, state);
       break;
     case A_BINARYOP:
@@ -3584,20 +4327,7 @@ void get_addr_ast(state_t *state, ast_t *ast) {
         case T_DOT:
         {
           get_addr_ast(state, ast->as.binaryop.lhs);
-          unsigned int offset = 0;
-          type_t *f = ast->as.binaryop.lhs->type.as.alias.type->as.struct_.fieldlist;
-          while (!sv_eq(f->as.fieldlist.name.image, ast->as.binaryop.rhs->as.fac.image)) {
-            if (type_is_kind(f->as.fieldlist.type, TY_CHAR) && f->as.fieldlist.next
-                && !type_is_kind(f->as.fieldlist.next->as.fieldlist.type, TY_CHAR)) {
-              offset += 2;
-            } else {
-              offset += f->as.fieldlist.type->size;
-            }
-            f = f->as.fieldlist.next;
-          };
-          assert(f);
-          assert(offset < 256);
-
+          int offset = ast->as.binaryop.rhs->as.fac.field_offset;
           if (offset > 0) {
             state_add_addr_offset(state, offset);
           }
@@ -3605,9 +4335,9 @@ void get_addr_ast(state_t *state, ast_t *ast) {
         case T_PLUS:
         case T_MINUS:
         {
-          assert(type_is_kind(&ast->type, TY_PTR));
+          assert(type_is_kind(ast->type, TY_PTR));
           get_addr_ast(state, ast->as.binaryop.lhs);
-          int size = ast->type.as.ptr->size;
+          int size = ast->type->as.ptr->size;
           if (ast->as.binaryop.rhs->kind == A_INT) {
             state_add_addr_offset(state, ast->as.binaryop.rhs->as.fac.asint * size);
           } else {
@@ -3640,7 +4370,7 @@ void compile_data(ast_t *ast, state_t *state, int uli, int offset) {
 
   switch (ast->kind) {
     case A_CAST:
-      if (type_is_kind(&ast->as.cast.target, TY_PTR) && type_is_kind(&ast->as.cast.ast->type, TY_ARRAY)) {
+      if (type_is_kind(ast->as.cast.target, TY_PTR) && type_is_kind(ast->as.cast.ast->type, TY_ARRAY)) {
         data(compiled, (bytecode_t){BDB, 0, {.num = 2}});
 
         state->is_init = true;
@@ -3651,7 +4381,7 @@ void compile_data(ast_t *ast, state_t *state, int uli, int offset) {
 
       } else {
         compile_data(ast->as.cast.ast, state, uli, 0);
-        int delta = type_size_aligned(&ast->as.cast.target) - type_size_aligned(&ast->as.cast.ast->type);
+        int delta = type_size_aligned(ast->as.cast.target) - type_size_aligned(ast->as.cast.ast->type);
         assert(delta >= 0);
         if (delta > 0) {
           data(compiled, (bytecode_t){BDB, 0, {.num = delta}});
@@ -3659,7 +4389,7 @@ void compile_data(ast_t *ast, state_t *state, int uli, int offset) {
       }
       break;
     case A_ARRAY:
-      if (type_is_kind(&ast->type, TY_ARRAY) && type_is_kind(ast->type.as.array.type, TY_PTR)) {
+      if (type_is_kind(ast->type, TY_ARRAY) && type_is_kind(ast->type->as.array.type, TY_PTR)) {
         int ulis[256];
         int uli_count = 0;
 
@@ -3687,15 +4417,15 @@ void compile_data(ast_t *ast, state_t *state, int uli, int offset) {
         }
 
       } else {
-        compile_data(ast->as.binary.left, state, uli, offset);
-        if (ast->as.binary.right) {
-          compile_data(ast->as.binary.right, state, uli, offset + ast->as.binary.left->type.size);
+        for (ast_t *a = ast; a; a = a->as.binary.right) {
+          compile_data(a->as.binary.left, state, uli, offset);
+          offset += a->as.binary.left->type->size;
         }
       }
       break;
     case A_INT:
       data(compiled,
-           (bytecode_t){ast->type.size == 2 ? BHEX2 : BHEX, 0, {.num = ast->as.fac.asint}});
+           (bytecode_t){ast->type->size == 2 ? BHEX2 : BHEX, 0, {.num = ast->as.fac.asint}});
       break;
     case A_STRING:
     {
@@ -3716,7 +4446,7 @@ void compile_data(ast_t *ast, state_t *state, int uli, int offset) {
     } break;
     default:
     {
-      int size = ast->type.size;
+      int size = ast->type->size;
       data(compiled, (bytecode_t){BDB, 0, {.num = size}});
       state->is_init = true;
       compile(ast, state);
@@ -3727,6 +4457,103 @@ void compile_data(ast_t *ast, state_t *state, int uli, int offset) {
   }
 }
 
+// the code of a binary operation before its lhs, returns what
+// compile_binaryop_post needs
+int compile_binaryop_pre(ast_t *ast, state_t *state) {
+  switch (ast->as.binaryop.op) {
+    case T_EQ:
+    case T_NEQ:
+      state_add_ir(state, (ir_t){IR_INT, {.num = ast->as.binaryop.op == T_EQ}});
+      compile(ast->as.binaryop.rhs, state);
+      break;
+    case T_SHL:
+    case T_SHR:
+      if (ast->as.binaryop.rhs->kind == A_INT) {
+        break;
+      }
+      __attribute__((fallthrough));
+    case T_STAR:
+    case T_SLASH:
+      // the return value of the builtin
+      state_add_ir(state, (ir_t){IR_CHANGE_SP, {.num = 2}});
+      break;
+    default:
+      break;
+  }
+  return state->sp;
+}
+
+// the code after the lhs
+void compile_binaryop_post(ast_t *ast, state_t *state, int start_sp) {
+  switch (ast->as.binaryop.op) {
+    case T_PLUS:
+    case T_MINUS:
+      compile(ast->as.binaryop.rhs, state);
+      if (type_is_kind(ast->type, TY_PTR)) {
+        state_add_ir(state, (ir_t){IR_MUL, {.num = ast->type->as.ptr->size}});
+        state_add_ir(state, (ir_t){IR_OPERATION, {.inst = ast->as.binaryop.op == T_PLUS ? SUM : SUB}});
+      } else if (ast->as.binaryop.op == T_MINUS && ast->type->kind == TY_INT && type_is_kind(ast->as.binaryop.lhs->type, TY_PTR) && type_is_kind(ast->as.binaryop.rhs->type, TY_PTR)) {
+        state_add_ir(state, (ir_t){IR_OPERATION, {.inst = SUB}});
+        state_add_ir(state, (ir_t){IR_DIV, {.num = ast->as.binaryop.lhs->type->as.ptr->size}});
+      } else {
+        state_add_ir(state, (ir_t){IR_OPERATION, {.inst = ast->as.binaryop.op == T_PLUS ? SUM : SUB}});
+      }
+      break;
+    case T_EQ:
+    case T_NEQ:
+    {
+      state_add_ir(state, (ir_t){IR_OPERATION, {.inst = SUB}});
+
+      int a = state->uli++;
+      state_add_ir(state, (ir_t){IR_JMPZ, {.num = a}});
+      state_add_ir(state, (ir_t){IR_CHANGE_SP, {.num = -2}});
+      state_add_ir(state, (ir_t){IR_INT, {.num = ast->as.binaryop.op != T_EQ}});
+      state_add_ir(state, (ir_t){IR_SETULI, {.num = a}});
+    } break;
+    case T_SHL:
+    case T_SHR:
+    {
+      if (ast->as.binaryop.rhs->kind != A_INT) {
+        if (opt_remark(OR_SHIFT_BUILTIN, ast->loc)) {
+          printf("the shift amount is not a constant, '%s' calls the %s builtin\n",
+                 ast->as.binaryop.op == T_SHL ? "<<" : ">>",
+                 ast->as.binaryop.op == T_SHL ? shiftl_string : shiftr_string);
+        }
+        compile(ast->as.binaryop.rhs, state);
+        sv_t name = sv_from_cstr(ast->as.binaryop.op == T_SHL ? shiftl_string : shiftr_string);
+        state_add_ir(state, (ir_t){IR_CALL, {.call = {name, state->sp - start_sp + 2}}});
+        state_add_ir(state, (ir_t){IR_CHANGE_SP, {.num = start_sp - state->sp}});
+        state_add_builtin(state, ast->as.binaryop.op == T_SHL ? BE_SHIFTL : BE_SHIFTR);
+        break;
+      }
+      ir_t ir = {IR_OPERATION, {.inst = ast->as.binaryop.op == T_SHL ? SHL : SHR}};
+      for (int i = 0; i < ast->as.binaryop.rhs->as.fac.asint; ++i) {
+        state_add_ir(state, ir);
+      }
+    } break;
+    case T_AND:
+      compile(ast->as.binaryop.rhs, state);
+      state_add_ir(state, (ir_t){IR_OPERATION, {.inst = AND}});
+      break;
+    case T_STAR:
+    case T_SLASH:
+      if (opt_remark(ast->as.binaryop.op == T_STAR ? OR_MUL_BUILTIN : OR_DIV_BUILTIN, ast->loc)) {
+        printf("'%s' calls the %s builtin\n",
+               ast->as.binaryop.op == T_STAR ? "*" : "/",
+               ast->as.binaryop.op == T_STAR ? mul_string : div_string);
+      }
+      compile(ast->as.binaryop.rhs, state);
+      sv_t name = ast->as.binaryop.op == T_STAR ? (sv_t){mul_string, 3} : (sv_t){div_string, 3};
+      state_add_ir(state, (ir_t){IR_CALL, {.call = {name, state->sp - start_sp + 2}}});
+      state_add_ir(state, (ir_t){IR_CHANGE_SP, {.num = start_sp - state->sp}});
+      state_add_builtin(state, ast->as.binaryop.op == T_STAR ? BE_MUL : BE_DIV);
+      break;
+    default:
+      printf("BINARYOP %s\n", token_kind_to_string(ast->as.binaryop.op));
+      TODO;
+  }
+}
+
 void compile(ast_t *ast, state_t *state) {
   assert(state);
   assert(ast);
@@ -3737,28 +4564,32 @@ void compile(ast_t *ast, state_t *state) {
     case A_NONE:
       assert(0);
     case A_LIST:
-      compile(ast->as.binary.left, state);
-      if (ast->as.binary.right) {
-        compile(ast->as.binary.right, state);
+      for (int i = 0; i < ast->as.list.num; ++i) {
+        compile(ast->as.list.items[i], state);
       }
       break;
     case A_BLOCK:
     {
       int start_sp = state->sp;
-      state_push_scope(state);
       compile(ast->as.ast, state);
-      state_drop_scope(state);
       state_add_ir(state, (ir_t){IR_CHANGE_SP, {.num = -(state->sp - start_sp)}});
     } break;
     case A_PARAM:
-      if (ast->as.binary.right) {
-        compile(ast->as.binary.right, state);
+    {
+      // pushed from the last one
+      int base = ast_walk.num;
+      for (ast_t *a = ast; a; a = a->as.binary.right) {
+        ast_walk_push(a, 0);
       }
-      compile(ast->as.binary.left, state);
-      break;
+      while (ast_walk.num > base) {
+        compile(ast_walk.items[--ast_walk.num].ast->as.binary.left, state);
+      }
+    } break;
     case A_FUNCDECL:
-      state_add_symbol(state, (symbol_t){ast->as.funcdecl.name, &ast->type, 0, {}});
-      state_push_scope(state);
+    {
+      double trace_start = trace_begin();
+      int ir_start = state->ir_num;
+      remark_function_add(ast->as.funcdecl.name);
       state->param = 4;
       if (ast->as.funcdecl.params) {
         compile(ast->as.funcdecl.params, state);
@@ -3773,14 +4604,13 @@ void compile(ast_t *ast, state_t *state) {
         state_add_ir(state, (ir_t){IR_CHANGE_SP, {.num = -state->sp}});
         state_add_ir(state, (ir_t){IR_FUNCEND, {}});
       }
-      state_drop_scope(state);
-      break;
+      trace_end("compile", ast->as.funcdecl.name.image, trace_start, 1, "ir", state->ir_num - ir_start);
+    } break;
     case A_FUNCDEF:
-      state_add_symbol(state, (symbol_t){ast->as.funcdecl.name, &ast->type, 0, {}});
       break;
     case A_PARAMDEF:
-      state_add_symbol(state, (symbol_t){ast->as.paramdef.name, &ast->as.paramdef.type, INFO_LOCAL, {-state->param}});
-      state->param += type_size_aligned(&ast->as.paramdef.type);
+      state_symbol_of(state, ast->as.paramdef.name)->info.local = -state->param;
+      state->param += type_size_aligned(ast->as.paramdef.type);
       if (ast->as.paramdef.next) {
         compile(ast->as.paramdef.next, state);
       }
@@ -3798,80 +4628,35 @@ void compile(ast_t *ast, state_t *state) {
     case A_RETURN:
       compile(ast->as.ast, state);
       state_add_ir(state, (ir_t){IR_ADDR_LOCAL, {.num = state->param + state->sp}});
-      state_add_ir(state, (ir_t){IR_WRITE, {.num = type_size_aligned(&ast->as.ast->type)}});
+      state_add_ir(state, (ir_t){IR_WRITE, {.num = type_size_aligned(ast->as.ast->type)}});
       state_add_ir(state, (ir_t){IR_CHANGE_SP, {.num = -state->sp}});
       state_add_ir(state, (ir_t){IR_FUNCEND, {}});
       break;
     case A_BINARYOP:
-      switch (ast->as.binaryop.op) {
-        case T_DOT:
-          get_addr_ast(state, ast);
-          state_add_ir(state, (ir_t){IR_READ, {.num = ast->type.size}});
-          break;
-        case T_PLUS:
-        case T_MINUS:
-          compile(ast->as.binaryop.lhs, state);
-          compile(ast->as.binaryop.rhs, state);
-          if (type_is_kind(&ast->type, TY_PTR)) {
-            state_add_ir(state, (ir_t){IR_MUL, {.num = ast->type.as.ptr->size}});
-            state_add_ir(state, (ir_t){IR_OPERATION, {.inst = ast->as.binaryop.op == T_PLUS ? SUM : SUB}});
-          } else if (ast->as.binaryop.op == T_MINUS && ast->type.kind == TY_INT && type_is_kind(&ast->as.binaryop.lhs->type, TY_PTR) && type_is_kind(&ast->as.binaryop.rhs->type, TY_PTR)) {
-            state_add_ir(state, (ir_t){IR_OPERATION, {.inst = SUB}});
-            state_add_ir(state, (ir_t){IR_DIV, {.num = ast->as.binaryop.lhs->type.as.ptr->size}});
-            break;
-          } else {
-            state_add_ir(state, (ir_t){IR_OPERATION, {.inst = ast->as.binaryop.op == T_PLUS ? SUM : SUB}});
-          }
-          break;
-        case T_EQ:
-        case T_NEQ:
-        {
-          state_add_ir(state, (ir_t){IR_INT, {.num = ast->as.binaryop.op == T_EQ}});
-          compile(ast->as.binaryop.rhs, state);
-          compile(ast->as.binaryop.lhs, state);
-          state_add_ir(state, (ir_t){IR_OPERATION, {.inst = SUB}});
-
-          int a = state->uli++;
-          state_add_ir(state, (ir_t){IR_JMPZ, {.num = a}});
-          state_add_ir(state, (ir_t){IR_CHANGE_SP, {.num = -2}});
-          state_add_ir(state, (ir_t){IR_INT, {.num = ast->as.binaryop.op != T_EQ}});
-          state_add_ir(state, (ir_t){IR_SETULI, {.num = a}});
-        } break;
-        case T_SHL:
-        case T_SHR:
-        {
-          assert(ast->as.binaryop.rhs->kind == A_INT);
-          compile(ast->as.binaryop.lhs, state);
-          ir_t ir = {IR_OPERATION, {.inst = ast->as.binaryop.op == T_SHL ? SHL : SHR}};
-          for (int i = 0; i < ast->as.binaryop.rhs->as.fac.asint; ++i) {
-            state_add_ir(state, ir);
-          }
-        } break;
-        case T_AND:
-          compile(ast->as.binaryop.lhs, state);
-          compile(ast->as.binaryop.rhs, state);
-          state_add_ir(state, (ir_t){IR_OPERATION, {.inst = AND}});
-          break;
-        case T_STAR:
-        case T_SLASH:
-          state_add_ir(state, (ir_t){IR_CHANGE_SP, {.num = 2}});
-          int start_sp = state->sp;
-          compile(ast->as.binaryop.lhs, state);
-          compile(ast->as.binaryop.rhs, state);
-          state_add_ir(state, (ir_t){IR_CALL, {.sv = ast->as.binaryop.op == T_STAR ? (sv_t){mul_string, 3} : (sv_t){div_string, 3}}});
-          state_add_ir(state, (ir_t){IR_CHANGE_SP, {.num = start_sp - state->sp}});
-          state_add_builtin(state, ast->as.binaryop.op == T_STAR ? BE_MUL : BE_DIV);
-          break;
-        default:
-          printf("BINARYOP %s\n", token_kind_to_string(ast->as.binaryop.op));
-          TODO;
+    {
+      if (ast->as.binaryop.op == T_DOT) {
+        get_addr_ast(state, ast);
+        state_add_ir(state, (ir_t){IR_READ, {.num = ast->type->size}});
+        break;
       }
-      break;
+      // a + b + c ... nests on the lhs as deep as the chain is long, so the
+      // chain is walked down with the stack and finished bottom up
+      int base = ast_walk.num;
+      ast_t *a = ast;
+      for (; a->kind == A_BINARYOP && a->as.binaryop.op != T_DOT; a = a->as.binaryop.lhs) {
+        ast_walk_push(a, compile_binaryop_pre(a, state));
+      }
+      compile(a, state);
+      while (ast_walk.num > base) {
+        ast_walk_t walk = ast_walk.items[--ast_walk.num];
+        compile_binaryop_post(walk.ast, state, walk.arg);
+      }
+    } break;
     case A_UNARYOP:
       switch (ast->as.unaryop.op) {
         case T_STAR:
           compile(ast->as.unaryop.arg, state);
-          state_add_ir(state, (ir_t){IR_READ, {.num = ast->type.size}});
+          state_add_ir(state, (ir_t){IR_READ, {.num = ast->type->size}});
           break;
         case T_AND:
           get_addr_ast(state, ast->as.unaryop.arg);
@@ -3901,10 +4686,10 @@ void compile(ast_t *ast, state_t *state) {
       break;
     case A_SYM:
     {
-      symbol_t *s = state_find_symbol(state, ast->as.fac);
+      symbol_t *s = state_symbol_of(state, ast->as.fac);
       if (s->kind == INFO_CONSTANT) {
         state_add_ir(state, (ir_t){IR_INT, {.num = s->info.num}});
-      } else if (type_is_kind(&ast->type, TY_ARRAY)) {
+      } else if (type_is_kind(ast->type, TY_ARRAY)) {
         // eprintf(ast->loc, "cannot access ARRAY, maybe wanna cast it to PTR");
         get_addr_ast(state, ast);
       } else {
@@ -3921,7 +4706,7 @@ void compile(ast_t *ast, state_t *state) {
     } break;
     case A_DECL:
     {
-      int size = type_size_aligned(&ast->as.decl.type);
+      int size = type_size_aligned(ast->as.decl.type);
       if (ast->as.decl.expr) {
         int start_sp = state->sp;
         compile(ast->as.decl.expr, state);
@@ -3935,7 +4720,7 @@ void compile(ast_t *ast, state_t *state) {
       } else {
         state_add_ir(state, (ir_t){IR_CHANGE_SP, {.num = size}});
       }
-      state_add_symbol(state, (symbol_t){ast->as.decl.name, &ast->as.decl.type, INFO_LOCAL, {state->sp - 2}});
+      state_symbol_of(state, ast->as.decl.name)->info.local = state->sp - 2;
     } break;
     case A_GLOBDECL:
     {
@@ -3943,55 +4728,52 @@ void compile(ast_t *ast, state_t *state) {
       if (ast->as.decl.expr) {
         compile_data(ast->as.decl.expr, state, uli, 0);
       } else {
-        data(compiled, (bytecode_t){BDB, 0, {.num = ast->as.decl.type.size}});
+        data(compiled, (bytecode_t){BDB, 0, {.num = ast->as.decl.type->size}});
       }
-      state_add_symbol(state,
-                       (symbol_t){ast->as.decl.name, &ast->as.decl.type, INFO_GLOBAL, {uli}});
+      state_symbol_of(state, ast->as.decl.name)->info.global = uli;
     } break;
     case A_ASSIGN:
     {
       compile(ast->as.binary.right, state);
       get_addr_ast(state, ast->as.binary.left);
-      state_add_ir(state, (ir_t){IR_WRITE, {.num = ast->type.size}});
+      state_add_ir(state, (ir_t){IR_WRITE, {.num = ast->type->size}});
     } break;
     case A_FUNCALL:
     {
-      state_add_ir(state, (ir_t){IR_CHANGE_SP, {.num = type_size_aligned(&ast->type)}});
+      state_add_ir(state, (ir_t){IR_CHANGE_SP, {.num = type_size_aligned(ast->type)}});
       int start_sp = state->sp;
       if (ast->as.funcall.params) {
         compile(ast->as.funcall.params, state);
       }
-      state_add_ir(state, (ir_t){IR_CALL, {.sv = ast->as.funcall.name.image}});
+      int frame = state->sp - start_sp + type_size_aligned(ast->type);
+      state_add_ir(state, (ir_t){IR_CALL, {.call = {ast->as.funcall.name.image, frame}}});
       state_add_ir(state, (ir_t){IR_CHANGE_SP, {.num = start_sp - state->sp}});
     } break;
     case A_ARRAY:
-      assert(ast->type.as.array.len.kind != ARRAY_LEN_EXPR);
-      if (type_is_kind(ast->type.as.array.type, TY_CHAR)) {
-        if (ast->as.binary.right) {
-          if (ast->as.binary.right->as.binary.right) {
-            compile(ast->as.binary.right->as.binary.right, state);
+    {
+      assert(ast->type->as.array.len.kind != ARRAY_LEN_EXPR);
+      // pushed from the last item, two chars share a word
+      int base = ast_walk.num;
+      for (ast_t *a = ast; a; a = a->as.binary.right) {
+        ast_walk_push(a->as.binary.left, 0);
+      }
+      int num = ast_walk.num - base;
+      if (type_is_kind(ast->type->as.array.type, TY_CHAR)) {
+        for (int i = (num - 1) & ~1; i >= 0; i -= 2) {
+          compile(ast_walk.items[base + i].ast, state);
+          if (i + 1 < num) {
+            compile(ast_walk.items[base + i + 1].ast, state);
+            state_add_ir(state, (ir_t){IR_OPERATION, {.inst = B_AH}});
           }
-          compile(ast->as.binary.left, state);
-          compile(ast->as.binary.right->as.binary.left, state);
-          state_add_ir(state, (ir_t){IR_OPERATION, {.inst = B_AH}});
-        } else {
-          compile(ast->as.binary.left, state);
         }
-        break;
-      }
-      if (ast->as.binary.right) {
-        compile(ast->as.binary.right, state);
-      }
-      compile(ast->as.binary.left, state);
-      break;
-    case A_TYPEDEF:
-      if (ast->as.typedef_.type.kind == TY_ENUM) {
-        int i = 0;
-        for (type_t *typei = &ast->as.typedef_.type; typei; typei = typei->as.enum_.next) {
-          state_add_symbol(state, (symbol_t){typei->as.enum_.name, type_malloc((type_t){TY_INT, 2, {}}), INFO_CONSTANT, {.num = i}});
-          i++;
+      } else {
+        for (int i = num - 1; i >= 0; --i) {
+          compile(ast_walk.items[base + i].ast, state);
         }
       }
+      ast_walk.num = base;
+    } break;
+    case A_TYPEDEF:
       break;
     case A_CAST:
       if (ast->as.cast.ast->kind == A_ARRAY
@@ -3999,10 +4781,10 @@ void compile(ast_t *ast, state_t *state) {
           && ast->as.cast.ast->as.binary.left->kind == A_INT
           && ast->as.cast.ast->as.binary.left->as.fac.asint == 0
           && ast->as.cast.ast->as.binary.right == NULL) {
-        for (int i = 0; i < type_size_aligned(&ast->as.cast.target); i += 2) {
+        for (int i = 0; i < type_size_aligned(ast->as.cast.target); i += 2) {
           state_add_ir(state, (ir_t){IR_INT, {.num = 0}});
         }
-      } else if (type_is_kind(&ast->as.cast.target, TY_STRUCT) && ast->as.cast.ast->kind == A_ARRAY) {
+      } else if (type_is_kind(ast->as.cast.target, TY_STRUCT) && ast->as.cast.ast->kind == A_ARRAY) {
         ast_t *asts[128] = {0};
         int ast_num = 0;
         ast_t *asti = ast->as.cast.ast;
@@ -4012,8 +4794,8 @@ void compile(ast_t *ast, state_t *state) {
           asti = asti->as.binary.right;
         }
         for (--ast_num; ast_num >= 0; --ast_num) {
-          if (ast_num > 1 && type_is_kind(&asts[ast_num]->type, TY_CHAR)
-              && type_is_kind(&asts[ast_num - 1]->type, TY_CHAR)) {
+          if (ast_num > 1 && type_is_kind(asts[ast_num]->type, TY_CHAR)
+              && type_is_kind(asts[ast_num - 1]->type, TY_CHAR)) {
             compile(asts[ast_num - 1], state);
             compile(asts[ast_num], state);
             state_add_ir(state, (ir_t){IR_OPERATION, {.inst = B_AH}});
@@ -4022,16 +4804,16 @@ void compile(ast_t *ast, state_t *state) {
             compile(asts[ast_num], state);
           }
         }
-      } else if (type_is_kind(&ast->as.cast.target, TY_PTR) && type_is_kind(&ast->as.cast.ast->type, TY_ARRAY)) {
+      } else if (type_is_kind(ast->as.cast.target, TY_PTR) && type_is_kind(ast->as.cast.ast->type, TY_ARRAY)) {
         get_addr_ast(state, ast->as.cast.ast);
       } else {
-        int tsize = type_size_aligned(&ast->as.cast.target);
-        int size = type_size_aligned(&ast->as.cast.ast->type);
+        int tsize = type_size_aligned(ast->as.cast.target);
+        int size = type_size_aligned(ast->as.cast.ast->type);
         if (tsize - size < 0) {
           eprintf(ast->loc,
                   "cannot cast '%s' to smaller size type '%s' ",
-                  type_dump_to_string(&ast->as.cast.ast->type),
-                  type_dump_to_string(&ast->as.cast.target));
+                  type_dump_to_string(ast->as.cast.ast->type),
+                  type_dump_to_string(ast->as.cast.target));
         }
         state_add_ir(state, (ir_t){IR_CHANGE_SP, {.num = tsize - size}});
         compile(ast->as.cast.ast, state);
@@ -4080,175 +4862,2193 @@ void compile(ast_t *ast, state_t *state) {
         int b = state->uli++;
         state_push_break_target(state, b);
         state_add_ir(state, (ir_t){IR_SETULI, {.num = a}});
-        if (ast->as.binary.left->kind == A_UNARYOP && ast->as.binary.left->as.unaryop.op == T_NOT) {
+        if (!ast->as.binary.left) {
+          // endless, optimize_ast dropped the constant condition
+        } else if (ast->as.binary.left->kind == A_UNARYOP && ast->as.binary.left->as.unaryop.op == T_NOT) {
           compile(ast->as.binary.left->as.unaryop.arg, state);
           state_add_ir(state, (ir_t){IR_JMPNZ, {.num = b}});
         } else {
           compile(ast->as.binary.left, state);
           state_add_ir(state, (ir_t){IR_JMPZ, {.num = b}});
         }
-        if (ast->as.binary.right) {
-          compile(ast->as.binary.right, state);
+        if (ast->as.binary.right) {
+          compile(ast->as.binary.right, state);
+        }
+        state_add_ir(state, (ir_t){IR_JMP, {.num = a}});
+        state_add_ir(state, (ir_t){IR_SETULI, {.num = b}});
+        state_drop_break_target(state);
+      }
+      break;
+    case A_EXTERN:
+      assert(ast->as.ast->kind == A_FUNCDEF);
+      state_add_ir(state, (ir_t){IR_EXTERN, {.sv = ast->as.ast->as.funcdef.name.image}});
+      compile(ast->as.ast, state);
+      break;
+    case A_BREAK:
+      if (state->break_target_num == 0) {
+        eprintf(ast->loc, "break statement not within loop or switch");
+      }
+      break_target_info_t info = state->break_target[state->break_target_num - 1];
+      state_add_ir(state, (ir_t){IR_CHANGE_SP, {.num = -(state->sp - info.sp)}});
+      state_add_ir(state, (ir_t){IR_JMP, {.num = info.uli}});
+      break;
+  }
+}
+
+// a list of irs or bytecodes seen as a doubly linked list over the array indices,
+// used by the peephole optimizers to delete in O(1) and compact once at the end
+typedef struct {
+  int *next;
+  int *prev;
+  int head;
+} peephole_list_t;
+
+void peephole_list_init(peephole_list_t *list, int count) {
+  assert(list);
+  assert(count > 0);
+  *list = (peephole_list_t){malloc(count * sizeof(int)), malloc(count * sizeof(int)), 0};
+  assert(list->next && list->prev);
+  for (int i = 0; i < count; ++i) {
+    list->next[i] = i + 1 < count ? i + 1 : -1;
+    list->prev[i] = i - 1;
+  }
+}
+
+void peephole_list_delete(peephole_list_t *list, int i) {
+  assert(list);
+  assert(i >= 0);
+  if (list->prev[i] >= 0) {
+    list->next[list->prev[i]] = list->next[i];
+  } else {
+    list->head = list->next[i];
+  }
+  if (list->next[i] >= 0) {
+    list->prev[list->next[i]] = list->prev[i];
+  }
+}
+
+void peephole_list_window(peephole_list_t *list, int i, int *w, int n) {
+  assert(list);
+  assert(w);
+  w[0] = i;
+  for (int k = 1; k < n; ++k) {
+    w[k] = w[k - 1] >= 0 ? list->next[w[k - 1]] : -1;
+  }
+}
+
+// where to continue after a rewrite of the window that followed 'before' (-1 if it was the head):
+// only windows overlapping the rewrite can have changed, so back up by window - 1 items
+int peephole_list_resume(peephole_list_t *list, int before, int window) {
+  assert(list);
+  int i = before >= 0 ? list->next[before] : list->head;
+  for (int k = 0; k < window - 1 && i >= 0 && list->prev[i] >= 0; ++k) {
+    i = list->prev[i];
+  }
+  return i;
+}
+
+// moves the items still in the list to the start of the array, returns the new count
+int peephole_list_compact(peephole_list_t *list, void *items, int size) {
+  assert(list);
+  assert(items);
+  int count = 0;
+  for (int i = list->head; i >= 0; i = list->next[i]) {
+    memmove((char *)items + count * size, (char *)items + i * size, size);
+    count++;
+  }
+  free(list->next);
+  free(list->prev);
+  *list = (peephole_list_t){0};
+  return count;
+}
+
+// the peephole rules of optimize_ir and optimize_asm, one per line:
+//   <ir|asm> <min opt level> <pattern> [if <guard>] -> [replacement]
+// in ir rules every item is KIND or KIND(args), in asm rules INST or INST arg[:8|:16],
+// the first use of a name binds it, the other uses and any expression must match
+char *default_rules =
+  "# IR Optimization\n"
+  "ir 1 CHANGE_SP(0) ->\n"
+  "ir 1 CHANGE_SP(x) CHANGE_SP(y) -> CHANGE_SP(x + y)\n"
+  "ir 3 ADDR_LOCAL READ(x) CHANGE_SP(y) if x <= -y -> CHANGE_SP(x + y)\n"
+  "ir 3 ADDR_LOCAL(a) READ(b) ADDR_LOCAL(c) READ(d) if a - d == c - b -> ADDR_LOCAL(a - d) READ(d + b)\n"
+  "ir 2 INT(x) INT(y) OPERATION(B_AH) -> INT((x << 8) | y)\n"
+  "ir 2 INT(x) INT(y) OPERATION(SUM) -> INT(x + y)\n"
+  "ir 2 INT(x) INT(y) OPERATION(SUB) -> INT(x - y)\n"
+  "ir 3 ADDR_LOCAL(2) READ(x) ADDR_LOCAL(y) WRITE(x) CHANGE_SP(z) if -z >= x -> ADDR_LOCAL(y - x) WRITE(x) CHANGE_SP(z + x)\n"
+  "ir 3 INT(x) MUL(y) -> INT(x * y)\n"
+  "ir 3 ADDR_LOCAL(x) INT(y) OPERATION(SUM) -> ADDR_LOCAL(x + y)\n"
+  "ir 3 ADDR_GLOBAL(x, y) INT(z) OPERATION(SUM) -> ADDR_GLOBAL(x, y + z)\n"
+  "ir 3 INT(0) OPERATION(SUM|SUB) ->\n"
+  "\n"
+  "# ASM Optimization\n"
+  "asm 1 PEEKAR 2 -> PEEKA\n"
+  "asm 1 PUSHA POPA ->\n"
+  "asm 1 PUSHA POPB -> A_B\n"
+  "asm 1 RAM_A|RAM_B x:16 if x < 256 -> RAM_AL|RAM_BL x:8\n"
+  "asm 1 SUM|SUB CMPA -> SUM|SUB\n"
+  "asm 1 PUSHA RAM_A|RAM_AL x POPB -> A_B RAM_A|RAM_AL x\n" // TODO: add PEEKAR case
+  "asm 1 RAM_A|RAM_AL x A_B -> RAM_B|RAM_BL x\n"
+  "asm 2 RAM_B x RAM_AL 1 SUM|SUB -> RAM_A x INCA|DECA\n"
+  "asm 2 RAM_BL x RAM_AL 1 SUM|SUB -> RAM_AL x INCA|DECA\n"
+  "asm 2 A_B RAM_AL 1 SUM|SUB -> INCA|DECA\n";
+// TODO: RAM_A 0 SUB -> B_A CMPA?
+
+#define RULE_ITEM_MAX  8
+#define RULE_ARG_MAX   2
+#define RULE_VAR_MAX   8
+#define RULE_STACK_MAX 16
+#define RULE_ALT_MAX   8
+#define INST_MAX       256
+// equal length asm rewrites don't shrink the list, stop rule sets that never settle
+#define RULE_REWRITES_PER_ITEM 16
+
+static_assert(IR_EXTERN < INST_MAX, "too many ir kinds for the rule dispatch");
+
+// the instructions a rule can name
+instruction_t rule_instructions[] = {
+  NOP, RAM_A, RAM_B, RAM_AL, RAM_BL, A_rB, AL_rB, rB_A, rB_AL, SUM, SUB, A_B,
+  DECSP, INCSP, SP_A, A_SP, POPA, POPB, PUSHA, PUSHAR, PEEKA, PEEKAR, PEEKB, CMPA,
+  JMPR, JMPRZ, JMPRNZ, RET, B_AH, SHL, SHR, AND, CALL, CALLR, INCA, DECA,
+};
+
+typedef enum {
+  RO_END,
+  RO_NUM, // + value
+  RO_VAR, // + value
+  RO_NEG,
+  RO_NOT,
+  RO_BNOT,
+  RO_MUL,
+  RO_DIV,
+  RO_MOD,
+  RO_ADD,
+  RO_SUB,
+  RO_SHL,
+  RO_SHR,
+  RO_LT,
+  RO_LE,
+  RO_GT,
+  RO_GE,
+  RO_EQ,
+  RO_NE,
+  RO_BAND,
+  RO_BXOR,
+  RO_BOR,
+  RO_AND,
+  RO_OR,
+} rule_op_kind_t;
+
+// expressions are stored in postfix order in rule_code and end with RO_END
+typedef struct {
+  rule_op_kind_t kind;
+  int value;
+} rule_op_t;
+
+typedef struct {
+  enum {
+    RULE_ARG_ANY,
+    RULE_ARG_BIND,
+    RULE_ARG_EXPR, // in a pattern the arg must be equal to it
+  } kind;
+  int var;
+  int expr;
+} rule_arg_t;
+
+typedef struct {
+  int kind; // ir_kind_t or instruction_t
+  rule_arg_t args[RULE_ARG_MAX];
+  int arg_num; // -1 if the pattern doesn't look at the args
+  int width;   // asm only: 8 for INSTHEX, 16 for INSTHEX2, 0 for any or copied
+} rule_item_t;
+
+typedef struct {
+  char *text;
+  optlevel_t level;
+  rule_item_t pattern[RULE_ITEM_MAX];
+  int pattern_num;
+  rule_item_t replace[RULE_ITEM_MAX]; // at most as long as the pattern
+  int replace_num;
+  int guard; // -1 if none
+  int var_num;
+  uint32_t numeric; // asm only: vars used as numbers, they only bind INSTHEX and INSTHEX2
+  int hits;
+  int saved; // ir ops or asm bytes, the bytes are counted only with -d opt or --opt-stats
+} rule_t;
+
+typedef struct {
+  bool is_asm;
+  rule_t *rules;
+  int rule_num;
+  int rule_cap;
+  int window; // longest pattern
+  // rules indices grouped by the first kind of the pattern, in rule order:
+  // the rules for kind are dispatch[start[kind] .. start[kind + 1]]
+  int *dispatch;
+  int start[INST_MAX + 1];
+} rule_set_t;
+
+rule_set_t ir_rules = {false, NULL, 0, 0, 0, NULL, {0}};
+rule_set_t asm_rules = {true, NULL, 0, 0, 0, NULL, {0}};
+rule_op_t *rule_code = NULL;
+int rule_code_num = 0;
+int rule_code_cap = 0;
+
+void rules_free() {
+  rule_set_t *sets[] = {&ir_rules, &asm_rules};
+  for (int s = 0; s < 2; ++s) {
+    for (int i = 0; i < sets[s]->rule_num; ++i) {
+      free(sets[s]->rules[i].text);
+    }
+    free(sets[s]->rules);
+    free(sets[s]->dispatch);
+    *sets[s] = (rule_set_t){sets[s]->is_asm, NULL, 0, 0, 0, NULL, {0}};
+  }
+  free(rule_code);
+  rule_code = NULL;
+  rule_code_num = 0;
+  rule_code_cap = 0;
+}
+
+int rule_instruction_from_sv(sv_t name) {
+  for (int i = 0; i < (int)(sizeof(rule_instructions) / sizeof(rule_instructions[0])); ++i) {
+    if (sv_eq(name, sv_from_cstr(instruction_to_string(rule_instructions[i])))) {
+      return rule_instructions[i];
+    }
+  }
+  return -1;
+}
+
+int rule_ir_kind_from_sv(sv_t name) {
+  for (ir_kind_t kind = IR_NONE + 1; kind <= IR_EXTERN; ++kind) {
+    if (sv_eq(name, sv_from_cstr(ir_kind_to_string(kind)))) {
+      return kind;
+    }
+  }
+  return -1;
+}
+
+// number of int args of an ir kind, -1 if a rule cannot express it
+int ir_kind_arg_num(ir_kind_t kind) {
+  switch (kind) {
+    case IR_NONE:
+    case IR_FUNCEND:
+      return 0;
+    case IR_ADDR_GLOBAL:
+      return 2;
+    case IR_SETLABEL:
+    case IR_CALL:
+    case IR_EXTERN:
+      return -1;
+    case IR_SETULI:
+    case IR_JMPZ:
+    case IR_JMPNZ:
+    case IR_JMP:
+    case IR_ADDR_LOCAL:
+    case IR_READ:
+    case IR_WRITE:
+    case IR_CHANGE_SP:
+    case IR_INT:
+    case IR_OPERATION:
+    case IR_MUL:
+    case IR_DIV:
+      return 1;
+  }
+  assert(0);
+}
+
+int ir_get_arg(ir_t *ir, int k) {
+  assert(ir);
+  switch (ir->kind) {
+    case IR_ADDR_GLOBAL: return k == 0 ? ir->arg.loc.base : ir->arg.loc.offset;
+    case IR_OPERATION: return ir->arg.inst;
+    default: return ir->arg.num;
+  }
+}
+
+void ir_set_arg(ir_t *ir, int k, int value) {
+  assert(ir);
+  switch (ir->kind) {
+    case IR_ADDR_GLOBAL:
+      if (k == 0) {
+        ir->arg.loc.base = value;
+      } else {
+        ir->arg.loc.offset = value;
+      }
+      break;
+    case IR_OPERATION: ir->arg.inst = value; break;
+    default: ir->arg.num = value; break;
+  }
+}
+
+typedef struct {
+  char *filename;
+  int line;
+  char *cur;
+  rule_t *rule;
+  bool is_asm;
+  sv_t vars[RULE_VAR_MAX];
+  uint32_t uses; // vars read by the last expression
+  int depth;
+} rule_parser_t;
+
+void rule_error(rule_parser_t *p, char *msg) {
+  assert(p);
+  fprintf(stderr, "ERROR: %s:%d: %s: '%s'\n", p->filename, p->line, msg, p->rule->text);
+  exit(1);
+}
+
+void rule_skip_space(rule_parser_t *p) {
+  while (*p->cur == ' ' || *p->cur == '\t') {
+    p->cur++;
+  }
+}
+
+bool rule_accept(rule_parser_t *p, char *str) {
+  rule_skip_space(p);
+  int len = strlen(str);
+  if (strncmp(p->cur, str, len) != 0) {
+    return false;
+  }
+  p->cur += len;
+  return true;
+}
+
+void rule_expect(rule_parser_t *p, char *str) {
+  if (!rule_accept(p, str)) {
+    char msg[64];
+    snprintf(msg, sizeof(msg), "expected '%s'", str);
+    rule_error(p, msg);
+  }
+}
+
+bool rule_peek_ident(rule_parser_t *p, sv_t *name) {
+  rule_skip_space(p);
+  if (!isalpha(*p->cur) && *p->cur != '_') {
+    return false;
+  }
+  int len = 1;
+  while (isalnum(p->cur[len]) || p->cur[len] == '_') {
+    len++;
+  }
+  *name = (sv_t){p->cur, len};
+  return true;
+}
+
+bool rule_peek_keyword(rule_parser_t *p, char *keyword) {
+  sv_t name;
+  return rule_peek_ident(p, &name) && sv_eq(name, sv_from_cstr(keyword));
+}
+
+int rule_find_var(rule_parser_t *p, sv_t name) {
+  for (int v = 0; v < p->rule->var_num; ++v) {
+    if (sv_eq(p->vars[v], name)) {
+      return v;
+    }
+  }
+  return -1;
+}
+
+void rule_emit(rule_parser_t *p, rule_op_kind_t kind, int value, int pushed) {
+  rule_op_t op = {kind, value};
+  DA_APPEND(rule_code, rule_code_num, rule_code_cap, op);
+  p->depth += pushed;
+  if (p->depth > RULE_STACK_MAX) {
+    rule_error(p, "expression too deep");
+  }
+}
+
+void rule_parse_binary(rule_parser_t *p, int min_prec);
+
+void rule_parse_unary(rule_parser_t *p) {
+  sv_t name;
+  rule_skip_space(p);
+  if (rule_accept(p, "(")) {
+    rule_parse_binary(p, 0);
+    rule_expect(p, ")");
+  } else if (p->cur[0] == '-' && p->cur[1] != '>') {
+    p->cur++;
+    rule_parse_unary(p);
+    rule_emit(p, RO_NEG, 0, 0);
+  } else if (rule_accept(p, "!")) {
+    rule_parse_unary(p);
+    rule_emit(p, RO_NOT, 0, 0);
+  } else if (rule_accept(p, "~")) {
+    rule_parse_unary(p);
+    rule_emit(p, RO_BNOT, 0, 0);
+  } else if (isdigit(*p->cur)) {
+    rule_emit(p, RO_NUM, strtol(p->cur, &p->cur, 10), 1);
+  } else if (rule_peek_ident(p, &name)) {
+    p->cur += name.len;
+    int inst = rule_instruction_from_sv(name);
+    int var = rule_find_var(p, name);
+    if (inst >= 0) {
+      rule_emit(p, RO_NUM, inst, 1);
+    } else if (var >= 0) {
+      p->uses |= 1u << var;
+      rule_emit(p, RO_VAR, var, 1);
+    } else {
+      rule_error(p, "unbound name in expression");
+    }
+  } else {
+    rule_error(p, "expected an expression");
+  }
+}
+
+struct {
+  char *str;
+  rule_op_kind_t kind;
+  int prec;
+} rule_binary_ops[] = {
+  // the longer operators first
+  {"||", RO_OR, 1},
+  {"&&", RO_AND, 2},
+  {"==", RO_EQ, 6},
+  {"!=", RO_NE, 6},
+  {"<=", RO_LE, 7},
+  {">=", RO_GE, 7},
+  {"<<", RO_SHL, 8},
+  {">>", RO_SHR, 8},
+  {"|", RO_BOR, 3},
+  {"^", RO_BXOR, 4},
+  {"&", RO_BAND, 5},
+  {"<", RO_LT, 7},
+  {">", RO_GT, 7},
+  {"+", RO_ADD, 9},
+  {"-", RO_SUB, 9},
+  {"*", RO_MUL, 10},
+  {"/", RO_DIV, 10},
+  {"%", RO_MOD, 10},
+};
+
+void rule_parse_binary(rule_parser_t *p, int min_prec) {
+  rule_parse_unary(p);
+  while (true) {
+    rule_skip_space(p);
+    if (p->cur[0] == '-' && p->cur[1] == '>') {
+      return;
+    }
+    int op = -1;
+    for (int i = 0; i < (int)(sizeof(rule_binary_ops) / sizeof(rule_binary_ops[0])); ++i) {
+      if (strncmp(p->cur, rule_binary_ops[i].str, strlen(rule_binary_ops[i].str)) == 0) {
+        op = i;
+        break;
+      }
+    }
+    if (op < 0 || rule_binary_ops[op].prec <= min_prec) {
+      return;
+    }
+    p->cur += strlen(rule_binary_ops[op].str);
+    rule_parse_binary(p, rule_binary_ops[op].prec);
+    rule_emit(p, rule_binary_ops[op].kind, 0, -1);
+  }
+}
+
+int rule_parse_expr(rule_parser_t *p) {
+  int start = rule_code_num;
+  p->uses = 0;
+  p->depth = 0;
+  rule_parse_binary(p, 0);
+  rule_emit(p, RO_END, 0, 0);
+  return start;
+}
+
+// returns false on a division by zero
+bool rule_eval(int expr, int *vars, int *result) {
+  int stack[RULE_STACK_MAX];
+  int sp = 0;
+  for (rule_op_t *op = &rule_code[expr]; op->kind != RO_END; ++op) {
+    switch (op->kind) {
+      case RO_NUM: stack[sp++] = op->value; break;
+      case RO_VAR: stack[sp++] = vars[op->value]; break;
+      case RO_NEG: stack[sp - 1] = -stack[sp - 1]; break;
+      case RO_NOT: stack[sp - 1] = !stack[sp - 1]; break;
+      case RO_BNOT: stack[sp - 1] = ~stack[sp - 1]; break;
+      default:
+      {
+        int b = stack[--sp];
+        int *a = &stack[sp - 1];
+        switch (op->kind) {
+          case RO_MUL: *a *= b; break;
+          case RO_DIV:
+          case RO_MOD:
+            if (b == 0) {
+              return false;
+            }
+            *a = op->kind == RO_DIV ? *a / b : *a % b;
+            break;
+          case RO_ADD: *a += b; break;
+          case RO_SUB: *a -= b; break;
+          case RO_SHL: *a <<= b; break;
+          case RO_SHR: *a >>= b; break;
+          case RO_LT: *a = *a < b; break;
+          case RO_LE: *a = *a <= b; break;
+          case RO_GT: *a = *a > b; break;
+          case RO_GE: *a = *a >= b; break;
+          case RO_EQ: *a = *a == b; break;
+          case RO_NE: *a = *a != b; break;
+          case RO_BAND: *a &= b; break;
+          case RO_BXOR: *a ^= b; break;
+          case RO_BOR: *a |= b; break;
+          case RO_AND: *a = *a && b; break;
+          case RO_OR: *a = *a || b; break;
+          default: assert(0);
+        }
+      }
+    }
+  }
+  assert(sp == 1);
+  *result = stack[0];
+  return true;
+}
+
+rule_arg_t rule_parse_arg(rule_parser_t *p, bool in_pattern) {
+  sv_t name;
+  if (in_pattern && rule_peek_ident(p, &name)) {
+    if (sv_eq(name, sv_from_cstr("_"))) {
+      p->cur += name.len;
+      return (rule_arg_t){RULE_ARG_ANY, 0, 0};
+    }
+    if (rule_find_var(p, name) < 0 && rule_instruction_from_sv(name) < 0) {
+      if (p->rule->var_num >= RULE_VAR_MAX) {
+        rule_error(p, "too many names");
+      }
+      p->cur += name.len;
+      p->vars[p->rule->var_num] = name;
+      return (rule_arg_t){RULE_ARG_BIND, p->rule->var_num++, 0};
+    }
+  }
+  rule_arg_t arg = {RULE_ARG_EXPR, 0, rule_parse_expr(p)};
+  if (!p->is_asm) {
+    return arg;
+  }
+  // asm: a lone name in a replacement copies the bytecode it was bound to
+  rule_op_t *code = &rule_code[arg.expr];
+  if (!in_pattern && code[0].kind == RO_VAR && code[1].kind == RO_END) {
+    arg.kind = RULE_ARG_BIND;
+    arg.var = code[0].value;
+  } else {
+    p->rule->numeric |= p->uses;
+  }
+  return arg;
+}
+
+rule_item_t rule_parse_item(rule_parser_t *p, bool in_pattern) {
+  sv_t name;
+  if (!rule_peek_ident(p, &name)) {
+    rule_error(p, "expected an item");
+  }
+  p->cur += name.len;
+
+  rule_item_t item = {0};
+  item.arg_num = in_pattern ? -1 : 0;
+  if (p->is_asm) {
+    item.kind = rule_instruction_from_sv(name);
+    if (item.kind < 0) {
+      rule_error(p, "unknown instruction");
+    }
+    // an arg is anything but the next instruction or the end of the side
+    sv_t next;
+    rule_skip_space(p);
+    bool has_arg = *p->cur && *p->cur != '#' && !(p->cur[0] == '-' && p->cur[1] == '>')
+                   && !(rule_peek_ident(p, &next)
+                        && (rule_instruction_from_sv(next) >= 0 || sv_eq(next, sv_from_cstr("if"))));
+    if (has_arg) {
+      item.args[0] = rule_parse_arg(p, in_pattern);
+      item.arg_num = 1;
+      if (rule_accept(p, ":")) {
+        rule_skip_space(p);
+        item.width = strtol(p->cur, &p->cur, 10);
+        if (item.width != 8 && item.width != 16) {
+          rule_error(p, "width must be 8 or 16");
+        }
+      }
+    }
+    if (!in_pattern && item.arg_num == 1 && item.args[0].kind == RULE_ARG_EXPR && item.width == 0) {
+      rule_error(p, "computed args need a width");
+    }
+    return item;
+  }
+
+  item.kind = rule_ir_kind_from_sv(name);
+  if (item.kind < 0) {
+    rule_error(p, "unknown ir kind");
+  }
+  int arg_num = ir_kind_arg_num(item.kind);
+  if (rule_accept(p, "(")) {
+    item.arg_num = 0;
+    do {
+      if (item.arg_num >= RULE_ARG_MAX) {
+        rule_error(p, "too many args");
+      }
+      item.args[item.arg_num++] = rule_parse_arg(p, in_pattern);
+    } while (rule_accept(p, ","));
+    rule_expect(p, ")");
+  }
+  if (arg_num < 0 ? !in_pattern || item.arg_num >= 0 : item.arg_num >= 0 && item.arg_num != arg_num) {
+    rule_error(p, "wrong number of args");
+  }
+  return item;
+}
+
+void rule_parse(rule_parser_t *p) {
+  rule_t *rule = p->rule;
+  rule_skip_space(p);
+  rule->level = strtol(p->cur, &p->cur, 10);
+  if (rule->level <= OL_NONE || rule->level >= OL_COUNT) {
+    rule_error(p, "invalid opt level");
+  }
+
+  rule->guard = -1;
+  while (!rule_peek_keyword(p, "if") && !(rule_skip_space(p), p->cur[0] == '-' && p->cur[1] == '>')) {
+    if (rule->pattern_num >= RULE_ITEM_MAX) {
+      rule_error(p, "pattern too long");
+    }
+    rule->pattern[rule->pattern_num++] = rule_parse_item(p, true);
+  }
+  if (rule->pattern_num == 0) {
+    rule_error(p, "empty pattern");
+  }
+  if (rule_peek_keyword(p, "if")) {
+    p->cur += 2;
+    rule->guard = rule_parse_expr(p);
+    if (p->is_asm) {
+      rule->numeric |= p->uses;
+    }
+  }
+  rule_expect(p, "->");
+  // an ir rule removes at least one ir, so the ir pass is linear
+  int replace_max = p->is_asm ? rule->pattern_num : rule->pattern_num - 1;
+  while (rule_skip_space(p), *p->cur && *p->cur != '#') {
+    if (rule->replace_num >= replace_max) {
+      rule_error(p, p->is_asm ? "replacement longer than the pattern" : "ir replacement not shorter than the pattern");
+    }
+    rule->replace[rule->replace_num++] = rule_parse_item(p, false);
+  }
+}
+
+bool rule_is_name_char(char c) {
+  return isalnum(c) || c == '_';
+}
+
+// 'A|B' groups of known names are expanded in n rules taking the k-th name of every group,
+// so every group in a line must have the same number of names
+int rule_expand(char *line, char **out) {
+  int alt_num = 1;
+  for (int k = 0; k < alt_num; ++k) {
+    int len = strlen(line);
+    out[k] = malloc(len + 1);
+    assert(out[k]);
+    char *o = out[k];
+    char *c = line;
+    while (*c) {
+      if (!rule_is_name_char(*c) || (c > line && rule_is_name_char(c[-1]))) {
+        *o++ = *c++;
+        continue;
+      }
+      char *names[RULE_ALT_MAX];
+      int lens[RULE_ALT_MAX];
+      int n = 0;
+      char *e = c;
+      while (true) {
+        char *s = e;
+        while (rule_is_name_char(*e)) {
+          e++;
+        }
+        sv_t name = {s, e - s};
+        if (n >= RULE_ALT_MAX || (rule_instruction_from_sv(name) < 0 && rule_ir_kind_from_sv(name) < 0)) {
+          n = 0;
+          break;
+        }
+        names[n] = s;
+        lens[n++] = e - s;
+        if (e[0] != '|' || !rule_is_name_char(e[1])) {
+          break;
+        }
+        e++;
+      }
+      if (n > 1) {
+        if (alt_num > 1 && n != alt_num) {
+          for (int i = 0; i <= k; ++i) {
+            free(out[i]);
+          }
+          return -1;
+        }
+        alt_num = n;
+        memcpy(o, names[k], lens[k]);
+        o += lens[k];
+        c = e;
+      } else {
+        while (rule_is_name_char(*c)) {
+          *o++ = *c++;
+        }
+      }
+    }
+    *o = 0;
+  }
+  return alt_num;
+}
+
+void rule_set_add(rule_set_t *set, rule_t rule) {
+  assert(set);
+  DA_APPEND(set->rules, set->rule_num, set->rule_cap, rule);
+  if (rule.pattern_num > set->window) {
+    set->window = rule.pattern_num;
+  }
+}
+
+void rule_set_build_dispatch(rule_set_t *set) {
+  assert(set);
+  memset(set->start, 0, sizeof(set->start));
+  for (int r = 0; r < set->rule_num; ++r) {
+    assert(0 <= set->rules[r].pattern[0].kind && set->rules[r].pattern[0].kind < INST_MAX);
+    set->start[set->rules[r].pattern[0].kind + 1]++;
+  }
+  for (int i = 0; i < INST_MAX; ++i) {
+    set->start[i + 1] += set->start[i];
+  }
+  int fill[INST_MAX];
+  memcpy(fill, set->start, sizeof(fill));
+  free(set->dispatch);
+  set->dispatch = malloc((set->rule_num + 1) * sizeof(int));
+  assert(set->dispatch);
+  for (int r = 0; r < set->rule_num; ++r) {
+    set->dispatch[fill[set->rules[r].pattern[0].kind]++] = r;
+  }
+}
+
+void rules_load(char *filename, char *text) {
+  assert(filename);
+  assert(text);
+  // every line fits in a buffer as long as the text
+  char *buffer = malloc(strlen(text) + 1);
+  assert(buffer);
+  char *line = text;
+  for (int line_num = 1; *line; ++line_num) {
+    char *end = strchr(line, '\n');
+    int len = end ? end - line : (int)strlen(line);
+    memcpy(buffer, line, len);
+    buffer[len] = 0;
+    line = end ? end + 1 : line + len;
+
+    char *comment = strchr(buffer, '#');
+    if (comment) {
+      *comment = 0;
+    }
+    while (len > 0 && isspace(buffer[len - 1])) {
+      buffer[--len] = 0;
+    }
+    char *start = buffer;
+    while (isspace(*start)) {
+      start++;
+    }
+    if (!*start) {
+      continue;
+    }
+
+    char *lines[RULE_ALT_MAX];
+    rule_t rule = {0};
+    rule_parser_t p = {filename, line_num, start, &rule, false, {}, 0, 0};
+    int alt_num = rule_expand(start, lines);
+    if (alt_num < 0) {
+      rule.text = start;
+      rule_error(&p, "alternatives of different length");
+    }
+    for (int k = 0; k < alt_num; ++k) {
+      rule = (rule_t){0};
+      rule.text = lines[k];
+      p = (rule_parser_t){filename, line_num, lines[k], &rule, false, {}, 0, 0};
+      p.is_asm = rule_peek_keyword(&p, "asm");
+      if (!p.is_asm && !rule_peek_keyword(&p, "ir")) {
+        rule_error(&p, "expected 'ir' or 'asm'");
+      }
+      p.cur += p.is_asm ? 3 : 2;
+      rule_parse(&p);
+      rule_set_add(p.is_asm ? &asm_rules : &ir_rules, rule);
+    }
+  }
+  free(buffer);
+  rule_set_build_dispatch(&ir_rules);
+  rule_set_build_dispatch(&asm_rules);
+}
+
+void rules_load_file(char *filename) {
+  assert(filename);
+  FILE *file = fopen(filename, "r");
+  if (!file) {
+    fprintf(stderr, "error: cannot open file '%s': %s\n", filename, strerror(errno));
+    exit(1);
+  }
+  fseek(file, 0, SEEK_END);
+  int size = ftell(file);
+  fseek(file, 0, SEEK_SET);
+  char *text = malloc(size + 1);
+  assert(text);
+  fread(text, 1, size, file);
+  text[size] = 0;
+  assert(fclose(file) == 0);
+  rules_load(filename, text);
+  free(text);
+}
+
+void rules_print_hits() {
+  rule_set_t *sets[] = {&ir_rules, &asm_rules};
+  printf("RULE HITS:\n");
+  for (int s = 0; s < 2; ++s) {
+    for (int i = 0; i < sets[s]->rule_num; ++i) {
+      printf("  %6d | %s\n", sets[s]->rules[i].hits, sets[s]->rules[i].text);
+    }
+  }
+}
+
+// only what the optimizers did or missed in this run
+void opt_stats_print() {
+  printf("OPT STATS:\n");
+  int saved_ir = 0;
+  int saved_bytes = 0;
+  int missed = 0;
+  for (int i = 0; i < OR_COUNT; ++i) {
+    opt_remark_info_t *info = &opt_remarks[i];
+    if (info->hits == 0) {
+      continue;
+    }
+    if (info->missed) {
+      printf("  %-7s missed %6d %14s | %s\n", info->pass, info->hits, "", info->name);
+      missed += info->hits;
+    } else {
+      printf("  %-7s passed %6d %8d ir    | %s\n", info->pass, info->hits, info->total, info->name);
+      saved_ir += info->total;
+    }
+  }
+  rule_set_t *sets[] = {&ir_rules, &asm_rules};
+  for (int s = 0; s < 2; ++s) {
+    for (int i = 0; i < sets[s]->rule_num; ++i) {
+      rule_t *rule = &sets[s]->rules[i];
+      if (rule->hits == 0) {
+        continue;
+      }
+      printf("  %-7s passed %6d %8d %-5s | %s\n",
+             sets[s]->is_asm ? "asm" : "ir",
+             rule->hits,
+             rule->saved,
+             sets[s]->is_asm ? "bytes" : "ir",
+             rule->text);
+      if (sets[s]->is_asm) {
+        saved_bytes += rule->saved;
+      } else {
+        saved_ir += rule->saved;
+      }
+    }
+  }
+  printf("  saved %d ir ops and %d bytes, %d missed\n", saved_ir, saved_bytes, missed);
+}
+
+bool rule_match_arg(rule_arg_t *arg, int value, int *vars) {
+  int expected;
+  switch (arg->kind) {
+    case RULE_ARG_ANY: return true;
+    case RULE_ARG_BIND: vars[arg->var] = value; return true;
+    case RULE_ARG_EXPR: return rule_eval(arg->expr, vars, &expected) && expected == value;
+  }
+  assert(0);
+}
+
+bool rule_apply_ir(rule_t *rule, peephole_list_t *list, ir_t *irs, int *w) {
+  int vars[RULE_VAR_MAX];
+  for (int k = 0; k < rule->pattern_num; ++k) {
+    if (w[k] < 0 || (int)irs[w[k]].kind != rule->pattern[k].kind) {
+      return false;
+    }
+    for (int a = 0; a < rule->pattern[k].arg_num; ++a) {
+      if (!rule_match_arg(&rule->pattern[k].args[a], ir_get_arg(&irs[w[k]], a), vars)) {
+        return false;
+      }
+    }
+  }
+  int guard;
+  if (rule->guard >= 0 && (!rule_eval(rule->guard, vars, &guard) || !guard)) {
+    return false;
+  }
+
+  ir_t out[RULE_ITEM_MAX];
+  for (int k = 0; k < rule->replace_num; ++k) {
+    out[k] = (ir_t){rule->replace[k].kind, {}};
+    for (int a = 0; a < rule->replace[k].arg_num; ++a) {
+      int value;
+      if (!rule_eval(rule->replace[k].args[a].expr, vars, &value)) {
+        return false;
+      }
+      ir_set_arg(&out[k], a, value);
+    }
+  }
+  for (int k = 0; k < rule->replace_num; ++k) {
+    irs[w[k]] = out[k];
+  }
+  for (int k = rule->replace_num; k < rule->pattern_num; ++k) {
+    peephole_list_delete(list, w[k]);
+  }
+  return true;
+}
+
+bool rule_apply_asm(rule_t *rule, peephole_list_t *list, bytecode_t *bs, int *w) {
+  int vars[RULE_VAR_MAX];
+  int var_src[RULE_VAR_MAX];
+  for (int k = 0; k < rule->pattern_num; ++k) {
+    rule_item_t *item = &rule->pattern[k];
+    if (w[k] < 0 || (int)bs[w[k]].inst != item->kind) {
+      return false;
+    }
+    bytecode_t *b = &bs[w[k]];
+    bool numeric = b->kind == BINSTHEX || b->kind == BINSTHEX2;
+    if ((item->width == 8 && b->kind != BINSTHEX) || (item->width == 16 && b->kind != BINSTHEX2)) {
+      return false;
+    }
+    if (item->arg_num == 1) {
+      rule_arg_t *arg = &item->args[0];
+      if (!numeric
+          && ((arg->kind == RULE_ARG_BIND && ((rule->numeric >> arg->var) & 1)) || arg->kind == RULE_ARG_EXPR)) {
+        return false;
+      }
+      if (arg->kind == RULE_ARG_BIND) {
+        var_src[arg->var] = w[k];
+      }
+      if (!rule_match_arg(arg, numeric ? b->arg.num : 0, vars)) {
+        return false;
+      }
+    }
+  }
+  int guard;
+  if (rule->guard >= 0 && (!rule_eval(rule->guard, vars, &guard) || !guard)) {
+    return false;
+  }
+
+  bytecode_t out[RULE_ITEM_MAX];
+  for (int k = 0; k < rule->replace_num; ++k) {
+    rule_item_t *item = &rule->replace[k];
+    out[k] = (bytecode_t){BINST, 0, {}};
+    if (item->arg_num == 1 && item->args[0].kind == RULE_ARG_BIND) {
+      out[k] = bs[var_src[item->args[0].var]];
+    } else if (item->arg_num == 1 && !rule_eval(item->args[0].expr, vars, &out[k].arg.num)) {
+      return false;
+    }
+    out[k].inst = item->kind;
+    if (item->width) {
+      out[k].kind = item->width == 8 ? BINSTHEX : BINSTHEX2;
+    }
+  }
+  for (int k = 0; k < rule->replace_num; ++k) {
+    bs[w[k]] = out[k];
+  }
+  for (int k = rule->replace_num; k < rule->pattern_num; ++k) {
+    peephole_list_delete(list, w[k]);
+  }
+  return true;
+}
+
+// at is the item before the rewrite, the function is found walking back to its label
+void rule_remark(rule_set_t *set, rule_t *rule, peephole_list_t *list, void *items, int at, int saved) {
+  ir_t *irs = items;
+  bytecode_t *bs = items;
+  remark_function_t *function = NULL;
+  int index = 0;
+  for (int i = at; i >= 0 && !function; i = list->prev[i], ++index) {
+    if (set->is_asm && bs[i].kind == BSETLABEL) {
+      function = remark_function_find(sv_from_cstr(bs[i].arg.string));
+    } else if (!set->is_asm && irs[i].kind == IR_SETLABEL) {
+      function = remark_function_find(irs[i].arg.sv);
+    }
+  }
+  char id[32];
+  snprintf(id, sizeof(id), "%s#%d", set->is_asm ? "asm" : "ir", (int)(rule - set->rules));
+  remark_start(function ? &function->loc : NULL,
+               false,
+               set->is_asm ? "asm" : "ir",
+               id,
+               function,
+               index,
+               saved,
+               set->is_asm ? "bytes" : "ir");
+  printf("%s\n", rule->text);
+}
+
+// single pass trying only the rules for the current kind, after a rewrite it
+// backs up by the longest pattern, so it finds the same leftmost match as
+// restarting from the beginning, returns the number of rewrites
+int rule_set_run(rule_set_t *set, void *items, int *count, optlevel_t opt) {
+  assert(set);
+  assert(count);
+  assert(items || *count == 0);
+
+  if (*count == 0 || set->rule_num == 0) {
+    return 0;
+  }
+
+  ir_t *irs = items;
+  bytecode_t *bs = items;
+  peephole_list_t list;
+  peephole_list_init(&list, *count);
+  int rewrites = 0;
+
+  int i = list.head;
+  while (i >= 0) {
+    int w[RULE_ITEM_MAX];
+    peephole_list_window(&list, i, w, set->window);
+
+    int before = list.prev[i];
+    bool rewritten = false;
+    int kind = set->is_asm ? (int)bs[i].inst : (int)irs[i].kind;
+    assert(0 <= kind && kind < INST_MAX);
+    int sizes[RULE_ITEM_MAX];
+    if (set->is_asm && (remarks.print || remarks.stats)) {
+      for (int k = 0; k < set->window; ++k) {
+        sizes[k] = w[k] >= 0 ? bytecode_size(bs[w[k]]) : 0;
+      }
+    }
+    for (int d = set->start[kind]; d < set->start[kind + 1] && !rewritten; ++d) {
+      rule_t *rule = &set->rules[set->dispatch[d]];
+      if (opt >= rule->level
+          && (set->is_asm ? rule_apply_asm(rule, &list, bs, w) : rule_apply_ir(rule, &list, irs, w))) {
+        int saved = rule->pattern_num - rule->replace_num;
+        if (set->is_asm && (remarks.print || remarks.stats)) {
+          saved = 0;
+          for (int k = 0; k < rule->pattern_num; ++k) {
+            saved += sizes[k] - (k < rule->replace_num ? bytecode_size(bs[w[k]]) : 0);
+          }
+        }
+        if (remarks.print) {
+          rule_remark(set, rule, &list, items, before, saved);
+        }
+        rule->hits++;
+        rule->saved += saved;
+        rewritten = true;
+      }
+    }
+
+    if (rewritten) {
+      if (++rewrites > *count * RULE_REWRITES_PER_ITEM) {
+        fprintf(stderr, "ERROR: the peephole rules don't settle\n");
+        exit(1);
+      }
+      i = peephole_list_resume(&list, before, set->window);
+    } else {
+      i = list.next[i];
+    }
+  }
+
+  *count = peephole_list_compact(&list, items, set->is_asm ? sizeof(bytecode_t) : sizeof(ir_t));
+  return rewrites;
+}
+
+bool rule_set_matches_kind(rule_set_t *set, int kind) {
+  for (int i = 0; i < set->rule_num; ++i) {
+    for (int k = 0; k < set->rules[i].pattern_num; ++k) {
+      if (set->rules[i].pattern[k].kind == kind) {
+        return true;
+      }
+    }
+  }
+  return false;
+}
+
+// the functions in an ir list start at their IR_SETLABEL, what comes before
+// the first one is named (globals)
+int ir_function_end(ir_t *irs, int ir_count, int start) {
+  int end = start + 1;
+  while (end < ir_count && irs[end].kind != IR_SETLABEL) {
+    ++end;
+  }
+  return end;
+}
+
+sv_t ir_function_name(ir_t *irs, int start) {
+  return irs[start].kind == IR_SETLABEL ? irs[start].arg.sv : sv_from_cstr("(globals)");
+}
+
+// the control flow graph of a function of the ir: the basic blocks split it at
+// the labels and after the jumps, every value pushed on the ir stack is a
+// virtual register defined once and the stack at the start of a block is made
+// of its parameters, that the predecessors pass with the stack at their end
+// (ssa with block arguments instead of phis). When no local has its address
+// taken the variables are the stack slots, so reading and writing them moves
+// registers around instead of going through memory
+typedef enum {
+  VR_UNKNOWN, // loaded, clobbered by a call, an address or reserved stack
+  VR_INT,     // num
+  VR_OP,      // num is the instruction, args the operands, SHL and SHR use only the first
+  VR_MUL,     // num, args[0]
+  VR_DIV,     // num, args[0]
+  VR_PARAM,   // num is the block, args[0] the slot
+} vreg_kind_t;
+
+typedef enum {
+  CV_UNDEF, // no executable definition reached yet
+  CV_CONST,
+  CV_VARYING,
+} const_value_kind_t;
+
+typedef struct {
+  vreg_kind_t kind;
+  int num;
+  int args[2];
+  const_value_kind_t cv; // set by cfg_propagate
+  int value;             // 16 bits when cv is CV_CONST
+} vreg_t;
+
+typedef struct {
+  int start; // ir range of the block
+  int end;
+  int depth;  // stack slots at the start, -1 while no built predecessor reached it
+  int params; // the vreg of the first slot, the others follow
+  int exit;   // index in cfg.exits of the stack at the end
+  int exit_depth;
+  int succ[2]; // -1 if missing, succ[1] is the target of JMPZ and JMPNZ
+  int cond;    // the vreg tested by JMPZ and JMPNZ, -1 otherwise
+  int pred_start; // index in cfg.preds
+  int pred_num;
+  bool taken[2]; // the edge to the successor can be executed
+  bool executable;
+} block_t;
+
+typedef struct {
+  int pushed; // the vreg pushed by the ir op, -1 if none
+  int slot;   // the local read or written by an ADDR_LOCAL READ|WRITE pair, -1 if none
+} cfg_op_t;
+
+typedef struct {
+  ir_t *irs;
+  int ir_count;
+  bool promote; // no address of a local is taken, so the slots hold the variables
+  bool escaped; // an address of a local was found while building with promote
+  bool valid;   // every jump lands in the function and the predecessors agree on the stack depth
+  cfg_op_t *ops; // one for each ir op
+  block_t *blocks;
+  int block_num;
+  int block_cap;
+  vreg_t *vregs;
+  int vreg_num;
+  int vreg_cap;
+  int *exits;
+  int exit_num;
+  int exit_cap;
+  int *preds;
+  int *uli_blocks; // the block starting with each uli, -1 if none
+  int uli_num;
+  int *stack; // while a block is built
+  int stack_num;
+  int stack_cap;
+} cfg_t;
+
+void cfg_free(cfg_t *cfg) {
+  free(cfg->ops);
+  free(cfg->blocks);
+  free(cfg->vregs);
+  free(cfg->exits);
+  free(cfg->preds);
+  free(cfg->uli_blocks);
+  free(cfg->stack);
+  *cfg = (cfg_t){0};
+}
+
+int cfg_vreg(cfg_t *cfg, vreg_kind_t kind, int num, int arg0, int arg1) {
+  vreg_t vreg = {kind, num, {arg0, arg1}, CV_UNDEF, 0};
+  DA_APPEND(cfg->vregs, cfg->vreg_num, cfg->vreg_cap, vreg);
+  return cfg->vreg_num - 1;
+}
+
+void cfg_push(cfg_t *cfg, int vreg) {
+  DA_APPEND(cfg->stack, cfg->stack_num, cfg->stack_cap, vreg);
+}
+
+// pushes a new vreg as the value of the ir op i
+void cfg_push_new(cfg_t *cfg, int i, vreg_kind_t kind, int num, int arg0, int arg1) {
+  cfg_push(cfg, cfg_vreg(cfg, kind, num, arg0, arg1));
+  cfg->ops[i].pushed = cfg->stack[cfg->stack_num - 1];
+}
+
+int cfg_pop(cfg_t *cfg) {
+  if (cfg->stack_num == 0) {
+    cfg->valid = false;
+    return cfg_vreg(cfg, VR_UNKNOWN, 0, -1, -1);
+  }
+  return cfg->stack[--cfg->stack_num];
+}
+
+// after a store that can reach the locals nothing on the stack is known, after
+// a call only the top slots that the callee writes
+void cfg_clobber(cfg_t *cfg, int slots) {
+  for (int i = slots < cfg->stack_num ? cfg->stack_num - slots : 0; i < cfg->stack_num; ++i) {
+    cfg->stack[i] = cfg_vreg(cfg, VR_UNKNOWN, 0, -1, -1);
+  }
+}
+
+int cfg_block_of_uli(cfg_t *cfg, int uli) {
+  if (uli < 0 || uli >= cfg->uli_num || cfg->uli_blocks[uli] < 0) {
+    cfg->valid = false;
+    return -1;
+  }
+  return cfg->uli_blocks[uli];
+}
+
+void cfg_build_block(cfg_t *cfg, int b) {
+  block_t *block = &cfg->blocks[b];
+  ir_t *irs = cfg->irs;
+  block->params = cfg->vreg_num;
+  cfg->stack_num = 0;
+  for (int s = 0; s < block->depth; ++s) {
+    cfg_push(cfg, cfg_vreg(cfg, VR_PARAM, b, s, -1));
+  }
+
+  for (int i = block->start; i < block->end; ++i) {
+    ir_t ir = irs[i];
+    switch (ir.kind) {
+      case IR_NONE:
+        assert(0);
+      case IR_SETLABEL:
+      case IR_SETULI:
+      case IR_JMP:
+      case IR_FUNCEND:
+      case IR_EXTERN:
+        break;
+      case IR_JMPZ:
+      case IR_JMPNZ:
+        block->cond = cfg_pop(cfg);
+        break;
+      case IR_ADDR_LOCAL:
+      {
+        bool pair = i + 1 < block->end && (irs[i + 1].kind == IR_READ || irs[i + 1].kind == IR_WRITE);
+        // the byte offset of the addressed slot from the start of the function
+        // stack, the parameters and the return value are at 0 and above it
+        int offset = 2 * cfg->stack_num - ir.arg.num + 2;
+        if (!pair
+            || (offset > 0 && (irs[i + 1].arg.num != 2 || offset % 2 != 0 || offset > 2 * cfg->stack_num))) {
+          cfg->escaped = true;
+          if (cfg->promote) {
+            return;
+          }
+        }
+        if (!pair) {
+          cfg_push_new(cfg, i, VR_UNKNOWN, 0, -1, -1);
+          break;
+        }
+        ir_t next = irs[++i];
+        int slots = (next.arg.num + 1) / 2;
+        if (cfg->promote && offset > 0) {
+          int slot = offset / 2 - 1;
+          cfg->ops[i].slot = slot;
+          if (next.kind == IR_READ) {
+            cfg_push(cfg, cfg->stack[slot]);
+            cfg->ops[i].pushed = cfg->stack[slot];
+          } else {
+            int value = cfg_pop(cfg);
+            if (slot < cfg->stack_num) {
+              cfg->stack[slot] = value;
+            }
+          }
+        } else if (next.kind == IR_READ) {
+          for (int s = 0; s < slots; ++s) {
+            cfg_push_new(cfg, i, VR_UNKNOWN, 0, -1, -1);
+          }
+        } else {
+          for (int s = 0; s < slots; ++s) {
+            cfg_pop(cfg);
+          }
+          if (!cfg->promote) {
+            cfg_clobber(cfg, cfg->stack_num);
+          }
+        }
+      } break;
+      case IR_ADDR_GLOBAL:
+        cfg_push_new(cfg, i, VR_UNKNOWN, 0, -1, -1);
+        break;
+      case IR_READ:
+        cfg_pop(cfg);
+        for (int s = 0; s < (ir.arg.num + 1) / 2; ++s) {
+          cfg_push_new(cfg, i, VR_UNKNOWN, 0, -1, -1);
+        }
+        break;
+      case IR_WRITE:
+        cfg_pop(cfg);
+        for (int s = 0; s < (ir.arg.num + 1) / 2; ++s) {
+          cfg_pop(cfg);
+        }
+        // without promote the pointer may point to a local
+        if (!cfg->promote) {
+          cfg_clobber(cfg, cfg->stack_num);
+        }
+        break;
+      case IR_CHANGE_SP:
+        assert(ir.arg.num % 2 == 0);
+        for (int s = 0; s < ir.arg.num / 2; ++s) {
+          cfg_push_new(cfg, i, VR_UNKNOWN, 0, -1, -1);
+        }
+        for (int s = 0; s < -ir.arg.num / 2; ++s) {
+          cfg_pop(cfg);
+        }
+        break;
+      case IR_INT:
+        cfg_push_new(cfg, i, VR_INT, ir.arg.num & 0xFFFF, -1, -1);
+        break;
+      case IR_OPERATION:
+        if (ir.arg.inst == SHL || ir.arg.inst == SHR) {
+          int a = cfg_pop(cfg);
+          cfg_push_new(cfg, i, VR_OP, ir.arg.inst, a, -1);
+        } else {
+          int b = cfg_pop(cfg);
+          int a = cfg_pop(cfg);
+          cfg_push_new(cfg, i, VR_OP, ir.arg.inst, a, b);
+        }
+        break;
+      case IR_MUL:
+      case IR_DIV:
+      {
+        int a = cfg_pop(cfg);
+        cfg_push_new(cfg, i, ir.kind == IR_MUL ? VR_MUL : VR_DIV, ir.arg.num, a, -1);
+      } break;
+      case IR_CALL:
+        // the callee writes its parameters and the return value on this stack
+        cfg_clobber(cfg, ir.arg.call.frame / 2);
+        break;
+    }
+  }
+
+  block->exit = cfg->exit_num;
+  block->exit_depth = cfg->stack_num;
+  for (int s = 0; s < cfg->stack_num; ++s) {
+    DA_APPEND(cfg->exits, cfg->exit_num, cfg->exit_cap, cfg->stack[s]);
+  }
+}
+
+bool cfg_try_build(cfg_t *cfg) {
+  ir_t *irs = cfg->irs;
+  cfg->ops = malloc(cfg->ir_count * sizeof(cfg_op_t));
+  assert(cfg->ops || cfg->ir_count == 0);
+  for (int i = 0; i < cfg->ir_count; ++i) {
+    cfg->ops[i] = (cfg_op_t){-1, -1};
+  }
+
+  for (int i = 0; i < cfg->ir_count;) {
+    block_t block = {i, i + 1, -1, 0, 0, 0, {-1, -1}, -1, 0, 0, {false, false}, false};
+    while (block.end < cfg->ir_count && irs[block.end].kind != IR_SETULI) {
+      ir_kind_t last = irs[block.end - 1].kind;
+      if (last == IR_JMP || last == IR_JMPZ || last == IR_JMPNZ || last == IR_FUNCEND) {
+        break;
+      }
+      ++block.end;
+    }
+    DA_APPEND(cfg->blocks, cfg->block_num, cfg->block_cap, block);
+    i = block.end;
+  }
+
+  for (int b = 0; b < cfg->block_num; ++b) {
+    ir_t first = irs[cfg->blocks[b].start];
+    if (first.kind == IR_SETULI && first.arg.num >= cfg->uli_num) {
+      cfg->uli_num = first.arg.num + 1;
+    }
+  }
+  cfg->uli_blocks = malloc(cfg->uli_num * sizeof(int));
+  assert(cfg->uli_blocks || cfg->uli_num == 0);
+  for (int uli = 0; uli < cfg->uli_num; ++uli) {
+    cfg->uli_blocks[uli] = -1;
+  }
+  for (int b = 0; b < cfg->block_num; ++b) {
+    ir_t first = irs[cfg->blocks[b].start];
+    if (first.kind == IR_SETULI && first.arg.num >= 0 && cfg->uli_blocks[first.arg.num] < 0) {
+      cfg->uli_blocks[first.arg.num] = b;
+    }
+  }
+
+  for (int b = 0; b < cfg->block_num; ++b) {
+    block_t *block = &cfg->blocks[b];
+    ir_t last = irs[block->end - 1];
+    if (last.kind == IR_JMP) {
+      block->succ[0] = cfg_block_of_uli(cfg, last.arg.num);
+    } else if (last.kind != IR_FUNCEND && b + 1 < cfg->block_num) {
+      block->succ[0] = b + 1;
+    }
+    if (last.kind == IR_JMPZ || last.kind == IR_JMPNZ) {
+      block->succ[1] = cfg_block_of_uli(cfg, last.arg.num);
+    }
+  }
+  if (!cfg->valid) {
+    return true;
+  }
+
+  // the blocks no jump or fall through reaches are never built
+  int *work = malloc(cfg->block_num * sizeof(int));
+  assert(work || cfg->block_num == 0);
+  int work_num = 0;
+  if (cfg->block_num > 0) {
+    cfg->blocks[0].depth = 0;
+    work[work_num++] = 0;
+  }
+  while (work_num > 0) {
+    int b = work[--work_num];
+    cfg_build_block(cfg, b);
+    if (cfg->escaped && cfg->promote) {
+      free(work);
+      return false;
+    }
+    for (int s = 0; s < 2; ++s) {
+      int succ = cfg->blocks[b].succ[s];
+      if (succ < 0) {
+        continue;
+      }
+      if (cfg->blocks[succ].depth < 0) {
+        cfg->blocks[succ].depth = cfg->blocks[b].exit_depth;
+        work[work_num++] = succ;
+      } else if (cfg->blocks[succ].depth != cfg->blocks[b].exit_depth) {
+        cfg->valid = false;
+      }
+    }
+  }
+  free(work);
+
+  int pred_num = 0;
+  for (int b = 0; b < cfg->block_num; ++b) {
+    for (int s = 0; s < 2; ++s) {
+      if (cfg->blocks[b].succ[s] >= 0) {
+        cfg->blocks[cfg->blocks[b].succ[s]].pred_num++;
+        pred_num++;
+      }
+    }
+  }
+  cfg->preds = malloc(pred_num * sizeof(int));
+  assert(cfg->preds || pred_num == 0);
+  for (int b = 0, start = 0; b < cfg->block_num; ++b) {
+    cfg->blocks[b].pred_start = start;
+    start += cfg->blocks[b].pred_num;
+    cfg->blocks[b].pred_num = 0;
+  }
+  for (int b = 0; b < cfg->block_num; ++b) {
+    for (int s = 0; s < 2; ++s) {
+      block_t *succ = cfg->blocks[b].succ[s] >= 0 ? &cfg->blocks[cfg->blocks[b].succ[s]] : NULL;
+      if (succ) {
+        cfg->preds[succ->pred_start + succ->pred_num++] = b;
+      }
+    }
+  }
+  return true;
+}
+
+// first assumes that the locals can live in the slots, if one is addressed
+// it starts again with every local in memory
+void cfg_build(cfg_t *cfg, ir_t *irs, int ir_count) {
+  *cfg = (cfg_t){.irs = irs, .ir_count = ir_count, .promote = true, .valid = true};
+  if (!cfg_try_build(cfg)) {
+    cfg_free(cfg);
+    *cfg = (cfg_t){.irs = irs, .ir_count = ir_count, .promote = false, .valid = true};
+    assert(cfg_try_build(cfg));
+  }
+}
+
+bool cfg_const_meet(vreg_t *vreg, const_value_kind_t cv, int value) {
+  if (cv == CV_UNDEF || vreg->cv == CV_VARYING || (vreg->cv == CV_CONST && cv == CV_CONST && vreg->value == value)) {
+    return false;
+  }
+  if (vreg->cv == CV_UNDEF) {
+    vreg->cv = cv;
+    vreg->value = value;
+  } else {
+    vreg->cv = CV_VARYING;
+  }
+  return true;
+}
+
+bool cfg_edge_taken(cfg_t *cfg, block_t *block, int s) {
+  if (block->cond < 0) {
+    return true;
+  }
+  vreg_t *cond = &cfg->vregs[block->cond];
+  if (cond->cv != CV_CONST) {
+    return cond->cv == CV_VARYING;
+  }
+  bool jumps = (cond->value == 0) == (cfg->irs[block->end - 1].kind == IR_JMPZ);
+  return s == 1 ? jumps : !jumps;
+}
+
+// evaluates the vreg v from its inputs, returns whether its value changed
+bool cfg_propagate_vreg(cfg_t *cfg, int v) {
+  vreg_t *vreg = &cfg->vregs[v];
+  vreg_t *a = vreg->args[0] >= 0 ? &cfg->vregs[vreg->args[0]] : NULL;
+  vreg_t *b = vreg->args[1] >= 0 ? &cfg->vregs[vreg->args[1]] : NULL;
+  switch (vreg->kind) {
+    case VR_UNKNOWN:
+    case VR_DIV:
+      return cfg_const_meet(vreg, CV_VARYING, 0);
+    case VR_INT:
+      return cfg_const_meet(vreg, CV_CONST, vreg->num);
+    case VR_MUL:
+      // lowered to shifts, only powers of two are exact
+      if ((vreg->num & (vreg->num - 1)) != 0 || a->cv == CV_VARYING) {
+        return cfg_const_meet(vreg, CV_VARYING, 0);
+      }
+      return cfg_const_meet(vreg, a->cv, (a->value * vreg->num) & 0xFFFF);
+    case VR_OP:
+    {
+      const_value_kind_t cv = CV_CONST;
+      if (a->cv == CV_VARYING || (b && b->cv == CV_VARYING)) {
+        cv = CV_VARYING;
+      } else if (a->cv == CV_UNDEF || (b && b->cv == CV_UNDEF)) {
+        cv = CV_UNDEF;
+      }
+      int value = 0;
+      switch (vreg->num) {
+        case SUM: value = a->value + (b ? b->value : 0); break;
+        case SUB: value = a->value - (b ? b->value : 0); break;
+        case SHL: value = a->value << 1; break;
+        case SHR: value = a->value >> 1; break;
+        default: cv = CV_VARYING; break;
+      }
+      return cfg_const_meet(vreg, cv, value & 0xFFFF);
+    }
+    case VR_PARAM:
+    {
+      bool changed = false;
+      block_t *block = &cfg->blocks[vreg->num];
+      for (int p = 0; p < block->pred_num; ++p) {
+        block_t *pred = &cfg->blocks[cfg->preds[block->pred_start + p]];
+        for (int s = 0; s < 2; ++s) {
+          if (pred->taken[s] && &cfg->blocks[pred->succ[s]] == block) {
+            vreg_t *arg = &cfg->vregs[cfg->exits[pred->exit + vreg->args[0]]];
+            changed |= cfg_const_meet(vreg, arg->cv, arg->value);
+          }
+        }
+      }
+      return changed;
+    }
+  }
+  return false;
+}
+
+// the users of a vreg are the vregs computed from it, the params of the
+// successors it leaves on the stack, and -1 - b for the block b it ends
+void cfg_add_use(int *use_start, int *uses, int v, int user) {
+  if (uses) {
+    uses[use_start[v]++] = user;
+  } else {
+    use_start[v]++;
+  }
+}
+
+void cfg_add_uses(cfg_t *cfg, int *use_start, int *uses) {
+  for (int v = 0; v < cfg->vreg_num; ++v) {
+    for (int k = 0; k < 2; ++k) {
+      if (cfg->vregs[v].kind != VR_PARAM && cfg->vregs[v].args[k] >= 0) {
+        cfg_add_use(use_start, uses, cfg->vregs[v].args[k], v);
+      }
+    }
+  }
+  for (int b = 0; b < cfg->block_num; ++b) {
+    block_t *block = &cfg->blocks[b];
+    if (block->depth < 0) {
+      continue;
+    }
+    if (block->cond >= 0) {
+      cfg_add_use(use_start, uses, block->cond, -1 - b);
+    }
+    for (int s = 0; s < 2; ++s) {
+      if (block->succ[s] < 0 || (s == 1 && block->succ[1] == block->succ[0])) {
+        continue;
+      }
+      for (int slot = 0; slot < block->exit_depth; ++slot) {
+        cfg_add_use(use_start, uses, cfg->exits[block->exit + slot], cfg->blocks[block->succ[s]].params + slot);
+      }
+    }
+  }
+}
+
+// sparse conditional constant propagation: a value is constant if it is the
+// same on every edge that can be executed, and only the edges that the
+// constant conditions allow are executed. a vreg is evaluated again only when
+// one of its inputs changes and a block only when it becomes executable or
+// its condition changes
+void cfg_propagate(cfg_t *cfg) {
+  if (!cfg->valid || cfg->block_num == 0) {
+    return;
+  }
+  int *use_start = calloc(cfg->vreg_num + 1, sizeof(int));
+  assert(use_start);
+  cfg_add_uses(cfg, use_start, NULL);
+  for (int v = 0, start = 0; v <= cfg->vreg_num; ++v) {
+    int num = use_start[v];
+    use_start[v] = start;
+    start += num;
+  }
+  int *uses = malloc(use_start[cfg->vreg_num] * sizeof(int));
+  assert(uses || use_start[cfg->vreg_num] == 0);
+  // moves use_start[v] to the end of the uses of v
+  cfg_add_uses(cfg, use_start, uses);
+
+  int *vreg_work = malloc(cfg->vreg_num * sizeof(int));
+  bool *vreg_queued = malloc(cfg->vreg_num * sizeof(bool));
+  int *block_work = malloc(cfg->block_num * sizeof(int));
+  bool *block_queued = calloc(cfg->block_num, sizeof(bool));
+  assert((vreg_work && vreg_queued) || cfg->vreg_num == 0);
+  assert(block_work && block_queued);
+  int vreg_work_num = 0;
+  for (int v = cfg->vreg_num - 1; v >= 0; --v) {
+    vreg_work[vreg_work_num++] = v;
+    vreg_queued[v] = true;
+  }
+  int block_work_num = 0;
+  cfg->blocks[0].executable = true;
+  block_work[block_work_num++] = 0;
+  block_queued[0] = true;
+
+  while (vreg_work_num > 0 || block_work_num > 0) {
+    if (block_work_num > 0) {
+      int b = block_work[--block_work_num];
+      block_queued[b] = false;
+      block_t *block = &cfg->blocks[b];
+      for (int s = 0; s < 2; ++s) {
+        if (block->succ[s] < 0 || block->taken[s] || !cfg_edge_taken(cfg, block, s)) {
+          continue;
+        }
+        block->taken[s] = true;
+        block_t *succ = &cfg->blocks[block->succ[s]];
+        if (!succ->executable) {
+          succ->executable = true;
+          if (!block_queued[block->succ[s]]) {
+            block_work[block_work_num++] = block->succ[s];
+            block_queued[block->succ[s]] = true;
+          }
+        }
+        for (int slot = 0; slot < succ->depth; ++slot) {
+          if (!vreg_queued[succ->params + slot]) {
+            vreg_work[vreg_work_num++] = succ->params + slot;
+            vreg_queued[succ->params + slot] = true;
+          }
+        }
+      }
+      continue;
+    }
+    int v = vreg_work[--vreg_work_num];
+    vreg_queued[v] = false;
+    if (!cfg_propagate_vreg(cfg, v)) {
+      continue;
+    }
+    for (int u = v > 0 ? use_start[v - 1] : 0; u < use_start[v]; ++u) {
+      int user = uses[u];
+      if (user < 0) {
+        if (cfg->blocks[-1 - user].executable && !block_queued[-1 - user]) {
+          block_work[block_work_num++] = -1 - user;
+          block_queued[-1 - user] = true;
+        }
+      } else if (!vreg_queued[user]) {
+        vreg_work[vreg_work_num++] = user;
+        vreg_queued[user] = true;
+      }
+    }
+  }
+  free(use_start);
+  free(uses);
+  free(vreg_work);
+  free(vreg_queued);
+  free(block_work);
+  free(block_queued);
+}
+
+// drops the ops set to IR_NONE
+void ir_compact(ir_t *irs, int *ir_count) {
+  int out = 0;
+  for (int i = 0; i < *ir_count; ++i) {
+    if (irs[i].kind != IR_NONE) {
+      irs[out++] = irs[i];
+    }
+  }
+  *ir_count = out;
+}
+
+// counts a rewrite of the cfg passes at the index i of the function, with
+// -d opt prints it and returns true for the caller to add the text
+bool cfg_remark(opt_remark_t remark, ir_t *irs, int i, int saved) {
+  opt_remark_info_t *info = &opt_remarks[remark];
+  info->hits++;
+  info->total += saved;
+  if (!remarks.print) {
+    return false;
+  }
+  remark_function_t *function = irs[0].kind == IR_SETLABEL ? remark_function_find(irs[0].arg.sv) : NULL;
+  remark_start(function ? &function->loc : NULL, false, info->pass, info->name, function, i, saved, "ir");
+  return true;
+}
+
+// the reads of a local that is the same constant on every path become INTs,
+// that the ir rules can fold further, returns how many
+int cfg_fold_constants(ir_t *irs, int *ir_count) {
+  cfg_t cfg;
+  cfg_build(&cfg, irs, *ir_count);
+  cfg_propagate(&cfg);
+
+  int folded = 0;
+  for (int b = 0; b < cfg.block_num && cfg.valid; ++b) {
+    block_t *block = &cfg.blocks[b];
+    for (int i = block->start; i < block->end && block->executable; ++i) {
+      if (irs[i].kind != IR_READ || cfg.ops[i].slot < 0 || cfg.vregs[cfg.ops[i].pushed].cv != CV_CONST) {
+        continue;
+      }
+      int value = cfg.vregs[cfg.ops[i].pushed].value;
+      irs[i - 1] = (ir_t){IR_INT, {.num = value}};
+      irs[i].kind = IR_NONE;
+      folded++;
+      if (cfg_remark(OR_CONST_PROP, irs, i, 1)) {
+        printf("the local in slot %d is always %d\n", cfg.ops[i].slot, value);
+      }
+    }
+  }
+  cfg_free(&cfg);
+  ir_compact(irs, ir_count);
+  return folded;
+}
+
+bool ir_is_jump(ir_t ir) {
+  return ir.kind == IR_JMP || ir.kind == IR_JMPZ || ir.kind == IR_JMPNZ;
+}
+
+// one more than the largest uli set or jumped to in the function
+int ir_uli_num(ir_t *irs, int ir_count) {
+  int uli_num = 0;
+  for (int i = 0; i < ir_count; ++i) {
+    if ((irs[i].kind == IR_SETULI || ir_is_jump(irs[i])) && irs[i].arg.num >= uli_num) {
+      uli_num = irs[i].arg.num + 1;
+    }
+  }
+  return uli_num;
+}
+
+// maps every uli below uli_num to the index of its SETULI, -1 if it is not set
+int *ir_index_ulis(ir_t *irs, int ir_count, int uli_num) {
+  int *index = malloc(uli_num * sizeof(int));
+  assert(index || uli_num == 0);
+  for (int uli = 0; uli < uli_num; ++uli) {
+    index[uli] = -1;
+  }
+  for (int i = ir_count - 1; i >= 0; --i) {
+    if (irs[i].kind == IR_SETULI && irs[i].arg.num >= 0) {
+      index[irs[i].arg.num] = i;
+    }
+  }
+  return index;
+}
+
+// the stack slots popped and pushed by an ir op without side effects, false
+// for the others
+bool ir_pure_effect(ir_t ir, int *pops, int *pushes) {
+  switch (ir.kind) {
+    case IR_INT:
+    case IR_ADDR_LOCAL:
+    case IR_ADDR_GLOBAL:
+      *pops = 0;
+      *pushes = 1;
+      return true;
+    case IR_READ:
+      *pops = 1;
+      *pushes = (ir.arg.num + 1) / 2;
+      return true;
+    case IR_OPERATION:
+      *pops = ir.arg.inst == SHL || ir.arg.inst == SHR ? 1 : 2;
+      *pushes = 1;
+      return true;
+    case IR_MUL:
+    case IR_DIV:
+      *pops = 1;
+      *pushes = 1;
+      return true;
+    case IR_CHANGE_SP:
+      *pops = ir.arg.num < 0 ? -ir.arg.num / 2 : 0;
+      *pushes = ir.arg.num > 0 ? ir.arg.num / 2 : 0;
+      return true;
+    default:
+      return false;
+  }
+}
+
+// the ops right before the CHANGE_SP at i that only push values it pops
+// again, the longest run is removed and the CHANGE_SP pops what is left
+int cfg_remove_dead_values(ir_t *irs, int i) {
+  int slots = -irs[i].arg.num / 2;
+  int net = 0;
+  int low = 0; // the lowest depth of the run from its start
+  int best = i;
+  int best_net = 0;
+  int pops, pushes;
+  for (int j = i - 1; j >= 0 && ir_pure_effect(irs[j], &pops, &pushes); --j) {
+    net += pushes - pops;
+    low = -pops < pushes - pops + low ? -pops : pushes - pops + low;
+    if (low >= 0 && net > 0 && net <= slots) {
+      best = j;
+      best_net = net;
+    }
+  }
+  if (best == i) {
+    return 0;
+  }
+  if (cfg_remark(OR_DEAD_VALUE, irs, best, i - best)) {
+    printf("%d slot%s pushed only to be popped\n", best_net, best_net == 1 ? "" : "s");
+  }
+  for (int j = best; j < i; ++j) {
+    irs[j].kind = IR_NONE;
+  }
+  irs[i].arg.num += 2 * best_net;
+  return 1;
+}
+
+// removes what can never run or has no effect: the jumps on a constant, the
+// blocks that no path reaches, the jumps to the next op, the labels that are
+// never jumped to and the values that are pushed only to be popped, and
+// repeats while one enables another, returns the number of rewrites. each
+// round indexes the labels once, so it is linear in the function
+int cfg_remove_dead(ir_t *irs, int *ir_count) {
+  int removed = 0;
+  for (bool changed = true; changed;) {
+    int before = removed;
+    for (int i = 1; i < *ir_count; ++i) {
+      if ((irs[i].kind == IR_JMPZ || irs[i].kind == IR_JMPNZ) && irs[i - 1].kind == IR_INT) {
+        bool jumps = ((irs[i - 1].arg.num & 0xFFFF) == 0) == (irs[i].kind == IR_JMPZ);
+        if (cfg_remark(OR_CONST_BRANCH, irs, i, jumps ? 1 : 2)) {
+          printf("the condition is always %s\n", jumps ? "taken" : "not taken");
+        }
+        irs[i - 1].kind = IR_NONE;
+        irs[i].kind = jumps ? IR_JMP : IR_NONE;
+        removed++;
+      }
+    }
+    ir_compact(irs, ir_count);
+
+    // a jump to a label followed by a jump goes directly to the last target,
+    // the bound stops on loops made only of jumps
+    int uli_num = ir_uli_num(irs, *ir_count);
+    int *uli_index = ir_index_ulis(irs, *ir_count, uli_num);
+    for (int i = 0; i < *ir_count; ++i) {
+      for (int bound = 0; ir_is_jump(irs[i]) && bound < *ir_count; ++bound) {
+        int uli = irs[i].arg.num;
+        int target = uli >= 0 && uli < uli_num ? uli_index[uli] : -1;
+        while (target >= 0 && target < *ir_count && irs[target].kind == IR_SETULI) {
+          target++;
+        }
+        if (target < 0 || target >= *ir_count || irs[target].kind != IR_JMP || irs[target].arg.num == irs[i].arg.num) {
+          break;
         }
-        state_add_ir(state, (ir_t){IR_JMP, {.num = a}});
-        state_add_ir(state, (ir_t){IR_SETULI, {.num = b}});
-        state_drop_break_target(state);
+        if (cfg_remark(OR_JUMP_THREAD, irs, i, 0)) {
+          printf("_%03d jumps to _%03d\n", irs[i].arg.num, irs[target].arg.num);
+        }
+        irs[i].arg.num = irs[target].arg.num;
+        removed++;
       }
-      break;
-    case A_EXTERN:
-      assert(ast->as.ast->kind == A_FUNCDEF);
-      state_add_ir(state, (ir_t){IR_EXTERN, {.sv = ast->as.ast->as.funcdef.name.image}});
-      compile(ast->as.ast, state);
-      break;
-    case A_BREAK:
-      if (state->break_target_num == 0) {
-        eprintf(ast->loc, "break statement not within loop or switch");
+    }
+    free(uli_index);
+
+    cfg_t cfg;
+    cfg_build(&cfg, irs, *ir_count);
+    for (int b = 0; b < cfg.block_num && cfg.valid; ++b) {
+      block_t *block = &cfg.blocks[b];
+      // an extern after a function is a declaration, not code of the block
+      int code = 0;
+      for (int i = block->start; i < block->end; ++i) {
+        code += irs[i].kind != IR_EXTERN;
       }
-      break_target_info_t info = state->break_target[state->break_target_num - 1];
-      state_add_ir(state, (ir_t){IR_CHANGE_SP, {.num = -(state->sp - info.sp)}});
-      state_add_ir(state, (ir_t){IR_JMP, {.num = info.uli}});
-      break;
+      if (block->depth >= 0 || code == 0) {
+        continue;
+      }
+      if (cfg_remark(OR_UNREACHABLE, irs, block->start, block->end - block->start)) {
+        printf("no path reaches the block\n");
+      }
+      for (int i = block->start; i < block->end; ++i) {
+        if (irs[i].kind != IR_EXTERN) {
+          irs[i].kind = IR_NONE;
+        }
+      }
+      removed++;
+    }
+    cfg_free(&cfg);
+    ir_compact(irs, ir_count);
+
+    for (int i = 0; i < *ir_count; ++i) {
+      if (!ir_is_jump(irs[i])) {
+        continue;
+      }
+      for (int next = i + 1; next < *ir_count && irs[next].kind == IR_SETULI; ++next) {
+        if (irs[next].arg.num != irs[i].arg.num) {
+          continue;
+        }
+        if (cfg_remark(OR_JUMP_NEXT, irs, i, irs[i].kind == IR_JMP ? 1 : 0)) {
+          printf("_%03d is the next op\n", irs[i].arg.num);
+        }
+        // the conditional jumps still pop the condition
+        irs[i] = irs[i].kind == IR_JMP ? (ir_t){IR_NONE, {}} : (ir_t){IR_CHANGE_SP, {.num = -2}};
+        removed++;
+        break;
+      }
+    }
+
+    // the jumps are counted after the ones to the next op are gone
+    uli_num = ir_uli_num(irs, *ir_count);
+    int *uli_jumps = calloc(uli_num, sizeof(int));
+    assert(uli_jumps || uli_num == 0);
+    for (int i = 0; i < *ir_count; ++i) {
+      if (ir_is_jump(irs[i]) && irs[i].arg.num >= 0) {
+        uli_jumps[irs[i].arg.num]++;
+      }
+    }
+    for (int i = 0; i < *ir_count; ++i) {
+      if (irs[i].kind != IR_SETULI) {
+        continue;
+      }
+      if (irs[i].arg.num < 0 || uli_jumps[irs[i].arg.num] == 0) {
+        if (cfg_remark(OR_UNUSED_LABEL, irs, i, 1)) {
+          printf("no jump goes to _%03d\n", irs[i].arg.num);
+        }
+        irs[i].kind = IR_NONE;
+        removed++;
+      }
+    }
+    free(uli_jumps);
+    ir_compact(irs, ir_count);
+
+    for (int i = 0; i < *ir_count; ++i) {
+      if (irs[i].kind == IR_CHANGE_SP && irs[i].arg.num < 0) {
+        removed += cfg_remove_dead_values(irs, i);
+      }
+    }
+    ir_compact(irs, ir_count);
+    changed = removed != before;
+  }
+  return removed;
+}
+
+char *cfg_vreg_name(cfg_t *cfg, int v, char *name, int size) {
+  vreg_t *vreg = &cfg->vregs[v];
+  if (vreg->cv == CV_CONST) {
+    snprintf(name, size, "v%d=%d", v, vreg->value);
+  } else {
+    snprintf(name, size, "v%d", v);
+  }
+  return name;
+}
+
+void cfg_dump(ir_t *irs, int ir_count) {
+  cfg_t cfg;
+  cfg_build(&cfg, irs, ir_count);
+  cfg_propagate(&cfg);
+  char name[32];
+  printf("FUNCTION " SV_FMT "%s%s\n",
+         SV_UNPACK(ir_function_name(irs, 0)),
+         cfg.promote ? "" : " (locals in memory)",
+         cfg.valid ? "" : " (invalid)");
+  for (int b = 0; b < cfg.block_num; ++b) {
+    block_t *block = &cfg.blocks[b];
+    printf("  b%d (", b);
+    for (int s = 0; s < block->depth; ++s) {
+      printf("%s%s", s ? " " : "", cfg_vreg_name(&cfg, block->params + s, name, sizeof(name)));
+    }
+    printf(")");
+    if (block->pred_num > 0) {
+      printf(" <-");
+      for (int p = 0; p < block->pred_num; ++p) {
+        printf(" b%d", cfg.preds[block->pred_start + p]);
+      }
+    }
+    for (int s = 0; s < 2; ++s) {
+      if (block->succ[s] >= 0) {
+        printf(" %s b%d", s ? "|" : "->", block->succ[s]);
+      }
+    }
+    if (!block->executable) {
+      printf(" unreachable");
+    }
+    printf("\n");
+    for (int i = block->start; i < block->end; ++i) {
+      int pushed = cfg.ops[i].pushed;
+      printf("    %-12s ", pushed >= 0 ? cfg_vreg_name(&cfg, pushed, name, sizeof(name)) : "");
+      ir_dump(irs[i]);
+    }
+  }
+  cfg_free(&cfg);
+}
+
+void optimize_ir(ir_t *irs, int *ir_count, optlevel_t opt) {
+  // the cfg needs the functions one by one, rules that match a label skip it
+  bool cfg = opt >= OL_CFG;
+  if ((!trace.file && !cfg) || rule_set_matches_kind(&ir_rules, IR_SETLABEL)) {
+    rule_set_run(&ir_rules, irs, ir_count, opt);
+    return;
+  }
+
+  // no match can span a label, so a run per function rewrites the same as one
+  // over the whole list and the trace gets a span for each function
+  int out = 0;
+  for (int start = 0, end; start < *ir_count; start = end) {
+    end = ir_function_end(irs, *ir_count, start);
+    double trace_start = trace_begin();
+    int num = end - start;
+    int rewrites = 0;
+    if (cfg) {
+      // before the rules merge the pop of a dead value with the next push and
+      // merge the reads of locals in multi-word READs the cfg cannot promote
+      rewrites += cfg_remove_dead(irs + start, &num);
+      rewrites += cfg_fold_constants(irs + start, &num);
+    }
+    rewrites += rule_set_run(&ir_rules, irs + start, &num, opt);
+    if (cfg) {
+      int removed = cfg_remove_dead(irs + start, &num);
+      if (removed > 0) {
+        rewrites += removed + rule_set_run(&ir_rules, irs + start, &num, opt);
+      }
+    }
+    sv_t name = ir_function_name(irs, start);
+    memmove(irs + out, irs + start, num * sizeof(ir_t));
+    out += num;
+    trace_end("optimize_ir", name, trace_start, 3, "ir_in", end - start, "ir_out", num, "rewrites", rewrites);
+  }
+  *ir_count = out;
+}
+
+// --export, the functions that other objects call: they are GLOBAL and always kept
+struct {
+  sv_t *names;
+  int num;
+  int cap;
+} exports = {0};
+
+void exports_free() {
+  free(exports.names);
+  exports.names = NULL;
+  exports.num = 0;
+  exports.cap = 0;
+}
+
+// the start of the function in the ir, -1 if it is not defined there
+int ir_find_function(ir_t *irs, int ir_count, sv_t name) {
+  for (int i = 0; i < ir_count; ++i) {
+    if (irs[i].kind == IR_SETLABEL && sv_eq(irs[i].arg.sv, name)) {
+      return i;
+    }
   }
+  return -1;
 }
 
-bool is_ir_kind(ir_t *irs, int *ir_count, int i, ir_kind_t kind) {
-  assert(irs);
-  return i < *ir_count && irs[i].kind == kind;
+// marks the function as reached and queues it to follow its calls, starts
+// maps the interned names below start_num to the SETLABEL of the function
+void callgraph_reach(int *starts, int start_num, sv_t name, bool *reached, int *work, int *work_num) {
+  int id = intern(name);
+  int start = id < start_num ? starts[id] : -1;
+  if (start >= 0 && !reached[start]) {
+    reached[start] = true;
+    work[(*work_num)++] = start;
+  }
 }
 
-void optimize_ir(ir_t *irs, int *ir_count, bool debug_opt, optlevel_t opt) {
-  assert(irs);
-  assert(ir_count);
+// the call graph from main, the calls of the init code and the exported
+// functions: what none of them reaches is dropped, but its EXTERNs stay
+void ir_remove_unused_functions(ir_t *irs, int *ir_count, ir_t *irs_init, int ir_init_num) {
+  int *work = malloc((*ir_count + 1) * sizeof(int));
+  bool *reached = calloc(*ir_count + 1, sizeof(bool));
+  assert(work && reached);
+  int work_num = 0;
 
+  // the functions are indexed once, so a call edge costs one lookup
   for (int i = 0; i < *ir_count; ++i) {
-    if (opt >= OL_BASE && is_ir_kind(irs, ir_count, i, IR_CHANGE_SP) && irs[i].arg.num == 0) {
-      if (debug_opt) {
-        printf("  %03d | CHANGE_SP(0) -> nothing\n", i);
-      }
-
-      *ir_count -= 1;
-      memcpy(irs + i, irs + i + 1, (*ir_count - i) * sizeof(ir_t));
-      i = 0;
-    } else if (opt >= OL_BASE && is_ir_kind(irs, ir_count, i, IR_CHANGE_SP) && is_ir_kind(irs, ir_count, i + 1, IR_CHANGE_SP)) {
-      if (debug_opt) {
-        printf("  %03d | CHANGE_SP(x) CHANGE_SP(y) -> CHANGE_SP(x+y)\n", i);
-      }
-
-      irs[i + 1].arg.num += irs[i].arg.num;
-      *ir_count -= 1;
-      memcpy(irs + i, irs + i + 1, (*ir_count - i) * sizeof(ir_t));
-      i = 0;
-    } else if (opt >= OL_MULTI_READ && is_ir_kind(irs, ir_count, i, IR_ADDR_LOCAL)
-               && is_ir_kind(irs, ir_count, i + 1, IR_READ)
-               && is_ir_kind(irs, ir_count, i + 2, IR_CHANGE_SP)
-               && irs[i + 1].arg.num <= -irs[i + 2].arg.num) {
-      if (debug_opt) {
-        printf("  %03d | ADDR_LOCAL READ(x) CHANGE_SP(y) if x <= -y -> CHANGE_SP(x+y)\n", i);
-      }
-
-      irs[i + 2].arg.num += irs[i + 1].arg.num;
-      *ir_count -= 2;
-      memcpy(irs + i, irs + i + 2, (*ir_count - i) * sizeof(ir_t));
-      i = 0;
-    } else if (opt >= OL_MULTI_READ && is_ir_kind(irs, ir_count, i, IR_ADDR_LOCAL)
-               && is_ir_kind(irs, ir_count, i + 1, IR_READ)
-               && is_ir_kind(irs, ir_count, i + 2, IR_ADDR_LOCAL)
-               && is_ir_kind(irs, ir_count, i + 3, IR_READ)
-               && irs[i].arg.num - irs[i + 3].arg.num == irs[i + 2].arg.num - irs[i + 1].arg.num) {
-      if (debug_opt) {
-        printf("  %03d | ADDR_LOCAL(x+z) READ(y) ADDR_LOCAL(y+z) READ(z) -> ADDR_LOCAL(z) READ(x+y)\n", i);
-      }
-
-      irs[i + 2].arg.num = irs[i].arg.num - irs[i + 3].arg.num;
-      irs[i + 3].arg.num += irs[i + 1].arg.num;
-      *ir_count -= 2;
-      memcpy(irs + i, irs + i + 2, (*ir_count - i) * sizeof(ir_t));
-      i = 0;
-    } else if (opt >= OL_MATH && is_ir_kind(irs, ir_count, i, IR_INT) && is_ir_kind(irs, ir_count, i + 1, IR_INT)
-               && is_ir_kind(irs, ir_count, i + 2, IR_OPERATION) && irs[i + 2].arg.inst == B_AH) {
-      if (debug_opt) {
-        printf("  %03d | INT(x) INT(y) OPERATION(B_AH) -> INT((x << 8) | y)\n", i);
-      }
-
-      irs[i].arg.num = (irs[i].arg.num << 8) | irs[i + 1].arg.num;
-      *ir_count -= 2;
-      memcpy(irs + i + 1, irs + i + 3, (*ir_count - i) * sizeof(ir_t));
-      i = 0;
-    } else if (opt >= OL_MATH && is_ir_kind(irs, ir_count, i, IR_INT) && is_ir_kind(irs, ir_count, i + 1, IR_INT)
-               && is_ir_kind(irs, ir_count, i + 2, IR_OPERATION)
-               && (irs[i + 2].arg.inst == SUM || irs[i + 2].arg.inst == SUB)) {
-      if (debug_opt) {
-        printf("  %03d | INT(x) INT(y) OPERATION(SUM|SUB) -> INT(x+y | x-y)\n", i);
-      }
-
-      irs[i].arg.num += (irs[i + 2].arg.inst == SUB ? -1 : 1) * irs[i + 1].arg.num;
-      *ir_count -= 2;
-      memcpy(irs + i + 1, irs + i + 3, (*ir_count - i) * sizeof(ir_t));
-      i = 0;
-    } else if (opt >= OL_MULTI_READ && is_ir_kind(irs, ir_count, i, IR_ADDR_LOCAL)
-               && is_ir_kind(irs, ir_count, i + 1, IR_READ)
-               && is_ir_kind(irs, ir_count, i + 2, IR_ADDR_LOCAL)
-               && is_ir_kind(irs, ir_count, i + 3, IR_WRITE)
-               && is_ir_kind(irs, ir_count, i + 4, IR_CHANGE_SP) && irs[i].arg.num == 2
-               && irs[i + 1].arg.num == irs[i + 3].arg.num
-               && -irs[i + 4].arg.num >= irs[i + 1].arg.num) {
-      if (debug_opt) {
-        printf("  %03d | ADDR_LOCAL(2) READ(x) ADDR_LOCAL(y) WRITE(x) CHANGE_SP(z) if -z>=x -> ADDR_LOCAL(y-x) WRITE(x) CHANGE_SP(z+x)\n", i);
-      }
-
-      irs[i + 2].arg.num -= irs[i + 1].arg.num;
-      irs[i + 4].arg.num += irs[i + 1].arg.num;
-      *ir_count -= 2;
-      memcpy(irs + i, irs + i + 2, (*ir_count - i) * sizeof(ir_t));
-      i = 0;
-    } else if (opt > OL_MATH && is_ir_kind(irs, ir_count, i, IR_INT)
-               && is_ir_kind(irs, ir_count, i + 1, IR_MUL)) {
-      if (debug_opt) {
-        printf("  %03d | INT(x) MUL(y) -> INT(x * y)\n", i);
-      }
-
-      irs[i].arg.num *= irs[i + 1].arg.num;
-      *ir_count -= 1;
-      memcpy(irs + i + 1, irs + i + 2, (*ir_count - i) * sizeof(ir_t));
-      i = 0;
-    } else if (opt > OL_MATH && is_ir_kind(irs, ir_count, i, IR_ADDR_LOCAL)
-               && is_ir_kind(irs, ir_count, i + 1, IR_INT)
-               && is_ir_kind(irs, ir_count, i + 2, IR_OPERATION)
-               && irs[i + 2].arg.inst == SUM) {
-      if (debug_opt) {
-        printf("  %03d | ADDR_LOCAL(x) INT(y) OPERATION(SUM) -> ADDR_LOCAL(x + y)\n", i);
-      }
-
-      irs[i].arg.num += irs[i + 1].arg.num;
-      *ir_count -= 2;
-      memcpy(irs + i + 1, irs + i + 3, (*ir_count - i) * sizeof(ir_t));
-      i = 0;
-    } else if (opt > OL_MATH && is_ir_kind(irs, ir_count, i, IR_ADDR_GLOBAL)
-               && is_ir_kind(irs, ir_count, i + 1, IR_INT)
-               && is_ir_kind(irs, ir_count, i + 2, IR_OPERATION)
-               && irs[i + 2].arg.inst == SUM) {
-      if (debug_opt) {
-        printf("  %03d | ADDR_GLOBAL(x,y) INT(z) OPERATION(SUM) -> ADDR_GLOBAL(x,y+z)\n", i);
-      }
-
-      irs[i].arg.loc.offset += irs[i + 1].arg.num;
-      *ir_count -= 2;
-      memcpy(irs + i + 1, irs + i + 3, (*ir_count - i) * sizeof(ir_t));
-      i = 0;
-    } else if (opt > OL_MATH
-               && is_ir_kind(irs, ir_count, i, IR_INT)
-               && irs[i].arg.num == 0
-               && is_ir_kind(irs, ir_count, i + 1, IR_OPERATION)
-               && (irs[i + 1].arg.inst == SUM || irs[i + 1].arg.inst == SUB)) {
-      if (debug_opt) {
-        printf("  %03d | INT(0) OPERATION(SUM|SUB) -> nothing\n", i);
-      }
-
-      *ir_count -= 2;
-      memcpy(irs + i, irs + i + 2, (*ir_count - i) * sizeof(ir_t));
-      i = 0;
+    if (irs[i].kind == IR_SETLABEL) {
+      intern(irs[i].arg.sv);
+    }
+  }
+  int start_num = interner.name_num;
+  int *starts = malloc(start_num * sizeof(int));
+  assert(starts || start_num == 0);
+  for (int id = 0; id < start_num; ++id) {
+    starts[id] = -1;
+  }
+  for (int i = *ir_count - 1; i >= 0; --i) {
+    if (irs[i].kind == IR_SETLABEL) {
+      starts[intern(irs[i].arg.sv)] = i;
+    }
+  }
+
+  // what comes before the first function is not a function
+  if (*ir_count > 0 && irs[0].kind != IR_SETLABEL) {
+    reached[0] = true;
+  }
+  callgraph_reach(starts, start_num, sv_from_cstr("main"), reached, work, &work_num);
+  for (int i = 0; i < ir_init_num; ++i) {
+    if (irs_init[i].kind == IR_CALL) {
+      callgraph_reach(starts, start_num, irs_init[i].arg.call.name, reached, work, &work_num);
+    }
+  }
+  for (int i = 0; i < exports.num; ++i) {
+    callgraph_reach(starts, start_num, exports.names[i], reached, work, &work_num);
+  }
+  while (work_num > 0) {
+    int start = work[--work_num];
+    for (int i = start, end = ir_function_end(irs, *ir_count, start); i < end; ++i) {
+      if (irs[i].kind == IR_CALL) {
+        callgraph_reach(starts, start_num, irs[i].arg.call.name, reached, work, &work_num);
+      }
+    }
+  }
+  free(starts);
+
+  int out = 0;
+  for (int start = 0, end; start < *ir_count; start = end) {
+    end = ir_function_end(irs, *ir_count, start);
+    if (!reached[start] && cfg_remark(OR_UNUSED_FUNCTION, irs + start, 0, end - start)) {
+      printf("no call from main reaches " SV_FMT "\n", SV_UNPACK(irs[start].arg.sv));
+    }
+    for (int i = start; i < end; ++i) {
+      if (reached[start] || irs[i].kind == IR_EXTERN) {
+        irs[out++] = irs[i];
+      }
+    }
+  }
+  *ir_count = out;
+  free(work);
+  free(reached);
+}
+
+bool bytecode_references(compiled_t *compiled, char *label) {
+  bytecode_t *lists[] = {compiled->init, compiled->code};
+  int nums[] = {compiled->init_num, compiled->code_num};
+  for (int l = 0; l < 2; ++l) {
+    for (int i = 0; i < nums[l]; ++i) {
+      bytecode_kind_t kind = lists[l][i].kind;
+      if ((kind == BINSTLABEL || kind == BINSTRELLABEL) && strcmp(lists[l][i].arg.string, label) == 0) {
+        return true;
+      }
+    }
+  }
+  return false;
+}
+
+// the globals and the strings are an ALIGN and a label followed by their
+// bytes, those that no code references anymore are dropped
+void compiled_remove_unused_data(compiled_t *compiled) {
+  int out = 0;
+  for (int i = 0; i < compiled->data_num;) {
+    int end = i + 1;
+    if (compiled->data[i].kind == BALIGN && end < compiled->data_num && compiled->data[end].kind == BSETLABEL) {
+      while (end < compiled->data_num && compiled->data[end].kind != BALIGN
+             && compiled->data[end].kind != BEXTERN && compiled->data[end].kind != BGLOBAL) {
+        ++end;
+      }
+      char *label = compiled->data[i + 1].arg.string;
+      if (!bytecode_references(compiled, label)) {
+        opt_remarks[OR_UNUSED_DATA].hits++;
+        if (remarks.print) {
+          remark_start(NULL, false, "callgraph", opt_remarks[OR_UNUSED_DATA].name, NULL, 0, 0, NULL);
+          printf("no code references %s\n", label);
+        }
+        i = end;
+        continue;
+      }
+    }
+    for (; i < end; ++i) {
+      compiled->data[out++] = compiled->data[i];
     }
   }
+  compiled->data_num = out;
+}
+
+void optimize_asm(bytecode_t *bs, int *b_count, optlevel_t opt) {
+  rule_set_run(&asm_rules, bs, b_count, opt);
 }
 
 void compile_change_sp(state_t *state, int delta) {
@@ -4277,33 +7077,94 @@ void compile_change_sp(state_t *state, int delta) {
   }
 }
 
-void compile_ir_list(state_t *state, ir_t *irs, int ir_count) {
+// with -O4 the top of the ir stack is kept in A instead of being pushed and
+// popped right back: cached is 1 while it is in A and 2 while B also holds the
+// slot below it, that only lasts until the binary operation that takes both.
+// The slots are spilled before labels, jumps, calls and anything that needs A,
+// so at the labels the stack is the same as without caching
+void compile_ir_spill(compiled_t *compiled, int *cached) {
+  assert(*cached < 2);
+  if (*cached == 1) {
+    code(compiled, (bytecode_t){BINST, PUSHA, {}});
+    *cached = 0;
+  }
+}
+
+void compile_ir_top_to_a(compiled_t *compiled, int *cached) {
+  assert(*cached < 2);
+  if (*cached == 0) {
+    code(compiled, (bytecode_t){BINST, POPA, {}});
+    *cached = 1;
+  }
+}
+
+// the ops that take their operands from A and B
+bool ir_is_binary_op(ir_t *irs, int ir_count, int iri) {
+  return iri < ir_count && irs[iri].kind == IR_OPERATION
+         && (irs[iri].arg.inst == SUM || irs[iri].arg.inst == SUB || irs[iri].arg.inst == B_AH);
+}
+
+// the ops that change only A
+bool ir_is_a_only_op(ir_t ir) {
+  return (ir.kind == IR_OPERATION && (ir.arg.inst == SHL || ir.arg.inst == SHR)) || ir.kind == IR_MUL || ir.kind == IR_DIV;
+}
+
+// if the value pushed before iri reaches a binary operation only through the
+// ops that leave B alone, B can keep the lhs in the meantime
+bool ir_binary_op_follows(ir_t *irs, int ir_count, int iri) {
+  while (iri < ir_count && ir_is_a_only_op(irs[iri])) {
+    ++iri;
+  }
+  return ir_is_binary_op(irs, ir_count, iri);
+}
+
+// before a value is loaded in A: with the top in A and a binary operation
+// next, the top moves to B as its lhs, else it is spilled
+void compile_ir_before_load(compiled_t *compiled, int *cached, bool to_b) {
+  if (*cached == 1 && to_b) {
+    code(compiled, (bytecode_t){BINST, A_B, {}});
+    *cached = 2;
+  } else {
+    compile_ir_spill(compiled, cached);
+    *cached = 1;
+  }
+}
+
+void compile_ir_list(state_t *state, ir_t *irs, int ir_count, optlevel_t opt) {
   assert(state);
-  assert(irs);
+  assert(irs || ir_count == 0);
   compiled_t *compiled = &state->compiled;
+  bool cache = opt >= OL_CFG;
+  int cached = 0;
 
   for (int iri = 0; iri < ir_count; ++iri) {
     ir_t ir = irs[iri];
+    assert(cached < 2 || ir_binary_op_follows(irs, ir_count, iri));
 
     switch (ir.kind) {
       case IR_NONE:
         assert(0);
       case IR_SETLABEL:
+        compile_ir_spill(compiled, &cached);
         code(compiled, bytecode_with_sv(BSETLABEL, 0, ir.arg.sv));
         break;
       case IR_SETULI:
+        compile_ir_spill(compiled, &cached);
         code(compiled, bytecode_uli(BSETLABEL, 0, ir.arg.num));
         break;
       case IR_JMPZ:
       case IR_JMPNZ:
-        code(compiled, (bytecode_t){BINST, POPA, {}});
+        compile_ir_top_to_a(compiled, &cached);
         code(compiled, (bytecode_t){BINST, CMPA, {}});
         code(compiled, bytecode_uli(BINSTRELLABEL, ir.kind == IR_JMPZ ? JMPRZ : JMPRNZ, ir.arg.num));
+        cached = 0;
         break;
       case IR_JMP:
+        compile_ir_spill(compiled, &cached);
         code(compiled, bytecode_uli(BINSTRELLABEL, JMPR, ir.arg.num));
         break;
       case IR_FUNCEND:
+        compile_ir_spill(compiled, &cached);
         code(compiled, (bytecode_t){BINST, RET, {}});
         break;
       case IR_ADDR_LOCAL:
@@ -4312,9 +7173,19 @@ void compile_ir_list(state_t *state, ir_t *irs, int ir_count) {
           int size = irs[iri + 1].arg.num;
           assert(size % 2 == 0);
           assert(ir.arg.loc.base % 2 == 0);
-          for (int i = 0; i < size; i += 2) {
-            code(compiled, (bytecode_t){BINSTHEX, PEEKAR, {.num = ir.arg.loc.base + size - 2}});
-            code(compiled, (bytecode_t){BINST, PUSHA, {}});
+          // the offsets count the cached slot as pushed, base 2 is the slot itself
+          if (cache && cached == 1 && size == 2 && ir.arg.loc.base > 2 && ir_binary_op_follows(irs, ir_count, iri + 2)) {
+            compile_ir_before_load(compiled, &cached, true);
+            code(compiled, (bytecode_t){BINSTHEX, PEEKAR, {.num = ir.arg.loc.base - 2}});
+          } else {
+            compile_ir_spill(compiled, &cached);
+            for (int i = 0; i < size; i += 2) {
+              if (i > 0) {
+                code(compiled, (bytecode_t){BINST, PUSHA, {}});
+              }
+              code(compiled, (bytecode_t){BINSTHEX, PEEKAR, {.num = ir.arg.loc.base + size - 2}});
+            }
+            cached = 1;
           }
           iri++;
         } else if (iri + 1 < ir_count && irs[iri + 1].kind == IR_WRITE && irs[iri + 1].arg.num > 1) {
@@ -4322,27 +7193,31 @@ void compile_ir_list(state_t *state, ir_t *irs, int ir_count) {
           assert(0 < size && size < 256);
           assert(ir.arg.loc.base % 2 == 0);
           for (int i = 0; i < size; i += 2) {
-            code(compiled, (bytecode_t){BINST, POPA, {}});
+            if (i > 0 || cached == 0) {
+              code(compiled, (bytecode_t){BINST, POPA, {}});
+            }
             code(compiled, (bytecode_t){BINSTHEX, PUSHAR, {.num = ir.arg.loc.base - 2}});
           }
+          cached = 0;
           iri++;
         } else {
+          compile_ir_spill(compiled, &cached);
           code(compiled, (bytecode_t){BINST, SP_A, {}});
           code(compiled, (bytecode_t){BINSTHEX2, RAM_B, {.num = ir.arg.loc.base}});
           code(compiled, (bytecode_t){BINST, SUM, {}});
-          code(compiled, (bytecode_t){BINST, PUSHA, {}});
+          cached = 1;
         }
         break;
       case IR_ADDR_GLOBAL:
+        compile_ir_before_load(compiled, &cached, cache && ir.arg.loc.offset == 0 && ir_binary_op_follows(irs, ir_count, iri + 1));
         code(compiled, bytecode_uli(BINSTLABEL, RAM_A, ir.arg.loc.base));
         if (ir.arg.loc.offset != 0) {
           code(compiled, (bytecode_t){BINSTHEX2, RAM_B, {.num = ir.arg.loc.offset}});
           code(compiled, (bytecode_t){BINST, SUM, {}});
         }
-        code(compiled, (bytecode_t){BINST, PUSHA, {}});
         break;
       case IR_WRITE:
-        code(compiled, (bytecode_t){BINST, POPB, {}});
+        code(compiled, (bytecode_t){BINST, cached == 1 ? A_B : POPB, {}});
         code(compiled, (bytecode_t){BINST, POPA, {}});
         if (ir.arg.num == 1) {
           code(compiled, (bytecode_t){BINST, AL_rB, {}});
@@ -4357,9 +7232,10 @@ void compile_ir_list(state_t *state, ir_t *irs, int ir_count) {
             code(compiled, (bytecode_t){BINST, A_rB, {}});
           }
         }
+        cached = 0;
         break;
       case IR_READ:
-        code(compiled, (bytecode_t){BINST, POPB, {}});
+        code(compiled, (bytecode_t){BINST, cached == 1 ? A_B : POPB, {}});
         if (ir.arg.num == 1) {
           code(compiled, (bytecode_t){BINST, rB_AL, {}});
         } else {
@@ -4378,11 +7254,21 @@ void compile_ir_list(state_t *state, ir_t *irs, int ir_count) {
             code(compiled, (bytecode_t){BINST, rB_A, {}});
           }
         }
-        code(compiled, (bytecode_t){BINST, PUSHA, {}});
+        cached = 1;
         break;
       case IR_CHANGE_SP:
-        compile_change_sp(state, ir.arg.num);
-        break;
+      {
+        // dropping the cached slot costs nothing
+        int delta = ir.arg.num;
+        if (cached == 1 && delta < 0) {
+          cached = 0;
+          delta += 2;
+        }
+        if (delta != 0) {
+          compile_ir_spill(compiled, &cached);
+          compile_change_sp(state, delta);
+        }
+      } break;
       case IR_INT:
       {
         int num = ir.arg.num;
@@ -4390,6 +7276,9 @@ void compile_ir_list(state_t *state, ir_t *irs, int ir_count) {
           num *= irs[iri + 1].arg.num;
           ++iri;
         }
+        // the ir rules fold in int, the word keeps the low 16 bits
+        num &= 0xFFFF;
+        compile_ir_before_load(compiled, &cached, cache && ir_binary_op_follows(irs, ir_count, iri + 1));
         // TODO: INTs in sequence
         // if (!(iri > 0 && irs[iri - 1].kind == IR_INT && irs[iri - 1].arg.num == num)) {
         if (0 <= num && num < 256) {
@@ -4398,158 +7287,74 @@ void compile_ir_list(state_t *state, ir_t *irs, int ir_count) {
           code(compiled, (bytecode_t){BINSTHEX2, RAM_A, {.num = num}});
         }
         //}
-        code(compiled, (bytecode_t){BINST, PUSHA, {}});
       } break;
       case IR_OPERATION:
         switch (ir.arg.inst) {
           case SUM:
           case SUB:
           case B_AH:
-            code(compiled, (bytecode_t){BINST, POPA, {}});
-            code(compiled, (bytecode_t){BINST, POPB, {}});
+            if (cached == 0) {
+              code(compiled, (bytecode_t){BINST, POPA, {}});
+            }
+            if (cached < 2) {
+              code(compiled, (bytecode_t){BINST, POPB, {}});
+            }
             code(compiled, (bytecode_t){BINST, ir.arg.inst, {}});
-            code(compiled, (bytecode_t){BINST, PUSHA, {}});
             break;
           case SHL:
           case SHR:
-            code(compiled, (bytecode_t){BINST, POPA, {}});
+            if (cached < 2) {
+              compile_ir_top_to_a(compiled, &cached);
+            }
             code(compiled, (bytecode_t){BINST, ir.arg.inst, {}});
-            code(compiled, (bytecode_t){BINST, PUSHA, {}});
             break;
           default:
             printf("%s\n", instruction_to_string(ir.arg.inst));
             TODO;
         }
+        if (ir.arg.inst != SHL && ir.arg.inst != SHR) {
+          cached = 1;
+        }
         break;
       case IR_MUL:
       case IR_DIV:
         if (ir.arg.num != 1) {
-          code(compiled, (bytecode_t){BINST, POPA, {}});
+          if (cached < 2) {
+            compile_ir_top_to_a(compiled, &cached);
+          }
           assert(ir.arg.num % 2 == 0);
           for (int i = 0; i < ir.arg.num; i += 2) {
             code(compiled, (bytecode_t){BINST, ir.kind == IR_MUL ? SHL : SHR, {}});
           }
-          code(compiled, (bytecode_t){BINST, PUSHA, {}});
         }
         break;
       case IR_CALL:
-        code(compiled, bytecode_with_sv(BINSTLABEL, CALL, ir.arg.sv));
+        compile_ir_spill(compiled, &cached);
+        code(compiled, bytecode_with_sv(BINSTLABEL, CALL, ir.arg.call.name));
         break;
       case IR_EXTERN:
+        compile_ir_spill(compiled, &cached);
         code(compiled, bytecode_with_sv(BEXTERN, 0, ir.arg.sv));
         break;
     }
+
+    if (!cache) {
+      compile_ir_spill(compiled, &cached);
+    }
   }
+  compile_ir_spill(compiled, &cached);
 }
 
-bool is_inst(bytecode_t *bs, int *b_count, int i, instruction_t inst) {
-  assert(bs);
-  return i >= 0 && i < *b_count && bs[i].inst == inst;
-}
-
-void optimize_asm(bytecode_t *bs, int *b_count, bool debug_opt, optlevel_t opt) {
-  assert(bs);
-  assert(b_count);
-
-  for (int i = 0; i < *b_count; ++i) {
-    // if ((is_inst(bs, b_count, i, PEEKAR) || is_inst(bs, b_count, i, PEEKA))
-    // && is_inst(bs, b_count, i + 1, A_B)) {
-    //   bs[i].inst = PEEKB;
-    //   memcpy(bs + i + 1, bs + i + 2, (b_count - i - 1) * sizeof(bs[0]));
-    // }
-    if (opt >= OL_BASE && is_inst(bs, b_count, i, PEEKAR) && bs[i].arg.num == 2) {
-      if (debug_opt) {
-        printf("  %03d | PEEKAR 2 -> PEEKA\n", i);
-      }
-
-      bs[i] = (bytecode_t){BINST, PEEKA, {}};
-    } else if (opt >= OL_BASE && is_inst(bs, b_count, i, PUSHA) && is_inst(bs, b_count, i + 1, POPA)) {
-      if (debug_opt) {
-        printf("  %03d | PUSHA POPA -> nothing\n", i);
-      }
-
-      memcpy(bs + i, bs + i + 2, (*b_count - i - 2) * sizeof(bytecode_t));
-      *b_count -= 2;
-      i = 0;
-    } else if (opt >= OL_BASE && is_inst(bs, b_count, i, PUSHA) && is_inst(bs, b_count, i + 1, POPB)) {
-      if (debug_opt) {
-        printf("  %03d | PUHSA POPB -> A_B\n", i);
-      }
-
-      bs[i].inst = A_B;
-      memcpy(bs + i + 1, bs + i + 2, (*b_count - i - 2) * sizeof(bs[0]));
-      *b_count -= 1;
-      i = 0;
-    } else if (opt >= OL_BASE && (is_inst(bs, b_count, i, RAM_A) || is_inst(bs, b_count, i, RAM_B))
-               && bs[i].arg.num < 256) {
-      if (debug_opt) {
-        printf("  %03d | RAM_A x | RAM_B x if x<256 -> RAM_AL x | RAM_BL x\n", i);
-      }
-
-      bs[i].inst = bs[i].inst == RAM_A ? RAM_AL : RAM_BL;
-      bs[i].kind = BINSTHEX;
-    } else if (opt >= OL_BASE && (is_inst(bs, b_count, i, SUM) || is_inst(bs, b_count, i, SUB))
-               && is_inst(bs, b_count, i + 1, CMPA)) {
-      if (debug_opt) {
-        printf("  %03d | SUM|SUB CMPA -> SUM|SUB\n", i);
-      }
-
-      *b_count -= 1;
-      memcpy(bs + i + 1, bs + i + 2, (*b_count - i) * sizeof(bytecode_t));
-      i = 0;
-    } else if (opt >= OL_BASE && is_inst(bs, b_count, i, PUSHA)
-               && (is_inst(bs, b_count, i + 1, RAM_A) || is_inst(bs, b_count, i + 1, RAM_AL))
-               && is_inst(bs, b_count, i + 2, POPB)) {
-      if (debug_opt) {
-        printf("  %03d | PUSHA RAM_A|RAM_AL POPB -> A_B RAM_A|RAM_AL\n", i); // TODO: add PEEKAR case
-      }
-
-      *b_count -= 1;
-      bs[i] = (bytecode_t){BINST, A_B, {}};
-      memcpy(bs + i + 2, bs + i + 3, (*b_count - i) * sizeof(bytecode_t));
-      i = 0;
-    } else if (opt >= OL_BASE && (is_inst(bs, b_count, i, RAM_A) || is_inst(bs, b_count, i, RAM_AL)) && is_inst(bs, b_count, i + 1, A_B)) {
-      if (debug_opt) {
-        printf("  %03d | RAM_A|RAM_AL A_B -> RAM_B|RAM_BL\n", i);
-      }
-
-      *b_count -= 1;
-      bs[i].inst = bs[i].inst == RAM_A ? RAM_B : RAM_BL;
-      memcpy(bs + i + 1, bs + i + 2, (*b_count - i) * sizeof(bytecode_t));
-      i = 0;
-      // TODO: RAM_A 0 SUB -> B_A CMPA?
-      //} else if ((is_inst(bs, b_count, i, RAM_A) || is_inst(bs, b_count, i, RAM_AL)) && bs[i].arg.num == 0 && is_inst(bs, b_count, i + 1, SUM)) {
-      //  if (debug_opt) {
-      //    printf("  %03d | RAM_A(0)|RAM_AL(0) SUB -> B_A\n", i);
-      //  }
-    } else if (opt >= OL_MATH
-               && (is_inst(bs, b_count, i, RAM_B) || is_inst(bs, b_count, i, RAM_BL))
-               && is_inst(bs, b_count, i + 1, RAM_AL)
-               && bs[i + 1].arg.num == 1
-               && (is_inst(bs, b_count, i + 2, SUM) || is_inst(bs, b_count, i + 2, SUB))) {
-      if (debug_opt) {
-        printf("  %03d | RAM_B x RAM_AL 1 SUB|SUM -> RAM_A x DECA|INCA", i);
-      }
-
-      *b_count -= 1;
-      bs[i].inst = bs[i].inst == RAM_B ? RAM_A : RAM_AL;
-      bs[i + 1] = (bytecode_t){BINST, bs[i + 2].inst == SUM ? INCA : DECA, {}};
-      memcpy(bs + i + 2, bs + i + 3, (*b_count - i) * sizeof(bytecode_t));
-      i = 0;
-    } else if (opt >= OL_MATH
-               && is_inst(bs, b_count, i, A_B)
-               && is_inst(bs, b_count, i + 1, RAM_AL)
-               && bs[i + 1].arg.num == 1
-               && (is_inst(bs, b_count, i + 2, SUM) || is_inst(bs, b_count, i + 2, SUB))) {
-      if (debug_opt) {
-        printf("  %03d | A_B RAM_AL 1 SUB|SUM -> DECA|INCA", i);
-      }
-
-      bs[i] = (bytecode_t){BINST, bs[i + 2].inst == SUM ? INCA : DECA, {}};
-      *b_count -= 2;
-      memcpy(bs + i + 1, bs + i + 3, (*b_count - i) * sizeof(bytecode_t));
-      i = 0;
-    }
+// a function at a time, for its trace span
+void compile_ir_functions(state_t *state, ir_t *irs, int ir_count, optlevel_t opt) {
+  compiled_t *compiled = &state->compiled;
+  for (int start = 0, end; start < ir_count; start = end) {
+    end = ir_function_end(irs, ir_count, start);
+    double trace_start = trace_begin();
+    int bytecodes = compiled->is_init ? compiled->init_num : compiled->code_num;
+    compile_ir_list(state, irs + start, end - start, opt);
+    bytecodes = (compiled->is_init ? compiled->init_num : compiled->code_num) - bytecodes;
+    trace_end("compile_ir", ir_function_name(irs, start), trace_start, 2, "ir", end - start, "bytecodes", bytecodes);
   }
 }
 
@@ -4557,7 +7362,7 @@ void help(int errorcode) {
   fprintf(stderr,
           "Usage: simpleC [options] [input-file-path]\n\n"
           "Options:\n"
-          " -d <module> | opt    enable debug options for a module or optimizers\n"
+          " -d <module> | opt    enable debug options for a module or the optimization remarks\n"
           " -D <module>          stop the execution after a module and print the output\n"
           "                        if module 'all' then it will execute only the tokenizer\n"
           " -e <string>          compile the string provided\n"
@@ -4570,7 +7375,16 @@ void help(int errorcode) {
           "                          - 1: base [default]\n"
           "                          - 2: math (simple calculations at compile time)\n"
           "                          - 3: smart addr (some semplifications in read an write operations)\n"
-          "                          - 4: all\n"
+          "                          - 4: all (constant propagation and dead code removal on the cfg, keeps the top of the stack in the registers)\n"
+          " --rules <file>       use the peephole rules in the file instead of the default ones\n"
+          " --print-rules        print the default peephole rules and exit\n"
+          " --rule-hits          print how many times every peephole rule was applied\n"
+          " --opt-stats          print the hits and savings of the optimizations and the missed ones\n"
+          " --export <function>  make the function GLOBAL and keep it even if main does not call it\n"
+          " --print-layouts      print the offset and size of the fields of every struct type\n"
+          " --bench <module>     time the module on the input and exit, only 'tok' and 'par'\n"
+          " --time-report[=json] print time, allocations and item counts of every phase\n"
+          " --trace-out <file>   write a chrome trace of the phases and of every function\n"
           " --dev                print the source code loc where the error is thrown\n"
           " -h | --help          print this page and exit\n\n"
           "Modules:\n"
@@ -4580,15 +7394,183 @@ void help(int errorcode) {
           "  par           parser\n"
           "  typ           typechecker\n"
           "  ir            ir\n"
+          "  cfg           control flow graph of the ir functions\n"
           "  com           compiler to assembly\n");
   exit(errorcode);
 }
 
+void bench_tokenizer(char *buffer, char *name) {
+  tokenizer_t tokenizer;
+  double start = time_now();
+  tokenizer_init(&tokenizer, buffer, name);
+  double time = time_now() - start;
+  int tokens = tokenizer.token_num - 1;
+  tokenizer_free(&tokenizer);
+  printf("tok: %d tokens, %.2f MB in %.3f s: %.0f tokens/s, %.1f MB/s\n",
+         tokens,
+         strlen(buffer) / 1e6,
+         time,
+         tokens / time,
+         strlen(buffer) / 1e6 / time);
+}
+
+void bench_parser(char *buffer, char *name) {
+  tokenizer_t tokenizer;
+  tokenizer_init(&tokenizer, buffer, name);
+  int tokens = tokenizer.token_num - 1;
+  int nodes = arenas[R_AST].alloc_num;
+  size_t bytes = arenas[R_AST].alloc_bytes;
+  double start = time_now();
+  parse(&tokenizer);
+  double time = time_now() - start;
+  nodes = arenas[R_AST].alloc_num - nodes;
+  bytes = arenas[R_AST].alloc_bytes - bytes;
+  tokenizer_free(&tokenizer);
+  printf("par: %d tokens, %d nodes (%zu bytes) in %.3f s: %.0f tokens/s, %.0f nodes/s\n",
+         tokens,
+         nodes,
+         bytes,
+         time,
+         tokens / time,
+         nodes / time);
+}
+
+typedef enum {
+  PH_TOKENIZE,
+  PH_PARSE,
+  PH_TYPECHECK,
+  PH_OPTIMIZE_AST,
+  PH_COMPILE,
+  PH_OPTIMIZE_IR,
+  PH_COMPILE_IR,
+  PH_OPTIMIZE_ASM,
+  PH_OUTPUT,
+  PH_COUNT,
+} phase_t;
+
+typedef struct {
+  char *name;
+  char *unit; // of the item counts
+  bool ran;
+  double time;
+  int alloc_num; // through alloc, in every region
+  size_t alloc_bytes;
+  long items_in; // -1 if not counted
+  long items_out;
+} phase_report_t;
+
+phase_report_t phase_reports[PH_COUNT] = {
+  [PH_TOKENIZE] = {"tokenize", "tokens", false, 0, 0, 0, -1, -1},
+  [PH_PARSE] = {"parse", "ast nodes", false, 0, 0, 0, -1, -1},
+  [PH_TYPECHECK] = {"typecheck", "types", false, 0, 0, 0, -1, -1},
+  [PH_OPTIMIZE_AST] = {"optimize_ast", "", false, 0, 0, 0, -1, -1},
+  [PH_COMPILE] = {"compile", "ir ops", false, 0, 0, 0, -1, -1},
+  [PH_OPTIMIZE_IR] = {"optimize_ir", "ir ops", false, 0, 0, 0, -1, -1},
+  [PH_COMPILE_IR] = {"compile_ir", "bytecodes", false, 0, 0, 0, -1, -1},
+  [PH_OPTIMIZE_ASM] = {"optimize_asm", "bytecodes", false, 0, 0, 0, -1, -1},
+  [PH_OUTPUT] = {"output", "bytes", false, 0, 0, 0, -1, -1},
+};
+
+struct {
+  double time;
+  int alloc_num;
+  size_t alloc_bytes;
+} phase_start;
+
+enum {
+  TIME_REPORT_NONE,
+  TIME_REPORT_TEXT,
+  TIME_REPORT_JSON,
+} time_report = TIME_REPORT_NONE;
+
+void phase_begin() {
+  phase_start.alloc_num = 0;
+  phase_start.alloc_bytes = 0;
+  for (int i = 0; i < R_COUNT; ++i) {
+    phase_start.alloc_num += arenas[i].alloc_num;
+    phase_start.alloc_bytes += arenas[i].alloc_bytes;
+  }
+  phase_start.time = time_now();
+}
+
+void phase_end(phase_t phase, long items_in, long items_out) {
+  assert(phase < PH_COUNT);
+  phase_report_t *report = &phase_reports[phase];
+  report->ran = true;
+  report->time += time_now() - phase_start.time;
+  for (int i = 0; i < R_COUNT; ++i) {
+    report->alloc_num += arenas[i].alloc_num;
+    report->alloc_bytes += arenas[i].alloc_bytes;
+  }
+  report->alloc_num -= phase_start.alloc_num;
+  report->alloc_bytes -= phase_start.alloc_bytes;
+  report->items_in = items_in;
+  report->items_out = items_out;
+  if (items_in >= 0) {
+    trace_end("phase", sv_from_cstr(report->name), phase_start.time, 2, "items_in", (int)items_in, "items_out", (int)items_out);
+  } else if (items_out >= 0) {
+    trace_end("phase", sv_from_cstr(report->name), phase_start.time, 1, "items_out", (int)items_out);
+  } else {
+    trace_end("phase", sv_from_cstr(report->name), phase_start.time, 0);
+  }
+}
+
+// at exit, so the runs stopped by -D report the phases they did
+void time_report_print() {
+  double total = 0;
+  if (time_report == TIME_REPORT_JSON) {
+    printf("{\"phases\": [");
+    bool first = true;
+    for (int i = 0; i < PH_COUNT; ++i) {
+      phase_report_t *r = &phase_reports[i];
+      if (!r->ran) {
+        continue;
+      }
+      total += r->time;
+      printf("%s\n  {\"name\": \"%s\", \"time_ms\": %.3f, \"allocs\": %d, \"alloc_bytes\": %zu",
+             first ? "" : ",",
+             r->name,
+             r->time * 1e3,
+             r->alloc_num,
+             r->alloc_bytes);
+      if (r->items_in >= 0) {
+        printf(", \"items_in\": %ld", r->items_in);
+      }
+      if (r->items_out >= 0) {
+        printf(", \"items_out\": %ld, \"unit\": \"%s\"", r->items_out, r->unit);
+      }
+      printf("}");
+      first = false;
+    }
+    printf("\n], \"total_ms\": %.3f}\n", total * 1e3);
+    return;
+  }
+
+  printf("TIME REPORT:\n");
+  printf("  %-13s %10s %8s %12s  %s\n", "phase", "time (ms)", "allocs", "bytes", "items");
+  for (int i = 0; i < PH_COUNT; ++i) {
+    phase_report_t *r = &phase_reports[i];
+    if (!r->ran) {
+      continue;
+    }
+    total += r->time;
+    printf("  %-13s %10.3f %8d %12zu", r->name, r->time * 1e3, r->alloc_num, r->alloc_bytes);
+    if (r->items_in >= 0) {
+      printf("  %ld -> %ld %s", r->items_in, r->items_out, r->unit);
+    } else if (r->items_out >= 0) {
+      printf("  %ld %s", r->items_out, r->unit);
+    }
+    printf("\n");
+  }
+  printf("  %-13s %10.3f\n", "total", total * 1e3);
+}
+
 typedef enum {
   M_TOK,
   M_PAR,
   M_TYP,
   M_IR,
+  M_CFG,
   M_COM,
   M_COUNT,
 } module_t;
@@ -4606,6 +7588,8 @@ uint8_t parse_module(char *str) {
     return 1 << M_TYP;
   } else if (strcmp(str, "ir") == 0) {
     return 1 << M_IR;
+  } else if (strcmp(str, "cfg") == 0) {
+    return 1 << M_CFG;
   } else if (strcmp(str, "com") == 0) {
     return 1 << M_COM;
   } else {
@@ -4627,10 +7611,14 @@ int main(int argc, char **argv) {
   char *input = NULL;
 
   optlevel_t opt = 1;
-  uint8_t debug_opt = 0;
   assert(M_COUNT < 8);
   uint8_t debug = 0;
   uint8_t exitat = 0;
+  char *rules_file = NULL;
+  uint8_t bench = 0;
+  bool rule_hits = false;
+  bool print_layouts = false;
+  char *trace_out = NULL;
 
   char *arg = NULL;
   ++argv;
@@ -4645,7 +7633,7 @@ int main(int argc, char **argv) {
             help(1);
           }
           if (strcmp(*argv, "opt") == 0) {
-            debug_opt = 1;
+            remarks.print = true;
           } else {
             debug |= parse_module(*argv);
           }
@@ -4687,8 +7675,8 @@ int main(int argc, char **argv) {
           break;
         case 'O':
           opt = atoi(arg + 2);
-          if (opt > OL_COUNT) {
-            fprintf(stderr, "ERROR: invalid optimize level: %d, max: %d\n", opt, OL_COUNT);
+          if (opt >= OL_COUNT) {
+            fprintf(stderr, "ERROR: invalid optimize level: %d, max: %d\n", opt, OL_COUNT - 1);
             help(1);
           }
           ++argv;
@@ -4703,6 +7691,69 @@ int main(int argc, char **argv) {
             dev_flag = true;
             ++argv;
             break;
+          } else if (strcmp(arg + 2, "rules") == 0) {
+            ++argv;
+            if (!*argv) {
+              fprintf(stderr, "ERROR: --rules expects a file\n");
+              help(1);
+            }
+            rules_file = *argv;
+            ++argv;
+            break;
+          } else if (strcmp(arg + 2, "print-rules") == 0) {
+            printf("%s", default_rules);
+            exit(0);
+          } else if (strcmp(arg + 2, "bench") == 0) {
+            ++argv;
+            if (!*argv) {
+              fprintf(stderr, "ERROR: --bench expects a module name\n");
+              help(1);
+            }
+            bench = parse_module(*argv);
+            if (bench != 1 << M_TOK && bench != 1 << M_PAR) {
+              fprintf(stderr, "ERROR: --bench supports only 'tok' and 'par'\n");
+              help(1);
+            }
+            ++argv;
+            break;
+          } else if (strcmp(arg + 2, "rule-hits") == 0) {
+            rule_hits = true;
+            ++argv;
+            break;
+          } else if (strcmp(arg + 2, "opt-stats") == 0) {
+            remarks.stats = true;
+            ++argv;
+            break;
+          } else if (strcmp(arg + 2, "print-layouts") == 0) {
+            print_layouts = true;
+            ++argv;
+            break;
+          } else if (strcmp(arg + 2, "time-report") == 0) {
+            time_report = TIME_REPORT_TEXT;
+            ++argv;
+            break;
+          } else if (strcmp(arg + 2, "time-report=json") == 0) {
+            time_report = TIME_REPORT_JSON;
+            ++argv;
+            break;
+          } else if (strcmp(arg + 2, "export") == 0) {
+            ++argv;
+            if (!*argv) {
+              fprintf(stderr, "ERROR: --export expects a function name\n");
+              help(1);
+            }
+            DA_APPEND(exports.names, exports.num, exports.cap, sv_from_cstr(*argv));
+            ++argv;
+            break;
+          } else if (strcmp(arg + 2, "trace-out") == 0) {
+            ++argv;
+            if (!*argv) {
+              fprintf(stderr, "ERROR: --trace-out expects a file\n");
+              help(1);
+            }
+            trace_out = *argv;
+            ++argv;
+            break;
           }
           __attribute__((fallthrough));
         default:
@@ -4720,9 +7771,27 @@ int main(int argc, char **argv) {
     }
   }
 
+  if (time_report != TIME_REPORT_NONE) {
+    assert(atexit(time_report_print) == 0);
+  }
+  if (trace_out) {
+    trace.file = fopen(trace_out, "w");
+    if (!trace.file) {
+      fprintf(stderr, "ERROR: cannot open file '%s': %s\n", trace_out, strerror(errno));
+      exit(1);
+    }
+    trace.origin = time_now();
+    assert(atexit(trace_write) == 0);
+  }
+
+  if (rules_file) {
+    rules_load_file(rules_file);
+  } else {
+    rules_load("default rules", default_rules);
+  }
+
   tokenizer_t tokenizer = {0};
   state_t state;
-  state_init(&state);
   ast_t *ast;
   char *buffer = NULL;
   char *name = NULL;
@@ -4738,7 +7807,7 @@ int main(int argc, char **argv) {
       fseek(file, 0, SEEK_END);
       int size = ftell(file);
       fseek(file, 0, SEEK_SET);
-      buffer = alloc(size + 1);
+      buffer = alloc(R_TOKEN, size + 1);
       fread(buffer, 1, size, file);
       buffer[size] = 0;
       assert(fclose(file) == 0);
@@ -4749,54 +7818,69 @@ int main(int argc, char **argv) {
       break;
   };
 
+  if ((bench >> M_TOK) & 1) {
+    bench_tokenizer(buffer, name);
+    exit(0);
+  }
+  if ((bench >> M_PAR) & 1) {
+    bench_parser(buffer, name);
+    exit(0);
+  }
+
+  phase_begin();
   tokenizer_init(&tokenizer, buffer, name);
+  phase_end(PH_TOKENIZE, -1, tokenizer.token_num - 1);
   if ((debug >> M_TOK) & 1) {
     printf("TOKENS:\n");
     token_t token;
     while ((token = token_next(&tokenizer)).kind != T_NONE) {
       token_dump(token);
     }
-    tokenizer_init(&tokenizer, buffer, name);
+    tokenizer.pos = 0;
   }
   if ((exitat >> M_TOK) & 1) {
     exit(0);
   }
 
+  phase_begin();
+  int nodes = arenas[R_AST].alloc_num;
   ast = parse(&tokenizer);
+  phase_end(PH_PARSE, -1, arenas[R_AST].alloc_num - nodes);
+  tokenizer_free(&tokenizer);
   if ((debug >> M_PAR) & 1) {
     printf("AST:\n");
     ast_dump_tree(ast, false, 0);
     printf("\n");
+    free_region(R_STRING);
   }
   if ((exitat >> M_PAR) & 1) {
     exit(0);
   }
 
+  phase_begin();
   state_init(&state);
   typecheck(ast, &state);
+  phase_end(PH_TYPECHECK, -1, type_table.type_num);
   if (opt > OL_NONE) {
-    if (debug_opt) {
-      printf("OPTIMIZE AST:\n");
-    }
-    optimize_ast(&ast, debug_opt, opt);
+    phase_begin();
+    optimize_ast(&ast, &state, opt);
+    phase_end(PH_OPTIMIZE_AST, -1, -1);
   }
   if ((debug >> M_TYP) & 1) {
     printf("TYPED AST:\n");
     ast_dump_tree(ast, true, 0);
     printf("\n");
+    free_region(R_STRING);
+  }
+  if (print_layouts) {
+    state_print_layouts(&state);
   }
   if ((exitat >> M_TYP) & 1) {
     exit(0);
   }
 
-  scope_t *scope = &state.scopes[0];
-  symbol_t *main_symbol = NULL;
-  for (int i = 0; i < scope->symbol_num; ++i) {
-    if (sv_eq(scope->symbols[i].name.image, sv_from_cstr("main"))) {
-      main_symbol = &scope->symbols[i];
-      break;
-    }
-  }
+  symbol_t *main_symbol = state_lookup_symbol(&state, sv_from_cstr("main"));
+  // typecheck dropped all the inner scopes, only the globals are still visible
   if (!main_symbol) {
     fprintf(stderr, "ERROR: no main function found\n");
     exit(1);
@@ -4806,15 +7890,32 @@ int main(int argc, char **argv) {
     exit(1);
   }
 
-  state_init_with_compiled(&state);
+  phase_begin();
+  state_reset_for_compile(&state);
+  for (int i = 0; i < exports.num; ++i) {
+    data(&state.compiled, bytecode_with_sv(BGLOBAL, 0, exports.names[i]));
+  }
   compile(ast, &state);
+  phase_end(PH_COMPILE, -1, state.ir_init_num + state.ir_num);
+  for (int i = 0; i < exports.num; ++i) {
+    if (ir_find_function(state.irs, state.ir_num, exports.names[i]) < 0) {
+      fprintf(stderr, "ERROR: --export '" SV_FMT "' is not a function defined in the input\n", SV_UNPACK(exports.names[i]));
+      exit(1);
+    }
+  }
+  // the ir doesn't reference ast nodes or types
+  free_region(R_AST);
+  free_region(R_TYPE);
+  type_table_free();
+  free_region(R_STRING);
 
   if (opt > OL_NONE) {
-    if (debug_opt) {
-      printf("OPTIMIZE IR:\n");
-    }
-    optimize_ir(state.irs_init, &state.ir_init_num, debug_opt, opt);
-    optimize_ir(state.irs, &state.ir_num, debug_opt, opt);
+    phase_begin();
+    int irs = state.ir_init_num + state.ir_num;
+    optimize_ir(state.irs_init, &state.ir_init_num, opt);
+    optimize_ir(state.irs, &state.ir_num, opt);
+    ir_remove_unused_functions(state.irs, &state.ir_num, state.irs_init, state.ir_init_num);
+    phase_end(PH_OPTIMIZE_IR, irs, state.ir_init_num + state.ir_num);
   }
   if ((debug >> M_IR) & 1) {
     printf("IR INIT:\n");
@@ -4832,11 +7933,23 @@ int main(int argc, char **argv) {
   if ((exitat >> M_IR) & 1) {
     exit(0);
   }
+  if ((debug >> M_CFG) & 1) {
+    printf("CFG:\n");
+    for (int start = 0, end; start < state.ir_num; start = end) {
+      end = ir_function_end(state.irs, state.ir_num, start);
+      cfg_dump(state.irs + start, end - start);
+    }
+    printf("\n");
+  }
+  if ((exitat >> M_CFG) & 1) {
+    exit(0);
+  }
 
+  phase_begin();
   state.compiled.is_init = true;
-  compile_ir_list(&state, state.irs_init, state.ir_init_num);
+  compile_ir_functions(&state, state.irs_init, state.ir_init_num, opt);
   state.compiled.is_init = false;
-  compile_ir_list(&state, state.irs, state.ir_num);
+  compile_ir_functions(&state, state.irs, state.ir_num, opt);
 
   state.compiled.is_init = true;
   code(&state.compiled, (bytecode_t){BINSTHEX, RAM_AL, {.num = 0}});
@@ -4845,13 +7958,21 @@ int main(int argc, char **argv) {
   code(&state.compiled, (bytecode_t){BINST, POPA, {}});
   code(&state.compiled, bytecode_with_string(BINSTLABEL, CALL, "exit"));
   state.compiled.is_init = false;
+  phase_end(PH_COMPILE_IR, -1, state.compiled.init_num + state.compiled.code_num);
 
   if (opt > OL_NONE) {
-    if (debug_opt) {
-      printf("OPTIMIZE ASM:\n");
-    }
-    optimize_asm(state.compiled.code, &state.compiled.code_num, debug_opt, opt);
-    optimize_asm(state.compiled.init, &state.compiled.init_num, debug_opt, opt);
+    phase_begin();
+    compiled_remove_unused_data(&state.compiled);
+    int bytecodes = state.compiled.init_num + state.compiled.code_num;
+    optimize_asm(state.compiled.code, &state.compiled.code_num, opt);
+    optimize_asm(state.compiled.init, &state.compiled.init_num, opt);
+    phase_end(PH_OPTIMIZE_ASM, bytecodes, state.compiled.init_num + state.compiled.code_num);
+  }
+  if (rule_hits) {
+    rules_print_hits();
+  }
+  if (remarks.stats) {
+    opt_stats_print();
   }
   if ((debug >> M_COM) & 1) {
     printf("ASSEMBLY:\n");
@@ -4861,14 +7982,11 @@ int main(int argc, char **argv) {
     exit(0);
   }
 
-  if (input_kind == INPUT_FILE) {
-    free_ptr(buffer);
-  }
-
   if (!output) {
     output = "out.asm";
   }
 
+  phase_begin();
   FILE *file = fopen(output, "w");
   if (!file) {
     fprintf(stderr, "cannot open file '%s': '%s'", output, strerror(errno));
@@ -4890,7 +8008,9 @@ int main(int argc, char **argv) {
     fputc(' ', file);
   }
 
+  long bytes = ftell(file);
   assert(fclose(file) == 0);
+  phase_end(PH_OUTPUT, -1, bytes);
 
   return 0;
 }